@@ -0,0 +1,200 @@
+/**
+ * @file accesslog.c
+ *
+ * @brief Asynchronous access log
+ *
+ * @details Threads log lines into their own ring buffer, which costs a copy and neither locks nor system calls. A
+ * writer thread drains all rings periodically, writing the pending data of each ring directly out of it with a single
+ * writev, so logging batches into large writes and a slow log file never stalls the threads logging. When a ring is
+ * full, lines are dropped and counted rather than waiting for the writer.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+
+#include "accesslog.h"
+
+struct accesslog_s {
+    int fd;
+    int interval; // milliseconds
+    int wakeup; // eventfd signalled by producers whose ring became half full
+    int stopping; // accessed atomically
+    pthread_t thread;
+    size_t ring_ln;
+    accesslog_ring_t *rings;
+};
+
+/**
+ * @brief Writes the pending lines of a ring
+ * @details Lines which cannot be written are discarded, so a failing log file does not fill the ring for good.
+ * @param log log the ring belongs to
+ * @param ring ring to drain
+ */
+static void drain_ring(accesslog_t *log, accesslog_ring_t *ring) {
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    while (tail != head) {
+        // The pending data wraps around the end of the ring at most once
+        size_t start = tail & (ring->size - 1);
+        size_t ln = head - tail;
+        struct iovec iov[2] = {
+            { .iov_base = &ring->data[start], .iov_len = ln < ring->size - start ? ln : ring->size - start },
+            { .iov_base = ring->data, .iov_len = 0 }
+        };
+        iov[1].iov_len = ln - iov[0].iov_len;
+
+        ssize_t write_ln = writev(log->fd, iov, iov[1].iov_len > 0 ? 2 : 1);
+        if (write_ln == -1 && errno == EINTR) {
+            continue;
+        } else if (write_ln <= 0) {
+            perror("Failed to write access log");
+            tail = head;
+            break;
+        }
+        tail += write_ln;
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped != ring->reported) {
+        fprintf(stderr, "Access log dropped %llu lines\n", (unsigned long long) (dropped - ring->reported));
+        ring->reported = dropped;
+    }
+}
+
+/**
+ * @brief Entry point of the writer thread
+ * @details Drains all rings every interval, or earlier when woken up, until the log is destroyed. The rings are
+ * drained a last time before the thread returns.
+ * @param arg accesslog_t of the thread
+ * @return NULL
+ */
+static void *accesslog_run(void *arg) {
+    accesslog_t *log = arg;
+    struct pollfd wakeup = { .fd = log->wakeup, .events = POLLIN };
+    while (!__atomic_load_n(&log->stopping, __ATOMIC_ACQUIRE)) {
+        if (poll(&wakeup, 1, log->interval) > 0) {
+            uint64_t count;
+            if (read(log->wakeup, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+                perror("Failed to reset access log event");
+            }
+        }
+        for (size_t i = 0; i < log->ring_ln; i++) {
+            drain_ring(log, &log->rings[i]);
+        }
+    }
+
+    for (size_t i = 0; i < log->ring_ln; i++) {
+        drain_ring(log, &log->rings[i]);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Frees the rings of a log
+ * @param log log whose rings are freed
+ */
+static void free_rings(accesslog_t *log) {
+    for (size_t i = 0; i < log->ring_ln; i++) {
+        free(log->rings[i].data);
+    }
+    free(log->rings);
+}
+
+accesslog_t *accesslog_create(int fd, size_t ring_ln, size_t ring_size, int interval) {
+    accesslog_t *log = malloc(sizeof(accesslog_t));
+    if (log == NULL) {
+        return NULL;
+    }
+    log->fd = fd;
+    log->interval = interval;
+    log->stopping = 0;
+    log->ring_ln = 0;
+    log->rings = calloc(ring_ln, sizeof(accesslog_ring_t));
+    if (log->rings == NULL) {
+        free(log);
+        return NULL;
+    }
+
+    size_t size = 1;
+    while (size < ring_size) {
+        size *= 2;
+    }
+    for (; log->ring_ln < ring_ln; log->ring_ln++) {
+        accesslog_ring_t *ring = &log->rings[log->ring_ln];
+        ring->data = malloc(size);
+        if (ring->data == NULL) {
+            free_rings(log);
+            free(log);
+            return NULL;
+        }
+        ring->size = size;
+        ring->log = log;
+    }
+
+    log->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (log->wakeup == -1) {
+        free_rings(log);
+        free(log);
+        return NULL;
+    }
+
+    int err_code = pthread_create(&log->thread, NULL, accesslog_run, log);
+    if (err_code != 0) {
+        close(log->wakeup);
+        free_rings(log);
+        free(log);
+        errno = err_code;
+        return NULL;
+    }
+    return log;
+}
+
+void accesslog_destroy(accesslog_t *log) {
+    __atomic_store_n(&log->stopping, 1, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if (write(log->wakeup, &one, sizeof(one)) == -1) {
+        perror("Failed to stop access log");
+    }
+    pthread_join(log->thread, NULL);
+    close(log->wakeup);
+    close(log->fd);
+    free_rings(log);
+    free(log);
+}
+
+accesslog_ring_t *accesslog_ring(accesslog_t *log, size_t i) {
+    return &log->rings[i];
+}
+
+int accesslog_write(accesslog_ring_t *ring, const char *line, size_t ln) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint64_t used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (ring->size - used < ln) {
+        __atomic_store_n(&ring->dropped, __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    size_t start = head & (ring->size - 1);
+    size_t first = ln < ring->size - start ? ln : ring->size - start;
+    memcpy(&ring->data[start], line, first);
+    memcpy(ring->data, &line[first], ln - first);
+    __atomic_store_n(&ring->head, head + ln, __ATOMIC_RELEASE);
+
+    // Only the write which fills the ring past its half wakes the writer, so bursts do not wait for the interval
+    if (used < ring->size / 2 && used + ln >= ring->size / 2) {
+        uint64_t one = 1;
+        if (write(ring->log->wakeup, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+            perror("Failed to wake access log");
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,66 @@
+#ifndef UE3_ACCESSLOG_H
+#define UE3_ACCESSLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Struct representing an access log, written by a background thread
+ */
+typedef struct accesslog_s accesslog_t;
+
+/**
+ * Struct representing the buffer a single thread logs into
+ * A ring of bytes with a single producer and the writer thread as single consumer. Positions only grow, they are
+ * reduced modulo size when accessing data.
+ */
+typedef struct {
+    char *data;
+    size_t size; // power of two
+    uint64_t head; // end of the logged lines, written by the producer, accessed atomically
+    uint64_t tail; // end of the written lines, written by the writer thread, accessed atomically
+    uint64_t dropped; // lines which did not fit, written by the producer, accessed atomically
+    uint64_t reported; // dropped lines the writer thread has reported already
+    accesslog_t *log;
+} accesslog_ring_t;
+
+/**
+ * @brief Creates an access log
+ * @details Starts the writer thread, which writes the lines logged into the rings to fd every interval milliseconds,
+ * or as soon as a ring is half full. Lines which do not fit into their ring are dropped and reported on stderr.
+ * @param fd file descriptor to write to, closed when the log is destroyed
+ * @param ring_ln number of rings, one for each thread logging
+ * @param ring_size size of each ring, rounded up to a power of two
+ * @param interval milliseconds between writes
+ * @return new log, NULL on failure
+ */
+accesslog_t *accesslog_create(int fd, size_t ring_ln, size_t ring_size, int interval);
+
+/**
+ * @brief Destroys an access log
+ * @details Stops the writer thread after it has written all logged lines and closes the file descriptor. No thread
+ * may log anymore.
+ * @param log log to destroy
+ */
+void accesslog_destroy(accesslog_t *log);
+
+/**
+ * @brief Returns a ring of an access log
+ * @param log log the ring belongs to
+ * @param i index of the ring
+ * @return ring to be used by a single thread
+ */
+accesslog_ring_t *accesslog_ring(accesslog_t *log, size_t i);
+
+/**
+ * @brief Logs a line
+ * @details Copies line into the ring without blocking. If the ring is full, the line is dropped and counted instead.
+ * Must only be called by the thread owning the ring.
+ * @param ring ring of the calling thread
+ * @param line line to log, including its line break
+ * @param ln length of line
+ * @return 0 on success, -1 if the line has been dropped
+ */
+int accesslog_write(accesslog_ring_t *ring, const char *line, size_t ln);
+
+#endif //UE3_ACCESSLOG_H
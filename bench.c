@@ -0,0 +1,466 @@
+/**
+ * @file bench.c
+ *
+ * @brief HTTP Load Generator
+ *
+ * @details Drives a URL with a number of concurrent connections for a fixed duration, using the client functions of
+ * http.c. Every connection is served by its own thread, sends DEPTH requests at once and waits for
+ * all of their responses. Latencies are recorded in a histogram with logarithmic buckets, so percentiles stay
+ * accurate to below one percent with constant memory, no matter how many requests are measured.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "http.h"
+
+/**
+ * Bits of the linear sub-buckets within each power of two, 8 bits keep the relative error below 1 %
+ */
+#define HIST_SUB_BITS 8
+
+/**
+ * Number of histogram buckets, covering all 64 bit values
+ */
+#define HIST_BUCKETS ((1 << HIST_SUB_BITS) + (64 - HIST_SUB_BITS) * (1 << (HIST_SUB_BITS - 1)))
+
+/**
+ * Seconds a connection may block on the server, so threads notice the end of the test
+ */
+#define SOCKET_TIMEOUT 2
+
+/**
+ * Structure that represents a latency histogram in nanoseconds
+ */
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+} histogram_t;
+
+/**
+ * Structure that represents all passed arguments
+ */
+typedef struct {
+    char *port;
+    char *url;
+    char *host;
+    char *path;
+    long connections;
+    long duration;
+    long depth;
+    int keep_alive;
+} args_t;
+
+/**
+ * Structure that represents a connection thread and its results
+ */
+typedef struct {
+    args_t *args;
+    pthread_t thread;
+    histogram_t hist;
+    uint64_t requests;
+    uint64_t bytes;
+    uint64_t connect_errors;
+    uint64_t io_errors;
+    uint64_t status_errors;
+} bench_conn_t;
+
+/**
+ * Set once the duration is over, accessed atomically
+ */
+static int stop = 0;
+
+/**
+ * @brief Prints usage text to stderr
+ * @details Print usage text to stderr, using binary name from argument binary.
+ * @param binary Represents the name of the binary, should probably be argv[0].
+ */
+static void print_usage(char *binary) {
+    fprintf(stderr, "Usage: %s [-p PORT] [-c CONNECTIONS] [-d SECONDS] [-P DEPTH] [-C] URL\n", binary);
+}
+
+/**
+ * @brief Parses a positive number
+ * @param str string to parse
+ * @param value parsed number will be written here
+ * @return 0 on success, -1 on failure
+ */
+static int parse_positive(const char *str, long *value) {
+    char *endptr;
+    errno = 0;
+    *value = strtol(str, &endptr, 10);
+    return errno != 0 || endptr == str || *endptr != '\0' || *value < 1 ? -1 : 0;
+}
+
+/**
+ * Parse arguments
+ * @brief Parses arguments from the command line
+ * @details Parses the arguments p, c, d, P and C, and splits the URL into host and path.
+ * @param argc argc which gets passed to main
+ * @param argv argv which gets passed to main
+ * @param args args_t struct where the parsed arguments will be stored
+ * @return 0 on success, -1 on failure
+ */
+static int parse_args(int argc, char **argv, args_t *args) {
+    // Define defaults if they are not set below
+    args->port = "80";
+    args->connections = 8;
+    args->duration = 10;
+    args->depth = 1;
+    args->keep_alive = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:c:d:P:C")) != -1) {
+        switch (opt) {
+            case 'p': {
+                long port;
+                if (parse_positive(optarg, &port) == -1) {
+                    return -1;
+                }
+                args->port = optarg;
+                break;
+            }
+            case 'c':
+                if (parse_positive(optarg, &args->connections) == -1) {
+                    return -1;
+                }
+                break;
+            case 'd':
+                if (parse_positive(optarg, &args->duration) == -1) {
+                    return -1;
+                }
+                break;
+            case 'P':
+                if (parse_positive(optarg, &args->depth) == -1) {
+                    return -1;
+                }
+                break;
+            case 'C':
+                args->keep_alive = 0;
+                break;
+            default:
+                return -1;
+        }
+    }
+
+    // Pipelining needs a persistent connection
+    if (optind + 1 != argc || (!args->keep_alive && args->depth > 1)) {
+        return -1;
+    }
+
+    args->url = argv[optind];
+    if (strncmp(args->url, "http://", 7) != 0) {
+        return -1;
+    }
+    unsigned long host_ln = strcspn(&args->url[7], ";/?:@=&");
+    args->host = strndup(&args->url[7], host_ln);
+    args->path = &args->url[7 + host_ln];
+    return args->host == NULL ? -1 : 0;
+}
+
+/**
+ * @brief Returns the time of the monotonic clock in nanoseconds
+ */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Returns the histogram bucket of a value
+ * @details Values below 2^HIST_SUB_BITS have a bucket each. Above, every power of two is split into
+ * 2^(HIST_SUB_BITS - 1) linear buckets.
+ * @param value value to look up
+ * @return index of the bucket
+ */
+static size_t hist_index(uint64_t value) {
+    if (value < (1 << HIST_SUB_BITS)) {
+        return value;
+    }
+    int shift = 63 - __builtin_clzll(value) - (HIST_SUB_BITS - 1);
+    size_t half = 1 << (HIST_SUB_BITS - 1);
+    return (1 << HIST_SUB_BITS) + (shift - 1) * half + (value >> shift) - half;
+}
+
+/**
+ * @brief Returns the highest value of a histogram bucket
+ * @param index index of the bucket
+ * @return highest value which falls into the bucket
+ */
+static uint64_t hist_value(size_t index) {
+    if (index < (1 << HIST_SUB_BITS)) {
+        return index;
+    }
+    size_t half = 1 << (HIST_SUB_BITS - 1);
+    size_t offset = index - (1 << HIST_SUB_BITS);
+    int shift = offset / half + 1;
+    uint64_t lowest = (uint64_t) (offset % half + half) << shift;
+    return lowest + ((uint64_t) 1 << shift) - 1;
+}
+
+/**
+ * @brief Records a value in a histogram
+ * @param hist histogram to record in
+ * @param value value to record
+ */
+static void hist_record(histogram_t *hist, uint64_t value) {
+    hist->counts[hist_index(value)]++;
+    hist->min = hist->total == 0 || value < hist->min ? value : hist->min;
+    hist->max = value > hist->max ? value : hist->max;
+    hist->total++;
+}
+
+/**
+ * @brief Adds all values of a histogram to another
+ * @param hist histogram to add to
+ * @param other histogram to add
+ */
+static void hist_merge(histogram_t *hist, const histogram_t *other) {
+    if (other->total == 0) {
+        return;
+    }
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        hist->counts[i] += other->counts[i];
+    }
+    hist->min = hist->total == 0 || other->min < hist->min ? other->min : hist->min;
+    hist->max = other->max > hist->max ? other->max : hist->max;
+    hist->total += other->total;
+}
+
+/**
+ * @brief Returns a percentile of a histogram
+ * @param hist histogram to query
+ * @param percentile percentile between 0 and 100
+ * @return value below or at which percentile percent of the recorded values are
+ */
+static uint64_t hist_percentile(const histogram_t *hist, double percentile) {
+    uint64_t rank = (uint64_t) (percentile / 100 * hist->total + 0.5);
+    rank = rank < 1 ? 1 : rank;
+    uint64_t count = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        count += hist->counts[i];
+        if (count >= rank) {
+            return hist_value(i) < hist->max ? hist_value(i) : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+/**
+ * @brief Opens a connection for the benchmark
+ * @details A receive timeout makes blocking reads return, so a stalled server cannot keep the thread past the end.
+ * @param conn connection thread
+ * @return connection, NULL on failure
+ */
+static http_conn *bench_connect(bench_conn_t *conn) {
+    const char *err = NULL;
+    http_conn *connection = http_conn_connect(conn->args->host, conn->args->port, &err);
+    if (connection == NULL) {
+        conn->connect_errors++;
+        return NULL;
+    }
+    struct timeval timeout = { .tv_sec = SOCKET_TIMEOUT, .tv_usec = 0 };
+    setsockopt(connection->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return connection;
+}
+
+/**
+ * @brief Receives a response completely
+ * @param conn connection thread, whose counters are updated
+ * @param connection connection to read from
+ * @param keep_alive whether the connection can be used for further requests will be written here
+ * @return 0 on success, -1 on failure
+ */
+static int bench_recv(bench_conn_t *conn, http_conn *connection, int *keep_alive) {
+    http_res res;
+    if (http_conn_recv_res(connection, &res) != 0) {
+        conn->io_errors++;
+        return -1;
+    }
+    conn->bytes += strlen(res.raw);
+    if (res.status_code.code < 200 || res.status_code.code >= 400) {
+        conn->status_errors++;
+    }
+
+    char buffer[16384];
+    ssize_t read_ln;
+    while ((read_ln = http_conn_recv_body(connection, &res, buffer, sizeof(buffer))) > 0) {
+        conn->bytes += read_ln;
+    }
+    *keep_alive = res.keep_alive && (res.chunked || res.content_length != -1);
+    free_http_res(&res);
+    if (read_ln < 0) {
+        conn->io_errors++;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Entry point of a connection thread
+ * @details Sends batches of requests until the test is stopped. The latency of a request is measured from sending its
+ * batch until its response has been received completely.
+ * @param arg bench_conn_t of the thread
+ * @return NULL
+ */
+static void *bench_worker(void *arg) {
+    bench_conn_t *conn = arg;
+    args_t *args = conn->args;
+    http_req req = {
+            .path = args->path,
+            .method = HTTP_GET,
+            .header = (http_header[]) { { .key = "Host", .value = args->host } },
+            .header_ln = 1,
+            .keep_alive = args->keep_alive
+    };
+
+    http_conn *connection = NULL;
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        if (connection == NULL && (connection = bench_connect(conn)) == NULL) {
+            // Avoid spinning while the server refuses connections
+            usleep(1000);
+            continue;
+        }
+
+        uint64_t start = now_ns();
+        int failed = 0;
+        for (long i = 0; i < args->depth && !failed; i++) {
+            failed = http_conn_send_req(connection, &req) == -1;
+        }
+        if (failed) {
+            conn->io_errors++;
+            http_conn_close(connection);
+            connection = NULL;
+            continue;
+        }
+
+        // Requests pipelined behind a response which closes the connection are not answered
+        int keep_alive = 1;
+        for (long i = 0; i < args->depth && !failed && keep_alive; i++) {
+            failed = bench_recv(conn, connection, &keep_alive) == -1;
+            if (!failed) {
+                hist_record(&conn->hist, now_ns() - start);
+                conn->requests++;
+            }
+        }
+        if (failed || !keep_alive || !args->keep_alive) {
+            http_conn_close(connection);
+            connection = NULL;
+        }
+    }
+
+    if (connection != NULL) {
+        http_conn_close(connection);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Formats a duration in a human readable unit
+ * @param buf buffer of at least 16 bytes
+ * @param ns duration in nanoseconds
+ * @return buf
+ */
+static char *format_duration(char *buf, uint64_t ns) {
+    if (ns < 1000) {
+        snprintf(buf, 16, "%lluns", (unsigned long long) ns);
+    } else if (ns < 1000000) {
+        snprintf(buf, 16, "%.2fus", ns / 1e3);
+    } else if (ns < 1000000000) {
+        snprintf(buf, 16, "%.2fms", ns / 1e6);
+    } else {
+        snprintf(buf, 16, "%.2fs", ns / 1e9);
+    }
+    return buf;
+}
+
+/**
+ * Main entrypoint.
+ * @brief Main entry point
+ * @details Main entry point. This is where the program will start from.
+ * @param argc argc passed to program
+ * @param argv argv passed to program
+ * @return exit code
+ */
+int main(int argc, char **argv) {
+    args_t args;
+    if (parse_args(argc, argv, &args) == -1) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    bench_conn_t *conns = calloc(args.connections, sizeof(bench_conn_t));
+    if (conns == NULL) {
+        perror("Failed to allocate memory");
+        return EXIT_FAILURE;
+    }
+
+    printf("Running %lds test @ %s\n", args.duration, args.url);
+    printf("  %ld connections, pipeline depth %ld, %s\n", args.connections, args.depth,
+           args.keep_alive ? "keep-alive" : "connection per request");
+    fflush(stdout);
+
+    uint64_t start = now_ns();
+    long started = 0;
+    for (; started < args.connections; started++) {
+        conns[started].args = &args;
+        int err_code = pthread_create(&conns[started].thread, NULL, bench_worker, &conns[started]);
+        if (err_code != 0) {
+            fprintf(stderr, "Failed to create thread: %s\n", strerror(err_code));
+            break;
+        }
+    }
+
+    struct timespec duration = { .tv_sec = args.duration, .tv_nsec = 0 };
+    while (nanosleep(&duration, &duration) == -1 && errno == EINTR);
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+    histogram_t *hist = calloc(1, sizeof(histogram_t));
+    uint64_t requests = 0, bytes = 0, connect_errors = 0, io_errors = 0, status_errors = 0;
+    for (long i = 0; i < started; i++) {
+        pthread_join(conns[i].thread, NULL);
+        if (hist != NULL) {
+            hist_merge(hist, &conns[i].hist);
+        }
+        requests += conns[i].requests;
+        bytes += conns[i].bytes;
+        connect_errors += conns[i].connect_errors;
+        io_errors += conns[i].io_errors;
+        status_errors += conns[i].status_errors;
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    printf("  %llu requests in %.2fs, %.2f MB read\n", (unsigned long long) requests, elapsed, bytes / 1e6);
+    printf("Requests/sec: %.2f\n", requests / elapsed);
+    printf("Transfer/sec: %.2f MB\n", bytes / 1e6 / elapsed);
+    if (hist != NULL && hist->total > 0) {
+        char buf[6][16];
+        printf("Latency: min %s, p50 %s, p90 %s, p99 %s, p99.9 %s, max %s\n",
+               format_duration(buf[0], hist->min), format_duration(buf[1], hist_percentile(hist, 50)),
+               format_duration(buf[2], hist_percentile(hist, 90)), format_duration(buf[3], hist_percentile(hist, 99)),
+               format_duration(buf[4], hist_percentile(hist, 99.9)), format_duration(buf[5], hist->max));
+    }
+    if (connect_errors + io_errors + status_errors > 0) {
+        printf("Errors: connect %llu, read/write %llu, status %llu\n", (unsigned long long) connect_errors,
+               (unsigned long long) io_errors, (unsigned long long) status_errors);
+    }
+
+    free(hist);
+    free(conns);
+    free(args.host);
+    return 0;
+}
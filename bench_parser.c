@@ -0,0 +1,408 @@
+/**
+ * @file bench_parser.c
+ *
+ * @brief Micro-benchmarks of the HTTP parser and serializer
+ *
+ * @details Measures recv_req, recv_res, parse_req, parse_res (which include the header tokenizer), get_header,
+ * send_req and send_res on in-memory streams and buffers, fed with recorded header corpora. Every benchmark is
+ * repeated until it ran for at least MIN_RUN_NS and reports nanoseconds and heap allocations per operation.
+ * Allocations are counted by interposing malloc, calloc and realloc, which relies on the __libc_ entry points of
+ * glibc.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "http.h"
+
+/**
+ * Minimum duration of a benchmark in nanoseconds
+ */
+#define MIN_RUN_NS 200000000
+
+/**
+ * Size of the buffers the serializers write into
+ */
+#define OUT_SIZE 65536
+
+/**
+ * Maximum number of headers of a parsed head
+ */
+#define MAX_HEADERS 128
+
+/**
+ * Structure that represents a recorded head
+ */
+typedef struct {
+    const char *name;
+    const char *head;
+} corpus_t;
+
+/**
+ * Structure that represents the state shared by one benchmark run
+ */
+typedef struct {
+    const corpus_t *corpus;
+    FILE *in; // stream reading the corpus
+    FILE *out; // stream writing into out_buf
+    char *work; // copy of the corpus for parsers working in place
+    size_t ln; // length of the corpus
+    http_req req; // the corpus parsed once, for lookups
+    int parsed; // whether req is filled
+    http_header header[MAX_HEADERS];
+    char out_buf[OUT_SIZE];
+} bench_t;
+
+static const corpus_t REQUESTS[] = {
+    { "curl",
+      "GET /index.html HTTP/1.1\r\n"
+      "Host: localhost:8080\r\n"
+      "User-Agent: curl/7.88.1\r\n"
+      "Accept: */*\r\n"
+      "\r\n" },
+    { "browser",
+      "GET /assets/js/app.min.js?v=3.2.1 HTTP/1.1\r\n"
+      "Host: www.example.com\r\n"
+      "Connection: keep-alive\r\n"
+      "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+      "sec-ch-ua-mobile: ?0\r\n"
+      "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+      "Chrome/124.0.0.0 Safari/537.36\r\n"
+      "sec-ch-ua-platform: \"Linux\"\r\n"
+      "Accept: */*\r\n"
+      "Sec-Fetch-Site: same-origin\r\n"
+      "Sec-Fetch-Mode: no-cors\r\n"
+      "Sec-Fetch-Dest: script\r\n"
+      "Referer: https://www.example.com/products/overview\r\n"
+      "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+      "Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+      "If-None-Match: \"5e1-1b2c3d-6650a1f0.1a2b3c4d\"\r\n"
+      "If-Modified-Since: Mon, 13 May 2024 08:12:32 GMT\r\n"
+      "\r\n" },
+    { "cookies",
+      "GET /account/settings HTTP/1.1\r\n"
+      "Host: app.example.com\r\n"
+      "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10.15; rv:125.0) Gecko/20100101 Firefox/125.0\r\n"
+      "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+      "Accept-Language: en-US,en;q=0.5\r\n"
+      "Accept-Encoding: gzip, deflate, br\r\n"
+      "Cookie: _ga=GA1.2.1234567890.1700000000; _gid=GA1.2.987654321.1715580000; "
+      "session=eyJhbGciOiJIUzI1NiIsInR5cCI6IkpXVCJ9.eyJzdWIiOiIxMjM0NTY3ODkwIiwibmFtZSI6IkpvaG4gRG9lIiwiaWF0IjoxNTE2MjM5MDIyfQ."
+      "SflKxwRJSMeKKF2QT4fwpMeJf36POk6yJV_adQssw5c; csrftoken=0a1b2c3d4e5f60718293a4b5c6d7e8f9; "
+      "prefs=theme%3Ddark%26lang%3Den%26tz%3DEurope%252FVienna; _fbp=fb.1.1700000000000.123456789; "
+      "ab_test=variant_b; consent=analytics%2Cmarketing%2Cfunctional; last_seen=1715580123\r\n"
+      "Cookie: tracking_id=7f3c2a1b-9d8e-4f6a-b5c4-3d2e1f0a9b8c; cart=%5B%7B%22id%22%3A42%2C%22qty%22%3A1%7D%5D\r\n"
+      "Connection: keep-alive\r\n"
+      "Upgrade-Insecure-Requests: 1\r\n"
+      "Sec-Fetch-Dest: document\r\n"
+      "Sec-Fetch-Mode: navigate\r\n"
+      "Sec-Fetch-Site: same-origin\r\n"
+      "Sec-Fetch-User: ?1\r\n"
+      "Priority: u=1\r\n"
+      "\r\n" }
+};
+
+static const corpus_t RESPONSES[] = {
+    { "minimal",
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Length: 7\r\n"
+      "Date: Tue, 14 May 2024 08:12:32 GMT\r\n"
+      "Connection: keep-alive\r\n"
+      "\r\n" },
+    { "static",
+      "HTTP/1.1 200 OK\r\n"
+      "ETag: \"5e1-1b2c3d-6650a1f0.1a2b3c4d\"\r\n"
+      "Last-Modified: Mon, 13 May 2024 08:12:32 GMT\r\n"
+      "Vary: Accept-Encoding\r\n"
+      "Content-Type: application/javascript\r\n"
+      "Content-Encoding: br\r\n"
+      "Accept-Ranges: bytes\r\n"
+      "Content-Length: 154908\r\n"
+      "Date: Tue, 14 May 2024 08:12:32 GMT\r\n"
+      "Connection: keep-alive\r\n"
+      "\r\n" },
+    { "cdn",
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Type: text/html; charset=utf-8\r\n"
+      "Transfer-Encoding: chunked\r\n"
+      "Connection: keep-alive\r\n"
+      "Cache-Control: private, no-cache, no-store, must-revalidate, max-age=0\r\n"
+      "Pragma: no-cache\r\n"
+      "Expires: 0\r\n"
+      "Strict-Transport-Security: max-age=31536000; includeSubDomains; preload\r\n"
+      "Content-Security-Policy: default-src 'self'; script-src 'self' https://cdn.example.com; "
+      "style-src 'self' 'unsafe-inline'; img-src * data:\r\n"
+      "X-Content-Type-Options: nosniff\r\n"
+      "X-Frame-Options: DENY\r\n"
+      "Referrer-Policy: strict-origin-when-cross-origin\r\n"
+      "Set-Cookie: session=eyJhbGciOiJIUzI1NiJ9.eyJ1aWQiOjQyfQ.abc; Path=/; HttpOnly; Secure; SameSite=Lax\r\n"
+      "Set-Cookie: csrftoken=0a1b2c3d4e5f60718293a4b5c6d7e8f9; Path=/; Secure; SameSite=Strict\r\n"
+      "Via: 1.1 varnish, 1.1 cache-fra-1234-FRA\r\n"
+      "X-Cache: MISS, HIT\r\n"
+      "X-Cache-Hits: 0, 3\r\n"
+      "X-Served-By: cache-fra-1234-FRA\r\n"
+      "Age: 12\r\n"
+      "Vary: Accept-Encoding, Cookie\r\n"
+      "Date: Tue, 14 May 2024 08:12:32 GMT\r\n"
+      "\r\n" }
+};
+
+/**
+ * Number of heap allocations since program start
+ */
+static uint64_t allocations = 0;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+/**
+ * @brief Counts and forwards an allocation to glibc
+ */
+void *malloc(size_t size) {
+    allocations++;
+    return __libc_malloc(size);
+}
+
+/**
+ * @brief Counts and forwards an allocation to glibc
+ */
+void *calloc(size_t nmemb, size_t size) {
+    allocations++;
+    return __libc_calloc(nmemb, size);
+}
+
+/**
+ * @brief Counts and forwards a reallocation to glibc
+ */
+void *realloc(void *ptr, size_t size) {
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+/**
+ * @brief Returns the time of the monotonic clock in nanoseconds
+ */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Fails the benchmark run
+ * @param name name of the failed operation
+ */
+static void fail(const char *name) {
+    fprintf(stderr, "%s failed\n", name);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * @brief Receives the corpus as request from a memory stream
+ * @param bench state of the benchmark run
+ */
+static void op_recv_req(bench_t *bench) {
+    http_req req;
+    rewind(bench->in);
+    if (recv_req(bench->in, &req) != 0) {
+        fail("recv_req");
+    }
+    free_http_req(&req);
+}
+
+/**
+ * @brief Receives the corpus as response from a memory stream
+ * @param bench state of the benchmark run
+ */
+static void op_recv_res(bench_t *bench) {
+    http_res res;
+    rewind(bench->in);
+    if (recv_res(bench->in, &res) != 0) {
+        fail("recv_res");
+    }
+    free_http_res(&res);
+}
+
+/**
+ * @brief Parses a copy of the corpus as request head
+ * @param bench state of the benchmark run
+ */
+static void op_parse_req(bench_t *bench) {
+    http_req req;
+    http_arena arena;
+    memcpy(bench->work, bench->corpus->head, bench->ln);
+    http_arena_init(&arena, bench->header, sizeof(bench->header));
+    if (parse_req(bench->work, bench->ln, &req, &arena) <= 0) {
+        fail("parse_req");
+    }
+}
+
+/**
+ * @brief Parses a copy of the corpus as response head
+ * @param bench state of the benchmark run
+ */
+static void op_parse_res(bench_t *bench) {
+    http_res res;
+    http_arena arena;
+    memcpy(bench->work, bench->corpus->head, bench->ln);
+    http_arena_init(&arena, bench->header, sizeof(bench->header));
+    if (parse_res(bench->work, bench->ln, &res, &arena) <= 0) {
+        fail("parse_res");
+    }
+}
+
+/**
+ * @brief Looks up a header of the corpus
+ * @param bench state of the benchmark run
+ */
+static void op_get_header(bench_t *bench) {
+    // The corpus is parsed on the first call, a missing header is looked up to scan all headers
+    if (!bench->parsed) {
+        http_arena arena;
+        memcpy(bench->work, bench->corpus->head, bench->ln);
+        http_arena_init(&arena, bench->header, sizeof(bench->header));
+        if (parse_req(bench->work, bench->ln, &bench->req, &arena) <= 0) {
+            fail("parse_req");
+        }
+        bench->parsed = 1;
+    }
+    char *volatile value = get_header(bench->req.header, bench->req.header_ln, "X-Missing");
+    (void) value;
+}
+
+/**
+ * @brief Sends a browser-like request into a memory stream
+ * @param bench state of the benchmark run
+ */
+static void op_send_req(bench_t *bench) {
+    http_header header[] = {
+        { .key = "Host", .value = "www.example.com" },
+        { .key = "User-Agent", .value = "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko)" },
+        { .key = "Accept", .value = "*/*" },
+        { .key = "Accept-Encoding", .value = "gzip, deflate, br" },
+        { .key = "Accept-Language", .value = "en-US,en;q=0.9" }
+    };
+    http_req req = {
+        .method = HTTP_GET,
+        .path = "/assets/js/app.min.js?v=3.2.1",
+        .header = header,
+        .header_ln = sizeof(header) / sizeof(header[0]),
+        .keep_alive = 1,
+        .body = NULL
+    };
+    rewind(bench->out);
+    if (send_req(bench->out, &req) == -1 || fflush(bench->out) == EOF) {
+        fail("send_req");
+    }
+}
+
+/**
+ * @brief Sends the head of a static file response into a memory stream
+ * @param bench state of the benchmark run
+ */
+static void op_send_res(bench_t *bench) {
+    http_header header[] = {
+        { .key = "ETag", .value = "\"5e1-1b2c3d-6650a1f0.1a2b3c4d\"" },
+        { .key = "Last-Modified", .value = "Mon, 13 May 2024 08:12:32 GMT" },
+        { .key = "Vary", .value = "Accept-Encoding" },
+        { .key = "Content-Type", .value = "application/javascript" },
+        { .key = "Accept-Ranges", .value = "bytes" }
+    };
+    http_res res = {
+        .status_code = { .code = 200, .description = "OK" },
+        .header = header,
+        .header_ln = sizeof(header) / sizeof(header[0]),
+        .keep_alive = 1,
+        .chunked = 0,
+        .body = NULL
+    };
+    rewind(bench->out);
+    if (send_res(bench->out, &res) == -1 || fflush(bench->out) == EOF) {
+        fail("send_res");
+    }
+}
+
+/**
+ * @brief Runs a benchmark and prints its result
+ * @details Doubles the number of iterations until a run lasts at least MIN_RUN_NS, after one warm-up iteration.
+ * @param name name of the benchmark
+ * @param corpus corpus fed to the operation, or NULL
+ * @param op operation to measure
+ */
+static void run(const char *name, const corpus_t *corpus, void (*op)(bench_t *)) {
+    bench_t *bench = malloc(sizeof(bench_t));
+    if (bench == NULL) {
+        fail("malloc");
+    }
+    bench->corpus = corpus;
+    bench->parsed = 0;
+    bench->ln = corpus != NULL ? strlen(corpus->head) : 0;
+    bench->work = malloc(bench->ln + 1);
+    bench->in = corpus != NULL ? fmemopen((void *) corpus->head, bench->ln, "r") : NULL;
+    bench->out = fmemopen(bench->out_buf, sizeof(bench->out_buf), "w");
+    if (bench->work == NULL || (corpus != NULL && bench->in == NULL) || bench->out == NULL) {
+        fail("setup");
+    }
+
+    op(bench);
+    uint64_t iterations = 1000;
+    uint64_t elapsed, allocated;
+    while (1) {
+        uint64_t start_allocations = allocations;
+        uint64_t start = now_ns();
+        for (uint64_t i = 0; i < iterations; i++) {
+            op(bench);
+        }
+        elapsed = now_ns() - start;
+        allocated = allocations - start_allocations;
+        if (elapsed >= MIN_RUN_NS) {
+            break;
+        }
+        iterations *= 2;
+    }
+
+    printf("%-12s %-10s %10.1f ns/op %8.2f allocs/op\n", name, corpus != NULL ? corpus->name : "-",
+           (double) elapsed / iterations, (double) allocated / iterations);
+
+    if (bench->in != NULL) {
+        fclose(bench->in);
+    }
+    fclose(bench->out);
+    free(bench->work);
+    free(bench);
+}
+
+/**
+ * Main entrypoint.
+ * @brief Main entry point
+ * @details Main entry point. This is where the program will start from.
+ * @return exit code
+ */
+int main(void) {
+    http_date_update();
+
+    size_t request_ln = sizeof(REQUESTS) / sizeof(REQUESTS[0]);
+    size_t response_ln = sizeof(RESPONSES) / sizeof(RESPONSES[0]);
+    for (size_t i = 0; i < request_ln; i++) {
+        run("recv_req", &REQUESTS[i], op_recv_req);
+    }
+    for (size_t i = 0; i < request_ln; i++) {
+        run("parse_req", &REQUESTS[i], op_parse_req);
+    }
+    for (size_t i = 0; i < request_ln; i++) {
+        run("get_header", &REQUESTS[i], op_get_header);
+    }
+    for (size_t i = 0; i < response_ln; i++) {
+        run("recv_res", &RESPONSES[i], op_recv_res);
+    }
+    for (size_t i = 0; i < response_ln; i++) {
+        run("parse_res", &RESPONSES[i], op_parse_res);
+    }
+    run("send_req", NULL, op_send_req);
+    run("send_res", NULL, op_send_res);
+    return 0;
+}
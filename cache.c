@@ -0,0 +1,450 @@
+/**
+ * @file cache.c
+ *
+ * @brief In-memory cache for static files
+ *
+ * @details Files are kept in memory together with the pre-rendered start of their response head, so a cache hit can be
+ * answered without any file system access. Entries are looked up by resolved path in a hash table, evicted in least
+ * recently used order once the memory limit is reached and invalidated by inotify as soon as the file changes.
+ * All operations are serialized by a single mutex, which is only held for the table updates.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+
+#include "cache.h"
+
+/**
+ * Initial number of hash buckets, the table is doubled once it holds more entries than buckets
+ */
+#define CACHE_INITIAL_BUCKETS 256
+
+/**
+ * Events which invalidate a cached file
+ */
+#define CACHE_WATCH_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF)
+
+struct cache_s {
+    pthread_mutex_t lock;
+    size_t max_bytes;
+    size_t used;
+    cache_entry_t **buckets; // by key
+    cache_entry_t **wd_buckets; // by inotify watch
+    size_t bucket_n; // power of two
+    size_t entry_n;
+    cache_entry_t *lru_head; // least recently used entry
+    cache_entry_t *lru_tail; // most recently used entry
+    int inotify;
+};
+
+/**
+ * @brief Hashes a key
+ * @details 64 bit FNV-1a over key, a null byte and encoding
+ * @param key key to hash
+ * @param encoding content coding of the variant, or NULL
+ * @return hash of key
+ */
+static uint64_t hash_key(const char *key, const char *encoding) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *key != '\0'; key++) {
+        hash ^= (unsigned char) *key;
+        hash *= 1099511628211ULL;
+    }
+    hash *= 1099511628211ULL;
+    for (; encoding != NULL && *encoding != '\0'; encoding++) {
+        hash ^= (unsigned char) *encoding;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * @brief Compares two content codings
+ * @param a content coding, or NULL
+ * @param b content coding, or NULL
+ * @return 1 if both are equal, 0 otherwise
+ */
+static int same_encoding(const char *a, const char *b) {
+    return a == b || (a != NULL && b != NULL && strcmp(a, b) == 0);
+}
+
+/**
+ * @brief Returns the memory accounted for an entry
+ * @param entry entry to measure
+ * @return size of content, head and key
+ */
+static size_t entry_cost(cache_entry_t *entry) {
+    return entry->size + entry->head_ln + strlen(entry->key) + sizeof(cache_entry_t);
+}
+
+/**
+ * @brief Frees an entry
+ * @param entry unreferenced entry
+ */
+static void free_entry(cache_entry_t *entry) {
+    free(entry->data);
+    free(entry->head);
+    free(entry->key);
+    free(entry->encoding);
+    free(entry);
+}
+
+void cache_release(cache_entry_t *entry) {
+    if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free_entry(entry);
+    }
+}
+
+/**
+ * @brief Removes an inotify watch which is no longer needed
+ * @details Files reached by several keys share one watch, so it is only removed once no entry uses it anymore. The
+ * caller must hold the lock.
+ * @param cache cache owning the watch
+ * @param wd watch to remove
+ */
+static void release_watch(cache_t *cache, int wd) {
+    for (cache_entry_t *entry = cache->wd_buckets[wd & (cache->bucket_n - 1)]; entry != NULL; entry = entry->wd_next) {
+        if (entry->wd == wd) {
+            return;
+        }
+    }
+    inotify_rm_watch(cache->inotify, wd);
+}
+
+/**
+ * @brief Removes an entry from the cache
+ * @details Unlinks entry from the hash tables and the LRU list and drops the reference held by the cache. The caller
+ * must hold the lock.
+ * @param cache cache containing entry
+ * @param entry entry to remove
+ */
+static void unlink_entry(cache_t *cache, cache_entry_t *entry) {
+    cache_entry_t **link = &cache->buckets[entry->hash & (cache->bucket_n - 1)];
+    while (*link != entry) {
+        link = &(*link)->bucket_next;
+    }
+    *link = entry->bucket_next;
+
+    link = &cache->wd_buckets[entry->wd & (cache->bucket_n - 1)];
+    while (*link != entry) {
+        link = &(*link)->wd_next;
+    }
+    *link = entry->wd_next;
+
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        cache->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        cache->lru_tail = entry->lru_prev;
+    }
+
+    cache->used -= entry_cost(entry);
+    cache->entry_n--;
+    entry->linked = 0;
+    release_watch(cache, entry->wd);
+    cache_release(entry);
+}
+
+/**
+ * @brief Appends an entry to the most recently used end of the LRU list
+ * @param cache cache containing entry
+ * @param entry entry which is not part of the LRU list
+ */
+static void lru_append(cache_t *cache, cache_entry_t *entry) {
+    entry->lru_prev = cache->lru_tail;
+    entry->lru_next = NULL;
+    if (cache->lru_tail != NULL) {
+        cache->lru_tail->lru_next = entry;
+    } else {
+        cache->lru_head = entry;
+    }
+    cache->lru_tail = entry;
+}
+
+/**
+ * @brief Doubles the number of hash buckets
+ * @details The caller must hold the lock. If memory runs out, the table is kept as it is.
+ * @param cache cache to grow
+ */
+static void grow_buckets(cache_t *cache) {
+    size_t bucket_n = cache->bucket_n * 2;
+    cache_entry_t **buckets = calloc(bucket_n, sizeof(cache_entry_t *));
+    cache_entry_t **wd_buckets = calloc(bucket_n, sizeof(cache_entry_t *));
+    if (buckets == NULL || wd_buckets == NULL) {
+        free(buckets);
+        free(wd_buckets);
+        return;
+    }
+
+    for (cache_entry_t *entry = cache->lru_head; entry != NULL; entry = entry->lru_next) {
+        cache_entry_t **bucket = &buckets[entry->hash & (bucket_n - 1)];
+        entry->bucket_next = *bucket;
+        *bucket = entry;
+
+        bucket = &wd_buckets[entry->wd & (bucket_n - 1)];
+        entry->wd_next = *bucket;
+        *bucket = entry;
+    }
+
+    free(cache->buckets);
+    free(cache->wd_buckets);
+    cache->buckets = buckets;
+    cache->wd_buckets = wd_buckets;
+    cache->bucket_n = bucket_n;
+}
+
+/**
+ * @brief Finds the entry of a key
+ * @details The caller must hold the lock.
+ * @param cache cache to search
+ * @param key key to look for
+ * @param encoding content coding of the variant, or NULL
+ * @param hash hash of key and encoding
+ * @return entry, or NULL if key is not cached
+ */
+static cache_entry_t *find_entry(cache_t *cache, const char *key, const char *encoding, uint64_t hash) {
+    for (cache_entry_t *entry = cache->buckets[hash & (cache->bucket_n - 1)]; entry != NULL; entry = entry->bucket_next) {
+        if (entry->hash == hash && strcmp(entry->key, key) == 0 && same_encoding(entry->encoding, encoding)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Invalidates changed files
+ * @details Reads all pending inotify events. The caller must hold the lock.
+ * @param cache cache to update
+ */
+static void handle_events_locked(cache_t *cache) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1) {
+        ssize_t read_ln = read(cache->inotify, buf, sizeof(buf));
+        if (read_ln <= 0) {
+            if (read_ln == -1 && errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+
+        for (char *p = buf; p < &buf[read_ln]; p += sizeof(struct inotify_event) + ((struct inotify_event *) p)->len) {
+            struct inotify_event *event = (struct inotify_event *) p;
+            cache_entry_t *entry = cache->wd_buckets[event->wd & (cache->bucket_n - 1)];
+            while (entry != NULL) {
+                cache_entry_t *next = entry->wd_next;
+                if (entry->wd == event->wd) {
+                    unlink_entry(cache, entry);
+                }
+                entry = next;
+            }
+        }
+    }
+}
+
+cache_t *cache_create(size_t max_bytes) {
+    cache_t *cache = malloc(sizeof(cache_t));
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache->max_bytes = max_bytes;
+    cache->used = 0;
+    cache->bucket_n = CACHE_INITIAL_BUCKETS;
+    cache->entry_n = 0;
+    cache->lru_head = NULL;
+    cache->lru_tail = NULL;
+    cache->buckets = calloc(cache->bucket_n, sizeof(cache_entry_t *));
+    cache->wd_buckets = calloc(cache->bucket_n, sizeof(cache_entry_t *));
+    if (cache->buckets == NULL || cache->wd_buckets == NULL) {
+        free(cache->buckets);
+        free(cache->wd_buckets);
+        free(cache);
+        return NULL;
+    }
+
+    cache->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (cache->inotify == -1) {
+        free(cache->buckets);
+        free(cache->wd_buckets);
+        free(cache);
+        return NULL;
+    }
+
+    int err_code = pthread_mutex_init(&cache->lock, NULL);
+    if (err_code != 0) {
+        close(cache->inotify);
+        free(cache->buckets);
+        free(cache->wd_buckets);
+        free(cache);
+        errno = err_code;
+        return NULL;
+    }
+
+    return cache;
+}
+
+void cache_destroy(cache_t *cache) {
+    while (cache->lru_head != NULL) {
+        unlink_entry(cache, cache->lru_head);
+    }
+    pthread_mutex_destroy(&cache->lock);
+    close(cache->inotify);
+    free(cache->buckets);
+    free(cache->wd_buckets);
+    free(cache);
+}
+
+int cache_event_fd(cache_t *cache) {
+    return cache->inotify;
+}
+
+void cache_handle_events(cache_t *cache) {
+    pthread_mutex_lock(&cache->lock);
+    handle_events_locked(cache);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+cache_entry_t *cache_get(cache_t *cache, const char *key, const char *encoding) {
+    uint64_t hash = hash_key(key, encoding);
+
+    pthread_mutex_lock(&cache->lock);
+    cache_entry_t *entry = find_entry(cache, key, encoding, hash);
+    if (entry != NULL) {
+        __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+        if (cache->lru_tail != entry) {
+            entry->lru_next->lru_prev = entry->lru_prev;
+            if (entry->lru_prev != NULL) {
+                entry->lru_prev->lru_next = entry->lru_next;
+            } else {
+                cache->lru_head = entry->lru_next;
+            }
+            lru_append(cache, entry);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return entry;
+}
+
+/**
+ * @brief Reads a complete file
+ * @details Loads the content of entries of files served as they are, see cache_load_fn.
+ * @param fd file to read
+ * @param size size of the file
+ * @param arg unused
+ * @param data newly allocated buffer holding the file will be written here
+ * @param data_ln size will be written here
+ * @return 0 on success, -1 on failure or if the file is shorter than size
+ */
+static int read_file(int fd, size_t size, void *arg, char **data, size_t *data_ln) {
+    char *buf = malloc(size > 0 ? size : 1);
+    if (buf == NULL) {
+        return -1;
+    }
+
+    size_t pos = 0;
+    while (pos < size) {
+        ssize_t read_ln = pread(fd, &buf[pos], size - pos, pos);
+        if (read_ln == -1 && errno == EINTR) {
+            continue;
+        } else if (read_ln <= 0) {
+            free(buf);
+            return -1;
+        }
+        pos += read_ln;
+    }
+
+    *data = buf;
+    *data_ln = size;
+    return 0;
+}
+
+cache_entry_t *cache_put(cache_t *cache, const char *key, const char *encoding, const char *path, int fd,
+                         const struct stat *st, http_res *res, cache_load_fn load, void *arg) {
+    if (!S_ISREG(st->st_mode) || st->st_size > cache->max_bytes / 4) {
+        return NULL;
+    }
+
+    cache_entry_t *entry = calloc(1, sizeof(cache_entry_t));
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->st = *st;
+    entry->hash = hash_key(key, encoding);
+    entry->refs = 2; // cache and caller
+    entry->key = strdup(key);
+    entry->encoding = encoding != NULL ? strdup(encoding) : NULL;
+    if (entry->key == NULL || (encoding != NULL && entry->encoding == NULL)) {
+        free_entry(entry);
+        return NULL;
+    }
+
+    // The watch is added before loading, so changes during the load are not missed
+    entry->wd = inotify_add_watch(cache->inotify, path, CACHE_WATCH_EVENTS);
+    if (entry->wd == -1) {
+        free_entry(entry);
+        return NULL;
+    }
+
+    struct stat after;
+    int failed = (load != NULL ? load : read_file)(fd, st->st_size, arg, &entry->data, &entry->size) == -1;
+    if (!failed) {
+        int head_ln = format_res_head_start(NULL, 0, res, entry->size);
+        entry->head = head_ln < 0 ? NULL : malloc(head_ln + 1);
+        failed = entry->head == NULL;
+        if (!failed) {
+            entry->head_ln = format_res_head_start(entry->head, head_ln + 1, res, entry->size);
+        }
+    }
+    if (failed || fstat(fd, &after) == -1 || after.st_size != st->st_size ||
+        after.st_mtim.tv_sec != st->st_mtim.tv_sec || after.st_mtim.tv_nsec != st->st_mtim.tv_nsec) {
+        pthread_mutex_lock(&cache->lock);
+        release_watch(cache, entry->wd);
+        pthread_mutex_unlock(&cache->lock);
+        free_entry(entry);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    cache_entry_t *existing = find_entry(cache, key, encoding, entry->hash);
+    if (existing != NULL) {
+        // Another thread cached the file in the meantime, both share the watch
+        __atomic_add_fetch(&existing->refs, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&cache->lock);
+        free_entry(entry);
+        return existing;
+    }
+
+    size_t cost = entry_cost(entry);
+    while (cache->lru_head != NULL && cache->used + cost > cache->max_bytes) {
+        unlink_entry(cache, cache->lru_head);
+    }
+    if (cache->entry_n >= cache->bucket_n) {
+        grow_buckets(cache);
+    }
+
+    cache_entry_t **bucket = &cache->buckets[entry->hash & (cache->bucket_n - 1)];
+    entry->bucket_next = *bucket;
+    *bucket = entry;
+    bucket = &cache->wd_buckets[entry->wd & (cache->bucket_n - 1)];
+    entry->wd_next = *bucket;
+    *bucket = entry;
+    lru_append(cache, entry);
+    entry->linked = 1;
+    cache->used += cost;
+    cache->entry_n++;
+
+    // Apply changes which happened before the entry was linked
+    handle_events_locked(cache);
+    pthread_mutex_unlock(&cache->lock);
+
+    return entry;
+}
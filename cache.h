@@ -0,0 +1,119 @@
+#ifndef UE3_CACHE_H
+#define UE3_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "http.h"
+
+/**
+ * Struct representing the file cache, shared by all threads
+ */
+typedef struct cache_s cache_t;
+
+/**
+ * Struct representing a cached file
+ * A file may be cached in several variants, which differ by content coding. An entry stays valid while it is
+ * referenced, even if it is evicted or invalidated in the meantime.
+ */
+typedef struct cache_entry_s {
+    char *data; // file content
+    size_t size;
+    char *head; // pre-rendered start of the response head, see format_res_head_start
+    size_t head_ln;
+    struct stat st; // status of the file when it was cached
+
+    // Internal members
+    char *key;
+    char *encoding; // content coding of data, NULL for the file itself
+    uint64_t hash;
+    int wd; // inotify watch of the file
+    int refs; // accessed atomically
+    int linked; // whether the entry is still part of the cache
+    struct cache_entry_s *bucket_next;
+    struct cache_entry_s *wd_next;
+    struct cache_entry_s *lru_prev;
+    struct cache_entry_s *lru_next;
+} cache_entry_t;
+
+/**
+ * @brief Creates a file cache
+ * @details Creates an empty cache which holds at most max_bytes of file content, heads and keys. Files are
+ * invalidated as soon as they change, which is detected using inotify.
+ * @param max_bytes memory limit of the cache
+ * @return new cache, NULL on failure
+ */
+cache_t *cache_create(size_t max_bytes);
+
+/**
+ * @brief Destroys a file cache
+ * @details Releases all entries of the cache. Entries still referenced are freed when they are released.
+ * @param cache cache to destroy
+ */
+void cache_destroy(cache_t *cache);
+
+/**
+ * @brief Returns the file descriptor reporting file changes
+ * @details The returned file descriptor becomes readable when cached files change. cache_handle_events should be
+ * called then.
+ * @param cache cache to query
+ * @return inotify file descriptor
+ */
+int cache_event_fd(cache_t *cache);
+
+/**
+ * @brief Invalidates changed files
+ * @details Reads all pending change events and removes the affected entries from the cache.
+ * @param cache cache to update
+ */
+void cache_handle_events(cache_t *cache);
+
+/**
+ * Function loading the content of a cache entry from a file
+ * @param fd file to load
+ * @param size size of the file
+ * @param arg argument passed to cache_put
+ * @param data newly allocated content will be written here
+ * @param data_ln length of the content will be written here
+ * @return 0 on success, -1 on failure
+ */
+typedef int (*cache_load_fn)(int fd, size_t size, void *arg, char **data, size_t *data_ln);
+
+/**
+ * @brief Looks up a file
+ * @details Looks up the variant of the file cached for key and encoding and references it. Does not access the file
+ * system.
+ * @param cache cache to search
+ * @param key resolved path of the file
+ * @param encoding content coding of the variant, NULL for the file itself
+ * @return referenced entry which has to be released with cache_release, NULL if the file is not cached
+ */
+cache_entry_t *cache_get(cache_t *cache, const char *key, const char *encoding);
+
+/**
+ * @brief Adds a file to the cache
+ * @details Loads the file fd into memory and pre-renders the start of its response head from res. Least recently
+ * used entries are evicted to make room. Files larger than a quarter of the cache are not cached. The entry is
+ * invalidated once the file at path changes.
+ * @param cache cache to add to
+ * @param key resolved path of the requested file
+ * @param encoding content coding of the variant, NULL for the file itself
+ * @param path path of the file fd, differs from key for precompressed files
+ * @param fd open file descriptor of the file
+ * @param st status of fd
+ * @param res response the file is served with, its status and headers are used for the head
+ * @param load function producing the content of the entry, NULL to read the file as it is
+ * @param arg argument passed to load
+ * @return referenced entry which has to be released with cache_release, NULL if the file could not be cached
+ */
+cache_entry_t *cache_put(cache_t *cache, const char *key, const char *encoding, const char *path, int fd,
+                         const struct stat *st, http_res *res, cache_load_fn load, void *arg);
+
+/**
+ * @brief Releases a referenced entry
+ * @param entry entry returned by cache_get or cache_put
+ */
+void cache_release(cache_entry_t *entry);
+
+#endif //UE3_CACHE_H
@@ -8,15 +8,45 @@
  * @details This is a HTTP Client Implementation for the CLI.
  * It sends a GET request to the specified URL and prints the response.
  * Alternatively, this response can also be written to a file with the -o or -d options.
+ * Several URLs, given as arguments or in a list file, are downloaded concurrently into the directory given with -d.
+ * With -j, a single large file is downloaded in byte ranges over several connections at once.
+ * Bodies saved to regular files are spliced from the socket into the file, other output goes through a large buffer.
  */
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <getopt.h>
 #include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include "http.h"
 
+/**
+ * Seconds a resolved host is reused for new connections
+ */
+#define DNS_TTL 60
+
+/**
+ * Minimum size of a range in segmented downloads, smaller files are downloaded with less connections
+ */
+#define SEGMENT_MIN_SIZE (1024 * 1024)
+
+/**
+ * Size of the buffer bodies are received into when they cannot be spliced, reads of this size bypass the connection
+ * buffer
+ */
+#define RECV_BUFFER_SIZE (1024 * 1024)
+
+/**
+ * Requested capacity of the pipe bodies are spliced through
+ */
+#define SPLICE_PIPE_SIZE (1024 * 1024)
+
 /**
  * Structure that represents an URL
  */
@@ -31,24 +61,110 @@ typedef struct {
  */
 typedef struct {
     char *port;
-    url_t url;
+    char **urls;
+    size_t url_ln;
+    char *list;
+    long connections;
+    long segments;
     char *file;
     char *dir;
 } args_t;
 
+/**
+ * Structure that represents the state shared by all download threads
+ */
+typedef struct {
+    args_t *args;
+    http_pool *pool;
+    size_t next; // index of the next URL to download, accessed atomically
+    int result; // exit code of the last failed download, accessed atomically
+} downloads_t;
+
+/**
+ * Structure that represents a range of a segmented download
+ */
+typedef struct {
+    args_t *args;
+    http_pool *pool;
+    url_t *url;
+    char *etag; // entity tag of the file, to detect changes during the download, or NULL
+    int fd; // output file
+    long long start;
+    long long end; // exclusive
+    long long size; // size of the whole file
+    int result; // exit code
+} segment_t;
+
 /**
  * @brief Prints usage text to stderr
  * @details Print usage text to stderr, using binary name from argument binary.
  * @param binary Represents the name of the binary, should probably be argv[0].
  */
 static void print_usage(char *binary) {
-    fprintf(stderr, "Usage: %s [-p PORT] [ -o FILE | -d DIR ] URL\n", binary);
+    fprintf(stderr, "Usage: %s [-p PORT] [-n CONNECTIONS] [ -o FILE | -d DIR ] URL...\n", binary);
+    fprintf(stderr, "       %s [-p PORT] [-n CONNECTIONS] -d DIR -l LIST [URL...]\n", binary);
+    fprintf(stderr, "       %s [-p PORT] -j SEGMENTS ( -o FILE | -d DIR ) URL\n", binary);
+}
+
+/**
+ * @brief Reads URLs from a list file
+ * @details Appends every line of the file to the URLs of args. Empty lines and lines starting with '#' are skipped.
+ * @param args arguments to add the URLs to
+ * @return 0 on success, -1 on failure
+ */
+static int read_url_list(args_t *args) {
+    FILE *list = strcmp(args->list, "-") == 0 ? stdin : fopen(args->list, "r");
+    if (list == NULL) {
+        return -1;
+    }
+
+    size_t size = args->url_ln;
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t line_ln;
+    while ((line_ln = getline(&line, &line_size, list)) != -1) {
+        while (line_ln > 0 && (line[line_ln - 1] == '\n' || line[line_ln - 1] == '\r')) {
+            line[--line_ln] = '\0';
+        }
+        if (line_ln == 0 || line[0] == '#') {
+            continue;
+        }
+
+        if (args->url_ln == size) {
+            size = size * 2 + 16;
+            char **urls = realloc(args->urls, size * sizeof(char *));
+            if (urls == NULL) {
+                free(line);
+                if (list != stdin) {
+                    fclose(list);
+                }
+                return -1;
+            }
+            args->urls = urls;
+        }
+        args->urls[args->url_ln] = strdup(line);
+        if (args->urls[args->url_ln] == NULL) {
+            free(line);
+            if (list != stdin) {
+                fclose(list);
+            }
+            return -1;
+        }
+        args->url_ln++;
+    }
+
+    free(line);
+    int failed = ferror(list);
+    if (list != stdin) {
+        fclose(list);
+    }
+    return failed ? -1 : 0;
 }
 
 /**
  * Parse arguments
  * @brief Parses arguments from the command line
- * @details Parses the arguments p,o and d.
+ * @details Parses the arguments p, n, j, l, o and d. The URLs are copied, so they can be extended by a list file later.
  * @param argc argc which gets passed to main
  * @param argv argv which gets passed to main
  * @param graph initialized args_t struct where the parsed arguments will be stored
@@ -58,12 +174,15 @@ static int parse_args(int argc, char **argv, args_t *args) {
     // Define defaults if they are not set below
     args->file = NULL;
     args->dir = NULL;
+    args->list = NULL;
+    args->connections = 4;
+    args->segments = 1;
     args->port = "80";
 
     // Parse all flags and parameters
     int opt;
     char *endptr = NULL;
-    while ((opt = getopt(argc, argv, "p:o:d:")) != -1) {
+    while ((opt = getopt(argc, argv, "p:n:j:l:o:d:")) != -1) {
         switch (opt) {
             case 'p':
                 if (endptr != NULL)
@@ -74,6 +193,28 @@ static int parse_args(int argc, char **argv, args_t *args) {
                     return -1;
                 args->port = optarg;
                 break;
+            case 'n': {
+                char *n_endptr;
+                args->connections = strtol(optarg, &n_endptr, 10);
+                if (*n_endptr != '\0' || args->connections < 1) {
+                    return -1;
+                }
+                break;
+            }
+            case 'j': {
+                char *j_endptr;
+                args->segments = strtol(optarg, &j_endptr, 10);
+                if (*j_endptr != '\0' || args->segments < 1) {
+                    return -1;
+                }
+                break;
+            }
+            case 'l':
+                if (args->list != NULL) {
+                    return -1;
+                }
+                args->list = optarg;
+                break;
             case 'o':
                 if (args->dir != NULL || args->file != NULL) {
                     return -1;
@@ -91,13 +232,24 @@ static int parse_args(int argc, char **argv, args_t *args) {
         }
     }
 
-    if (optind + 1 != argc) {
+    if (optind == argc && args->list == NULL) {
+        return -1;
+    }
+    // A list file or several URLs can only be written into a directory
+    if ((args->list != NULL || optind + 1 < argc) && args->dir == NULL) {
+        return -1;
+    }
+    // Ranges are written at their offset, so a segmented download needs a single URL and a regular output file
+    if (args->segments > 1 && (args->list != NULL || optind + 1 < argc || (args->file == NULL && args->dir == NULL))) {
         return -1;
     }
 
-    args->url.url = argv[optind++];
-    args->url.host = NULL;
-    args->url.path = NULL;
+    args->url_ln = argc - optind;
+    args->urls = malloc((args->url_ln + 1) * sizeof(char *));
+    if (args->urls == NULL) {
+        return -1;
+    }
+    memcpy(args->urls, &argv[optind], args->url_ln * sizeof(char *));
     return 0;
 }
 
@@ -127,147 +279,609 @@ static int parse_url(url_t *url) {
 }
 
 /**
- * Main entrypoint.
- * @brief Main entry point
- * @details Main entry point. This is where the program will start from.
- * @param argc argc passed to program
- * @param argv argv passed to program
- * @return exit code
+ * @brief Opens the file a response is saved to
+ * @details Opens FILE of -o, or a file in DIR of -d whose name is determined by the URL. Returns stdout otherwise.
+ * @param args parsed arguments
+ * @param url parsed URL of the response
+ * @return opened stream, NULL on failure
  */
-int main(int argc, char **argv) {
-    args_t args;
-    if (parse_args(argc, argv, &args) == -1) {
-        print_usage(argv[0]);
+static FILE *open_output(args_t *args, url_t *url) {
+    if (args->file != NULL) {
+        return fopen(args->file, "w");
+    } else if (args->dir == NULL) {
+        return stdout;
+    }
+
+    char *file = strrchr(url->path, '/');
+    if (file == NULL || file[1] == '\0' || file[1] == '?') {
+        file = "index.html";
+    } else {
+        file = &file[1];
+    }
+
+    char *path = malloc((strlen(file) + strlen(args->dir) + 2) * sizeof(char));
+    if (path == NULL) {
+        return NULL;
+    }
+    strcpy(path, args->dir);
+    strcat(path, "/");
+    strncat(path, file, strcspn(file, "?"));
+    FILE *stream = fopen(path, "w");
+    free(path);
+    return stream;
+}
+
+/**
+ * @brief Checks whether a body can be spliced into a file
+ * @param fd output file
+ * @return 1 if fd is a regular file, 0 otherwise
+ */
+static int can_splice(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+/**
+ * @brief Receives the body of a response into a file by splicing
+ * @details The data moves from the socket through a pipe into the file within the kernel, see http_conn_splice_body.
+ * @param conn connection the response is received on
+ * @param res received response head
+ * @param fd regular file to write the body to
+ * @param offset offset to write at, advanced by the bytes written, NULL to write at the file position
+ * @return exit code, 0 on success
+ */
+static int splice_body(http_conn *conn, http_res *res, int fd, off_t *offset) {
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+        perror("Failed to create pipe");
         return EXIT_FAILURE;
     }
+    // A larger pipe moves more per splice, the default capacity still works if it cannot be grown
+    fcntl(pipe_fds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    int size = fcntl(pipe_fds[1], F_GETPIPE_SZ);
 
-    int err_code = parse_url(&args.url);
-    if (err_code != 0) {
-        if (err_code == -2) {
-            fprintf(stderr, "Invalid URL\n");
-        } else {
-            perror("Failed to parse URL");
+    int result = 0;
+    while (1) {
+        ssize_t moved = http_conn_splice_body(conn, res, fd, offset, pipe_fds, size > 0 ? size : 65536);
+        if (moved == -2) {
+            fprintf(stderr, "Protocol error!\n");
+            result = 2;
+        } else if (moved == -1) {
+            perror("Error while reading stream");
+            result = EXIT_FAILURE;
+        } else if (moved == -3) {
+            perror("Error while writing stream");
+            result = EXIT_FAILURE;
+        } else if (moved > 0) {
+            continue;
         }
-        return EXIT_FAILURE;
+        break;
     }
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    return result;
+}
 
-    FILE *outStream = NULL;
-    if (args.file != NULL) {
-        outStream = fopen(args.file, "w");
-        if (outStream == NULL) {
-            perror("Failed to open file");
-            return EXIT_FAILURE;
+/**
+ * @brief Receives the body of a response
+ * @details Reads until the end of the body, which is delimited by Content-Length, the last chunk or EOF, and writes it
+ * to out. Regular files are preallocated to Content-Length and the body is spliced into them, other streams are
+ * written from a large buffer.
+ * @param conn connection the response is received on
+ * @param res received response head
+ * @param out stream to write the body to, NULL to discard it
+ * @return exit code, 0 on success
+ */
+static int receive_body(http_conn *conn, http_res *res, FILE *out) {
+    if (out != NULL && can_splice(fileno(out))) {
+        // Reserving the blocks upfront keeps the file contiguous, keeping the size lets a short body end it
+        if (res->content_length > 0) {
+            fallocate(fileno(out), FALLOC_FL_KEEP_SIZE, 0, res->content_length);
         }
+        return splice_body(conn, res, fileno(out), NULL);
     }
 
-    if (args.dir != NULL) {
-        char *file = strrchr(args.url.path, '/');
-        if (file == NULL || file[1] == '\0' || file[1] == '?') {
-            file = "index.html";
-        } else {
-            file = &file[1];
+    void *buffer;
+    int err = posix_memalign(&buffer, 4096, RECV_BUFFER_SIZE);
+    if (err != 0) {
+        errno = err;
+        perror("Failed to allocate buffer");
+        return EXIT_FAILURE;
+    }
+
+    int result = 0;
+    while (1) {
+        ssize_t read_ln = http_conn_recv_body(conn, res, buffer, RECV_BUFFER_SIZE);
+        if (read_ln == -2) {
+            fprintf(stderr, "Protocol error!\n");
+            result = 2;
+        } else if (read_ln == -1) {
+            perror("Error while reading stream");
+            result = EXIT_FAILURE;
+        } else if (read_ln > 0 && out != NULL && fwrite(buffer, 1, read_ln, out) < read_ln) {
+            perror("Error while writing stream");
+            result = EXIT_FAILURE;
+        } else if (read_ln > 0) {
+            continue;
         }
+        break;
+    }
+    free(buffer);
+    return result;
+}
 
-        char *path = malloc((strlen(file) + strlen(args.dir) + 2) * sizeof(char));
-        if (path == NULL) {
-            perror("Failed to allocate memory");
+/**
+ * @brief Sends a request and receives the head of its response
+ * @details Takes a connection from the pool. A reused connection may have been closed by the server in the meantime,
+ * so the request is repeated on another connection if it fails on a reused one.
+ * @param pool connection pool
+ * @param url parsed URL
+ * @param port port to connect to
+ * @param req request to send
+ * @param res head of the response will be written here
+ * @param conn connection the response is received on will be written here
+ * @return exit code, 0 on success
+ */
+static int request(http_pool *pool, url_t *url, char *port, http_req *req, http_res *res, http_conn **conn) {
+    while (1) {
+        const char *err = NULL;
+        int reused = 0;
+        *conn = http_pool_get(pool, url->host, port, &reused, &err);
+        if (*conn == NULL) {
+            if (err == NULL) {
+                perror("Failed to initiate connection");
+            } else {
+                fprintf(stderr, "Failed to initiate connection: %s\n", err);
+            }
             return EXIT_FAILURE;
         }
-        strcpy(path, args.dir);
-        strcat(path, "/");
-        strncat(path, file, strcspn(file, "?"));
-        outStream = fopen(path, "w");
-        free(path);
-        if (outStream == NULL) {
-            perror("Failed to open file");
+
+        int sent = http_conn_send_req(*conn, req) == 0;
+        int err_code = sent ? http_conn_recv_res(*conn, res) : -1;
+        if (err_code == 0) {
+            return 0;
+        }
+        http_conn_close(*conn);
+        *conn = NULL;
+        if (reused) {
+            continue;
+        }
+
+        if (!sent) {
+            perror("Failed to send request");
             return EXIT_FAILURE;
+        } else if (err_code == -2 || err_code == -3) {
+            fprintf(stderr, "Protocol error!\n");
+            return 2;
         }
+        perror("Error while receiving response");
+        return EXIT_FAILURE;
     }
+}
 
-    const char *err = NULL;
-    FILE *stream = init_client_conn(args.url.host, args.port, &err);
-    if (stream == NULL) {
-        if (err == NULL) {
-            perror("Failed to initiate connection");
+/**
+ * @brief Downloads an URL
+ * @details Requests the URL on a pooled connection and saves the body of the response as given by the arguments. The
+ * connection is returned to the pool if the server keeps it open.
+ * @param args parsed arguments
+ * @param pool connection pool
+ * @param url_str URL to download
+ * @return exit code, 0 on success
+ */
+static int download(args_t *args, http_pool *pool, char *url_str) {
+    url_t url = { .url = url_str, .host = NULL, .path = NULL };
+    int err_code = parse_url(&url);
+    if (err_code != 0) {
+        if (err_code == -2) {
+            fprintf(stderr, "Invalid URL\n");
         } else {
-            fprintf(stderr, "Failed to initiate connection: %s\n", err);
+            perror("Failed to parse URL");
         }
+        free(url.host);
+        free(url.path);
+        return EXIT_FAILURE;
+    }
+
+    FILE *outStream = open_output(args, &url);
+    if (outStream == NULL) {
+        perror("Failed to open file");
+        free(url.host);
+        free(url.path);
         return EXIT_FAILURE;
     }
 
     http_req req = {
-            .path = args.url.path,
+            .path = url.path,
             .method = HTTP_GET,
-            .header = (http_header[]) { { .key = "Host", .value = args.url.host } },
-            .header_ln = 1
+            .header = (http_header[]) { { .key = "Host", .value = url.host } },
+            .header_ln = 1,
+            .keep_alive = 1
     };
 
-    if (send_req(stream, &req) == -1) {
-        perror("Failed to send request");
-        fclose(stream);
-        if (outStream) {
-            fclose(outStream);
+    http_conn *conn;
+    http_res res;
+    int result = request(pool, &url, args->port, &req, &res, &conn);
+    if (result == 0) {
+        if (res.status_code.code != 200) {
+            fprintf(stderr, "%ld %s\n", res.status_code.code, res.status_code.description);
+            result = receive_body(conn, &res, NULL) == 0 ? 3 : EXIT_FAILURE;
+        } else {
+            result = receive_body(conn, &res, outStream);
+        }
+
+        // Only a completely received body which is not delimited by the end of the connection allows reuse
+        if (res.keep_alive && res.body_done && (res.chunked || res.content_length != -1)) {
+            http_pool_put(pool, url.host, args->port, conn);
+            conn = NULL;
+        }
+        free_http_res(&res);
+        if (conn != NULL) {
+            http_conn_close(conn);
+        }
+    }
+
+    free(url.host);
+    free(url.path);
+    if (outStream != stdout && fclose(outStream) == EOF && result == 0) {
+        perror("Error while writing stream");
+        result = EXIT_FAILURE;
+    }
+    return result;
+}
+
+/**
+ * @brief Writes a complete buffer at an offset of a file
+ * @param fd file to write to
+ * @param buf data to write
+ * @param ln number of bytes to write
+ * @param offset offset to write at
+ * @return 0 on success, -1 on failure
+ */
+static int pwrite_all(int fd, const char *buf, size_t ln, off_t offset) {
+    while (ln > 0) {
+        ssize_t write_ln = pwrite(fd, buf, ln, offset);
+        if (write_ln == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
         }
+        buf += write_ln;
+        ln -= write_ln;
+        offset += write_ln;
+    }
+    return 0;
+}
+
+/**
+ * @brief Receives the body of a range response through a buffer
+ * @details Used if the body is not framed by a Content-Length matching the range. Fails before writing data which
+ * would exceed the range.
+ * @param conn connection the response is received on
+ * @param res received response head
+ * @param segment segment the range belongs to
+ * @param pos offset to write at, advanced by the bytes written
+ * @return exit code, 0 on success
+ */
+static int receive_range(http_conn *conn, http_res *res, segment_t *segment, off_t *pos) {
+    void *buffer;
+    int err = posix_memalign(&buffer, 4096, RECV_BUFFER_SIZE);
+    if (err != 0) {
+        errno = err;
+        perror("Failed to allocate buffer");
         return EXIT_FAILURE;
     }
 
+    int result = 0;
+    while (1) {
+        ssize_t read_ln = http_conn_recv_body(conn, res, buffer, RECV_BUFFER_SIZE);
+        if (read_ln == -2 || (read_ln > 0 && read_ln > segment->end - *pos)) {
+            fprintf(stderr, "Protocol error!\n");
+            result = 2;
+        } else if (read_ln == -1) {
+            perror("Error while reading stream");
+            result = EXIT_FAILURE;
+        } else if (read_ln > 0 && pwrite_all(segment->fd, buffer, read_ln, *pos) == -1) {
+            perror("Error while writing stream");
+            result = EXIT_FAILURE;
+        } else if (read_ln > 0) {
+            *pos += read_ln;
+            continue;
+        }
+        break;
+    }
+    free(buffer);
+    return result;
+}
+
+/**
+ * @brief Entry point of a segment thread
+ * @details Requests the range of the segment and writes its body to the corresponding offset of the output file.
+ * If-Range makes the server send the whole file instead if it changed since the HEAD request, which fails the segment.
+ * @param arg segment_t to download, its result is written into it
+ * @return NULL
+ */
+static void *segment_worker(void *arg) {
+    segment_t *segment = arg;
+    char range[64];
+    snprintf(range, sizeof(range), "bytes=%lld-%lld", segment->start, segment->end - 1);
+    http_header header[3] = {
+            { .key = "Host", .value = segment->url->host },
+            { .key = "Range", .value = range },
+            { .key = "If-Range", .value = segment->etag }
+    };
+    http_req req = {
+            .path = segment->url->path,
+            .method = HTTP_GET,
+            .header = header,
+            .header_ln = segment->etag != NULL ? 3 : 2,
+            .keep_alive = 1
+    };
+
+    http_conn *conn;
     http_res res;
-    err_code = recv_res(stream, &res);
+    segment->result = request(segment->pool, segment->url, segment->args->port, &req, &res, &conn);
+    if (segment->result != 0) {
+        return NULL;
+    }
+
+    long long start, end, size;
+    char *content_range = get_header(res.header, res.header_ln, "Content-Range");
+    if (res.status_code.code == 200) {
+        fprintf(stderr, "File changed during download\n");
+        segment->result = EXIT_FAILURE;
+    } else if (res.status_code.code != 206) {
+        fprintf(stderr, "%ld %s\n", res.status_code.code, res.status_code.description);
+        segment->result = 3;
+    } else if (content_range == NULL || sscanf(content_range, "bytes %lld-%lld/%lld", &start, &end, &size) != 3 ||
+               start != segment->start || end != segment->end - 1 || size != segment->size) {
+        fprintf(stderr, "Protocol error!\n");
+        segment->result = 2;
+    }
+    if (segment->result != 0) {
+        free_http_res(&res);
+        http_conn_close(conn);
+        return NULL;
+    }
+
+    // Content-Length framing stops the splice at the end of the range, so it cannot overwrite the next one
+    off_t pos = segment->start;
+    if (!res.chunked && res.content_length == segment->end - segment->start) {
+        segment->result = splice_body(conn, &res, segment->fd, &pos);
+    } else {
+        segment->result = receive_range(conn, &res, segment, &pos);
+    }
+    if (segment->result == 0 && pos != segment->end) {
+        fprintf(stderr, "Protocol error!\n");
+        segment->result = 2;
+    }
+
+    if (segment->result == 0 && res.keep_alive && res.body_done) {
+        http_pool_put(segment->pool, segment->url->host, segment->args->port, conn);
+    } else {
+        http_conn_close(conn);
+    }
+    free_http_res(&res);
+    return NULL;
+}
+
+/**
+ * @brief Downloads an URL in several ranges concurrently
+ * @details Learns size and entity tag of the file with a HEAD request, then fetches up to -j ranges of at least
+ * SEGMENT_MIN_SIZE bytes on their own connections. The output file is sized upfront, so every range is written
+ * straight to its offset. Falls back to download if the server does not support ranges or the file is small.
+ * @param args parsed arguments
+ * @param pool connection pool
+ * @param url_str URL to download
+ * @return exit code, 0 on success
+ */
+static int download_segmented(args_t *args, http_pool *pool, char *url_str) {
+    url_t url = { .url = url_str, .host = NULL, .path = NULL };
+    int err_code = parse_url(&url);
     if (err_code != 0) {
-        if (err_code == -2 || err_code == -3) {
-            fprintf(stderr, "Protocol error!\n");
-            fclose(stream);
-            if (outStream) {
-                fclose(outStream);
-            }
-            return 2;
+        if (err_code == -2) {
+            fprintf(stderr, "Invalid URL\n");
         } else {
-            perror("Error while receiving response");
-            fclose(stream);
-            if (outStream) {
-                fclose(outStream);
-            }
-            return EXIT_FAILURE;
+            perror("Failed to parse URL");
         }
+        free(url.host);
+        free(url.path);
+        return EXIT_FAILURE;
     }
 
-    if (res.status_code.code != 200) {
+    http_req req = {
+            .path = url.path,
+            .method = HTTP_HEAD,
+            .header = (http_header[]) { { .key = "Host", .value = url.host } },
+            .header_ln = 1,
+            .keep_alive = 1
+    };
+
+    http_conn *conn;
+    http_res res;
+    int result = request(pool, &url, args->port, &req, &res, &conn);
+    if (result != 0) {
+        free(url.host);
+        free(url.path);
+        return result;
+    } else if (res.status_code.code != 200) {
         fprintf(stderr, "%ld %s\n", res.status_code.code, res.status_code.description);
-        free(args.url.host);
-        free(args.url.path);
         free_http_res(&res);
-        fclose(stream);
-        if (outStream) {
-            fclose(outStream);
-        }
+        http_conn_close(conn);
+        free(url.host);
+        free(url.path);
         return 3;
     }
 
-    char buffer[1024];
+    // Weak entity tags cannot be used with If-Range
+    long long size = res.content_length;
+    char *accept_ranges = get_header(res.header, res.header_ln, "Accept-Ranges");
+    char *etag = get_header(res.header, res.header_ln, "ETag");
+    etag = etag != NULL && strncmp(etag, "W/", 2) != 0 ? strdup(etag) : NULL;
+    long segment_ln = size / SEGMENT_MIN_SIZE < args->segments ? size / SEGMENT_MIN_SIZE : args->segments;
+    if (accept_ranges == NULL || strcasecmp(accept_ranges, "bytes") != 0) {
+        segment_ln = 1;
+    }
+
+    // The response to HEAD has no body, so the connection can be reused right away
+    if (res.keep_alive) {
+        http_pool_put(pool, url.host, args->port, conn);
+    } else {
+        http_conn_close(conn);
+    }
+    free_http_res(&res);
+
+    if (segment_ln < 2) {
+        free(etag);
+        free(url.host);
+        free(url.path);
+        return download(args, pool, url_str);
+    }
+
+    FILE *outStream = open_output(args, &url);
+    segment_t *segments = malloc(segment_ln * sizeof(segment_t));
+    pthread_t *threads = malloc(segment_ln * sizeof(pthread_t));
+    // Allocating the blocks before sizing the file keeps it contiguous, ftruncate alone would leave it sparse
+    if (outStream != NULL) {
+        fallocate(fileno(outStream), 0, 0, size);
+    }
+    if (outStream == NULL || segments == NULL || threads == NULL || ftruncate(fileno(outStream), size) == -1) {
+        perror(outStream == NULL ? "Failed to open file" : "Failed to prepare file");
+        result = EXIT_FAILURE;
+        segment_ln = 0;
+    }
+
+    // The first segment is downloaded by this thread
+    long started = 1;
+    for (long i = 0; i < segment_ln; i++) {
+        segments[i] = (segment_t) {
+                .args = args,
+                .pool = pool,
+                .url = &url,
+                .etag = etag,
+                .fd = fileno(outStream),
+                .start = size * i / segment_ln,
+                .end = size * (i + 1) / segment_ln,
+                .size = size,
+                .result = 0
+        };
+    }
+    for (; started < segment_ln; started++) {
+        int err = pthread_create(&threads[started], NULL, segment_worker, &segments[started]);
+        if (err != 0) {
+            fprintf(stderr, "Failed to create thread: %s\n", strerror(err));
+            result = EXIT_FAILURE;
+            break;
+        }
+    }
+    if (segment_ln > 0) {
+        segment_worker(&segments[0]);
+    }
+    for (long i = 0; i < segment_ln && i < started; i++) {
+        if (i > 0) {
+            pthread_join(threads[i], NULL);
+        }
+        if (segments[i].result != 0) {
+            result = segments[i].result;
+        }
+    }
+
+    free(threads);
+    free(segments);
+    free(etag);
+    free(url.host);
+    free(url.path);
+    if (outStream != NULL && fclose(outStream) == EOF && result == 0) {
+        perror("Error while writing stream");
+        result = EXIT_FAILURE;
+    }
+    return result;
+}
+
+/**
+ * @brief Entry point of a download thread
+ * @details Downloads URLs one after another until all URLs have been taken by a thread.
+ * @param arg shared downloads_t
+ * @return NULL
+ */
+static void *download_worker(void *arg) {
+    downloads_t *downloads = arg;
     while (1) {
-        size_t read_ln = fread(buffer, 1, sizeof(buffer), stream);
-        if (ferror(stream) != 0) {
-            perror("Error while reading stream");
-            return EXIT_FAILURE;
+        size_t i = __atomic_fetch_add(&downloads->next, 1, __ATOMIC_RELAXED);
+        if (i >= downloads->args->url_ln) {
+            return NULL;
         }
 
-        size_t write_ln = fwrite(buffer, 1, read_ln, outStream == NULL ? stdout : outStream);
-        if (write_ln < read_ln) {
-            perror("Error while writing stream");
-            return EXIT_FAILURE;
+        char *url = downloads->args->urls[i];
+        int result = downloads->args->segments > 1 ? download_segmented(downloads->args, downloads->pool, url)
+                                                   : download(downloads->args, downloads->pool, url);
+        if (result != 0) {
+            if (downloads->args->url_ln > 1) {
+                fprintf(stderr, "Failed to download %s\n", url);
+            }
+            __atomic_store_n(&downloads->result, result, __ATOMIC_RELAXED);
         }
+    }
+}
 
-        if (read_ln < sizeof(buffer)) {
+/**
+ * Main entrypoint.
+ * @brief Main entry point
+ * @details Main entry point. This is where the program will start from.
+ * @param argc argc passed to program
+ * @param argv argv passed to program
+ * @return exit code
+ */
+int main(int argc, char **argv) {
+    args_t args;
+    if (parse_args(argc, argv, &args) == -1) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    size_t arg_url_ln = args.url_ln;
+    if (args.list != NULL && read_url_list(&args) == -1) {
+        perror("Failed to read URL list");
+        return EXIT_FAILURE;
+    }
+
+    // Writing to a connection the server has closed must fail with EPIPE, a reused connection is retried then
+    signal(SIGPIPE, SIG_IGN);
+
+    http_pool *pool = http_pool_create(args.connections > args.segments ? args.connections : args.segments, DNS_TTL);
+    if (pool == NULL) {
+        perror("Failed to create connection pool");
+        return EXIT_FAILURE;
+    }
+
+    downloads_t downloads = { .args = &args, .pool = pool, .next = 0, .result = 0 };
+    size_t thread_ln = args.connections < args.url_ln ? args.connections : args.url_ln;
+    pthread_t *threads = malloc(thread_ln * sizeof(pthread_t));
+    if (threads == NULL && thread_ln > 0) {
+        perror("Failed to allocate memory");
+        http_pool_destroy(pool);
+        return EXIT_FAILURE;
+    }
+
+    // The main thread downloads as well, if no further thread can be started
+    size_t started = 0;
+    for (; started + 1 < thread_ln; started++) {
+        int err_code = pthread_create(&threads[started], NULL, download_worker, &downloads);
+        if (err_code != 0) {
+            fprintf(stderr, "Failed to create thread: %s\n", strerror(err_code));
             break;
         }
     }
+    download_worker(&downloads);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
 
-    free(args.url.host);
-    free(args.url.path);
-    free_http_res(&res);
-    fclose(stream);
-    if (outStream) {
-        fclose(outStream);
+    free(threads);
+    http_pool_destroy(pool);
+    for (size_t i = arg_url_ln; i < args.url_ln; i++) {
+        free(args.urls[i]);
     }
-    return 0;
+    free(args.urls);
+    return downloads.result;
 }
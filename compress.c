@@ -0,0 +1,216 @@
+/**
+ * @file compress.c
+ *
+ * @brief Content codings for responses
+ *
+ * @details Compresses files with gzip (zlib) or brotli. Files are read and encoded in chunks, the compressed output is
+ * collected in a growing buffer, so it can be kept in the file cache.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+
+#include "compress.h"
+
+/**
+ * Size of the chunks the input is read in
+ */
+#define COMPRESS_CHUNK 65536
+
+/**
+ * Compression level of gzip, files are compressed only once, so the best level is used
+ */
+#define COMPRESS_GZIP_LEVEL 9
+
+/**
+ * Quality of brotli, 11 is several times slower than this for little gain
+ */
+#define COMPRESS_BROTLI_QUALITY 9
+
+/**
+ * Structure that represents the growing output buffer of an encoder
+ */
+typedef struct {
+    char *buf;
+    size_t ln;
+    size_t size;
+} output_t;
+
+const char *compress_name(compress_coding coding) {
+    return coding == COMPRESS_BROTLI ? "br" : "gzip";
+}
+
+const char *compress_extension(compress_coding coding) {
+    return coding == COMPRESS_BROTLI ? ".br" : ".gz";
+}
+
+/**
+ * @brief Makes room in an output buffer
+ * @details Doubles the buffer if less than a chunk is left.
+ * @param output buffer to grow
+ * @return 0 on success, -1 on failure
+ */
+static int output_reserve(output_t *output) {
+    if (output->size - output->ln >= COMPRESS_CHUNK) {
+        return 0;
+    }
+    size_t size = output->size * 2 > output->ln + COMPRESS_CHUNK ? output->size * 2 : output->ln + COMPRESS_CHUNK;
+    char *buf = realloc(output->buf, size);
+    if (buf == NULL) {
+        return -1;
+    }
+    output->buf = buf;
+    output->size = size;
+    return 0;
+}
+
+/**
+ * @brief Reads the next chunk of a file
+ * @param fd file to read
+ * @param buf buffer of COMPRESS_CHUNK bytes
+ * @param pos offset to read at
+ * @param size size of the file
+ * @return number of bytes read, -1 on failure or if the file ends before size
+ */
+static ssize_t read_chunk(int fd, char *buf, size_t pos, size_t size) {
+    size_t ln = size - pos < COMPRESS_CHUNK ? size - pos : COMPRESS_CHUNK;
+    while (1) {
+        ssize_t read_ln = pread(fd, buf, ln, pos);
+        if (read_ln == -1 && errno == EINTR) {
+            continue;
+        } else if (read_ln == 0 && ln > 0) {
+            return -1;
+        }
+        return read_ln;
+    }
+}
+
+/**
+ * @brief Compresses a file with gzip
+ * @param fd file to compress
+ * @param size number of bytes to compress
+ * @param chunk input buffer of COMPRESS_CHUNK bytes
+ * @param output buffer the compressed data is appended to
+ * @return 0 on success, -1 on failure
+ */
+static int compress_gzip(int fd, size_t size, char *chunk, output_t *output) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // 16 added to the window bits selects the gzip format
+    if (deflateInit2(&stream, COMPRESS_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+
+    size_t pos = 0;
+    int result;
+    do {
+        ssize_t read_ln = read_chunk(fd, chunk, pos, size);
+        if (read_ln == -1) {
+            deflateEnd(&stream);
+            return -1;
+        }
+        pos += read_ln;
+        stream.next_in = (Bytef *) chunk;
+        stream.avail_in = read_ln;
+        int flush = pos == size ? Z_FINISH : Z_NO_FLUSH;
+
+        do {
+            if (output_reserve(output) == -1) {
+                deflateEnd(&stream);
+                return -1;
+            }
+            stream.next_out = (Bytef *) &output->buf[output->ln];
+            stream.avail_out = output->size - output->ln;
+            result = deflate(&stream, flush);
+            if (result == Z_STREAM_ERROR) {
+                deflateEnd(&stream);
+                return -1;
+            }
+            output->ln = output->size - stream.avail_out;
+        } while (stream.avail_out == 0 || stream.avail_in > 0);
+    } while (result != Z_STREAM_END);
+
+    deflateEnd(&stream);
+    return 0;
+}
+
+/**
+ * @brief Compresses a file with brotli
+ * @param fd file to compress
+ * @param size number of bytes to compress
+ * @param chunk input buffer of COMPRESS_CHUNK bytes
+ * @param output buffer the compressed data is appended to
+ * @return 0 on success, -1 on failure
+ */
+static int compress_brotli(int fd, size_t size, char *chunk, output_t *output) {
+    BrotliEncoderState *state = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+    if (state == NULL) {
+        return -1;
+    }
+    BrotliEncoderSetParameter(state, BROTLI_PARAM_QUALITY, COMPRESS_BROTLI_QUALITY);
+    BrotliEncoderSetParameter(state, BROTLI_PARAM_SIZE_HINT, size < UINT32_MAX ? size : 0);
+
+    size_t pos = 0;
+    do {
+        ssize_t read_ln = read_chunk(fd, chunk, pos, size);
+        if (read_ln == -1) {
+            BrotliEncoderDestroyInstance(state);
+            return -1;
+        }
+        pos += read_ln;
+        const uint8_t *next_in = (const uint8_t *) chunk;
+        size_t avail_in = read_ln;
+        BrotliEncoderOperation op = pos == size ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS;
+
+        while (avail_in > 0 || BrotliEncoderHasMoreOutput(state) ||
+               (op == BROTLI_OPERATION_FINISH && !BrotliEncoderIsFinished(state))) {
+            if (output_reserve(output) == -1) {
+                BrotliEncoderDestroyInstance(state);
+                return -1;
+            }
+            uint8_t *next_out = (uint8_t *) &output->buf[output->ln];
+            size_t avail_out = output->size - output->ln;
+            if (!BrotliEncoderCompressStream(state, op, &avail_in, &next_in, &avail_out, &next_out, NULL)) {
+                BrotliEncoderDestroyInstance(state);
+                return -1;
+            }
+            output->ln = output->size - avail_out;
+        }
+    } while (pos < size);
+
+    BrotliEncoderDestroyInstance(state);
+    return 0;
+}
+
+int compress_file(int fd, size_t size, compress_coding coding, char **data, size_t *data_ln) {
+    char *chunk = malloc(COMPRESS_CHUNK);
+    if (chunk == NULL) {
+        return -1;
+    }
+
+    // Text usually shrinks to a quarter or less, the buffer grows if needed
+    output_t output = { .buf = NULL, .ln = 0, .size = 0 };
+    output.size = size / 4 + COMPRESS_CHUNK;
+    output.buf = malloc(output.size);
+    if (output.buf == NULL) {
+        free(chunk);
+        return -1;
+    }
+
+    int result = coding == COMPRESS_BROTLI ? compress_brotli(fd, size, chunk, &output)
+                                           : compress_gzip(fd, size, chunk, &output);
+    free(chunk);
+    if (result == -1) {
+        free(output.buf);
+        return -1;
+    }
+
+    *data = output.buf;
+    *data_ln = output.ln;
+    return 0;
+}
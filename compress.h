@@ -0,0 +1,43 @@
+#ifndef UE3_COMPRESS_H
+#define UE3_COMPRESS_H
+
+#include <stddef.h>
+
+/**
+ * Content codings supported by compress_file, in order of preference
+ */
+typedef enum {
+    COMPRESS_BROTLI,
+    COMPRESS_GZIP,
+    COMPRESS_CODING_LN
+} compress_coding;
+
+/**
+ * @brief Returns the name of a content coding
+ * @details The name is used in Accept-Encoding and Content-Encoding headers.
+ * @param coding content coding
+ * @return name of coding, e.g. "br"
+ */
+const char *compress_name(compress_coding coding);
+
+/**
+ * @brief Returns the file extension of precompressed files
+ * @param coding content coding
+ * @return file extension including the dot, e.g. ".br"
+ */
+const char *compress_extension(compress_coding coding);
+
+/**
+ * @brief Compresses a file
+ * @details Reads the file fd in chunks and feeds them to a streaming encoder for coding, so the uncompressed file is
+ * never held in memory completely.
+ * @param fd file to compress, it is read using pread
+ * @param size number of bytes to compress
+ * @param coding content coding to apply
+ * @param data newly allocated buffer holding the compressed data will be written here
+ * @param data_ln length of the compressed data will be written here
+ * @return 0 on success, -1 on failure
+ */
+int compress_file(int fd, size_t size, compress_coding coding, char **data, size_t *data_ln);
+
+#endif //UE3_COMPRESS_H
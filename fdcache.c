@@ -0,0 +1,371 @@
+/**
+ * @file fdcache.c
+ *
+ * @brief Cache of open file descriptors
+ *
+ * @details Keeps regular files open together with their status, so files which are sent with sendfile instead of
+ * being held in memory can be served without open, fstat and close on every request. Entries are looked up by
+ * resolved path in a hash table, evicted in least recently used order once the entry limit is reached and invalidated
+ * by inotify as soon as the file changes, or once their time to live has passed. All operations are serialized by a
+ * single mutex, which is only held for the table updates.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+
+#include "fdcache.h"
+
+/**
+ * Events which invalidate an open file, IN_ATTRIB includes the link count dropping when the file is replaced
+ */
+#define FDCACHE_WATCH_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF)
+
+struct fdcache_s {
+    pthread_mutex_t lock;
+    size_t max_entries;
+    long ttl; // milliseconds
+    fdcache_open_fn open;
+    fdcache_entry_t **buckets; // by path
+    fdcache_entry_t **wd_buckets; // by inotify watch
+    size_t bucket_n; // power of two, at least max_entries
+    size_t entry_n;
+    fdcache_entry_t *lru_head; // least recently used entry
+    fdcache_entry_t *lru_tail; // most recently used entry
+    int inotify;
+};
+
+/**
+ * @brief Returns the current time of the monotonic clock
+ * @return milliseconds
+ */
+static long now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+/**
+ * @brief Hashes a path
+ * @details 64 bit FNV-1a
+ * @param path path to hash
+ * @return hash of path
+ */
+static uint64_t hash_path(const char *path) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *path != '\0'; path++) {
+        hash ^= (unsigned char) *path;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * @brief Closes and frees an entry
+ * @param entry unreferenced entry
+ */
+static void free_entry(fdcache_entry_t *entry) {
+    if (entry->fd != -1) {
+        close(entry->fd);
+    }
+    free(entry->path);
+    free(entry);
+}
+
+void fdcache_release(fdcache_entry_t *entry) {
+    if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free_entry(entry);
+    }
+}
+
+/**
+ * @brief Removes an inotify watch which is no longer needed
+ * @details Files reached by several paths share one watch, so it is only removed once no entry uses it anymore. The
+ * caller must hold the lock.
+ * @param cache cache owning the watch
+ * @param wd watch to remove
+ */
+static void release_watch(fdcache_t *cache, int wd) {
+    for (fdcache_entry_t *entry = cache->wd_buckets[wd & (cache->bucket_n - 1)]; entry != NULL;
+         entry = entry->wd_next) {
+        if (entry->wd == wd) {
+            return;
+        }
+    }
+    inotify_rm_watch(cache->inotify, wd);
+}
+
+/**
+ * @brief Removes an entry from the cache
+ * @details Unlinks entry from the hash tables and the LRU list and drops the reference held by the cache. The caller
+ * must hold the lock.
+ * @param cache cache containing entry
+ * @param entry entry to remove
+ */
+static void unlink_entry(fdcache_t *cache, fdcache_entry_t *entry) {
+    fdcache_entry_t **link = &cache->buckets[entry->hash & (cache->bucket_n - 1)];
+    while (*link != entry) {
+        link = &(*link)->bucket_next;
+    }
+    *link = entry->bucket_next;
+
+    link = &cache->wd_buckets[entry->wd & (cache->bucket_n - 1)];
+    while (*link != entry) {
+        link = &(*link)->wd_next;
+    }
+    *link = entry->wd_next;
+
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        cache->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        cache->lru_tail = entry->lru_prev;
+    }
+
+    cache->entry_n--;
+    release_watch(cache, entry->wd);
+    fdcache_release(entry);
+}
+
+/**
+ * @brief Appends an entry to the most recently used end of the LRU list
+ * @param cache cache containing entry
+ * @param entry entry which is not part of the LRU list
+ */
+static void lru_append(fdcache_t *cache, fdcache_entry_t *entry) {
+    entry->lru_prev = cache->lru_tail;
+    entry->lru_next = NULL;
+    if (cache->lru_tail != NULL) {
+        cache->lru_tail->lru_next = entry;
+    } else {
+        cache->lru_head = entry;
+    }
+    cache->lru_tail = entry;
+}
+
+/**
+ * @brief Finds the entry of a path
+ * @details The caller must hold the lock.
+ * @param cache cache to search
+ * @param path path to look for
+ * @param hash hash of path
+ * @return entry, or NULL if path is not cached
+ */
+static fdcache_entry_t *find_entry(fdcache_t *cache, const char *path, uint64_t hash) {
+    for (fdcache_entry_t *entry = cache->buckets[hash & (cache->bucket_n - 1)]; entry != NULL;
+         entry = entry->bucket_next) {
+        if (entry->hash == hash && strcmp(entry->path, path) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Invalidates changed files
+ * @details Reads all pending inotify events. The caller must hold the lock.
+ * @param cache cache to update
+ */
+static void handle_events_locked(fdcache_t *cache) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1) {
+        ssize_t read_ln = read(cache->inotify, buf, sizeof(buf));
+        if (read_ln <= 0) {
+            if (read_ln == -1 && errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+
+        for (char *p = buf; p < &buf[read_ln]; p += sizeof(struct inotify_event) + ((struct inotify_event *) p)->len) {
+            struct inotify_event *event = (struct inotify_event *) p;
+            fdcache_entry_t *entry = cache->wd_buckets[event->wd & (cache->bucket_n - 1)];
+            while (entry != NULL) {
+                fdcache_entry_t *next = entry->wd_next;
+                if (entry->wd == event->wd) {
+                    unlink_entry(cache, entry);
+                }
+                entry = next;
+            }
+        }
+    }
+}
+
+fdcache_t *fdcache_create(size_t max_entries, long ttl, fdcache_open_fn open) {
+    fdcache_t *cache = malloc(sizeof(fdcache_t));
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    // The table is sized for the entry limit once, so it never has to grow
+    cache->max_entries = max_entries;
+    cache->ttl = ttl;
+    cache->open = open;
+    cache->bucket_n = 16;
+    while (cache->bucket_n < max_entries) {
+        cache->bucket_n *= 2;
+    }
+    cache->entry_n = 0;
+    cache->lru_head = NULL;
+    cache->lru_tail = NULL;
+    cache->buckets = calloc(cache->bucket_n, sizeof(fdcache_entry_t *));
+    cache->wd_buckets = calloc(cache->bucket_n, sizeof(fdcache_entry_t *));
+    if (cache->buckets == NULL || cache->wd_buckets == NULL) {
+        free(cache->buckets);
+        free(cache->wd_buckets);
+        free(cache);
+        return NULL;
+    }
+
+    cache->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (cache->inotify == -1) {
+        free(cache->buckets);
+        free(cache->wd_buckets);
+        free(cache);
+        return NULL;
+    }
+
+    int err_code = pthread_mutex_init(&cache->lock, NULL);
+    if (err_code != 0) {
+        close(cache->inotify);
+        free(cache->buckets);
+        free(cache->wd_buckets);
+        free(cache);
+        errno = err_code;
+        return NULL;
+    }
+
+    return cache;
+}
+
+void fdcache_destroy(fdcache_t *cache) {
+    while (cache->lru_head != NULL) {
+        unlink_entry(cache, cache->lru_head);
+    }
+    pthread_mutex_destroy(&cache->lock);
+    close(cache->inotify);
+    free(cache->buckets);
+    free(cache->wd_buckets);
+    free(cache);
+}
+
+int fdcache_event_fd(fdcache_t *cache) {
+    return cache->inotify;
+}
+
+void fdcache_handle_events(fdcache_t *cache) {
+    pthread_mutex_lock(&cache->lock);
+    handle_events_locked(cache);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+fdcache_entry_t *fdcache_get(fdcache_t *cache, const char *path) {
+    uint64_t hash = hash_path(path);
+
+    pthread_mutex_lock(&cache->lock);
+    fdcache_entry_t *entry = find_entry(cache, path, hash);
+    if (entry != NULL && now_ms() - entry->opened >= cache->ttl) {
+        unlink_entry(cache, entry);
+        entry = NULL;
+    } else if (entry != NULL) {
+        __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+        if (cache->lru_tail != entry) {
+            entry->lru_next->lru_prev = entry->lru_prev;
+            if (entry->lru_prev != NULL) {
+                entry->lru_prev->lru_next = entry->lru_next;
+            } else {
+                cache->lru_head = entry->lru_next;
+            }
+            lru_append(cache, entry);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return entry;
+}
+
+fdcache_entry_t *fdcache_open(fdcache_t *cache, const char *path) {
+    fdcache_entry_t *entry = fdcache_get(cache, path);
+    if (entry != NULL) {
+        return entry;
+    }
+
+    entry = calloc(1, sizeof(fdcache_entry_t));
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->fd = -1;
+    entry->wd = -1;
+    entry->refs = 1;
+    entry->path = strdup(path);
+    if (entry->path == NULL) {
+        free_entry(entry);
+        return NULL;
+    }
+
+    // The watch is added before opening, so a file which is replaced in between invalidates the entry right away
+    int wd = inotify_add_watch(cache->inotify, path, FDCACHE_WATCH_EVENTS);
+    entry->fd = cache->open(path);
+    if (entry->fd == -1 || fstat(entry->fd, &entry->st) == -1) {
+        int err_code = errno;
+        if (wd != -1) {
+            pthread_mutex_lock(&cache->lock);
+            release_watch(cache, wd);
+            pthread_mutex_unlock(&cache->lock);
+        }
+        free_entry(entry);
+        errno = err_code;
+        return NULL;
+    }
+    if (wd == -1 || !S_ISREG(entry->st.st_mode)) {
+        // Not cached, the caller holds the only reference
+        if (wd != -1) {
+            pthread_mutex_lock(&cache->lock);
+            release_watch(cache, wd);
+            pthread_mutex_unlock(&cache->lock);
+        }
+        return entry;
+    }
+    entry->wd = wd;
+    entry->hash = hash_path(path);
+    entry->opened = now_ms();
+    entry->refs = 2; // cache and caller
+
+    pthread_mutex_lock(&cache->lock);
+    fdcache_entry_t *existing = find_entry(cache, path, entry->hash);
+    if (existing != NULL) {
+        // Another thread opened the file in the meantime
+        __atomic_add_fetch(&existing->refs, 1, __ATOMIC_RELAXED);
+        release_watch(cache, wd);
+        pthread_mutex_unlock(&cache->lock);
+        free_entry(entry);
+        return existing;
+    }
+
+    while (cache->lru_head != NULL && cache->entry_n >= cache->max_entries) {
+        unlink_entry(cache, cache->lru_head);
+    }
+
+    fdcache_entry_t **bucket = &cache->buckets[entry->hash & (cache->bucket_n - 1)];
+    entry->bucket_next = *bucket;
+    *bucket = entry;
+    bucket = &cache->wd_buckets[entry->wd & (cache->bucket_n - 1)];
+    entry->wd_next = *bucket;
+    *bucket = entry;
+    lru_append(cache, entry);
+    cache->entry_n++;
+
+    // Apply changes which happened before the entry was linked
+    handle_events_locked(cache);
+    pthread_mutex_unlock(&cache->lock);
+
+    return entry;
+}
@@ -0,0 +1,102 @@
+#ifndef UE3_FDCACHE_H
+#define UE3_FDCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/**
+ * Struct representing the open file cache, shared by all threads
+ */
+typedef struct fdcache_s fdcache_t;
+
+/**
+ * Struct representing an open file
+ * The descriptor is shared by all users of the entry, so it must only be read at explicit offsets, e.g. with pread or
+ * sendfile. An entry stays open while it is referenced, even if it is evicted or invalidated in the meantime.
+ */
+typedef struct fdcache_entry_s {
+    int fd; // read-only file descriptor
+    struct stat st; // status of fd when it was opened
+
+    // Internal members
+    char *path;
+    uint64_t hash;
+    int wd; // inotify watch of the file
+    long opened; // milliseconds of CLOCK_MONOTONIC
+    int refs; // accessed atomically
+    struct fdcache_entry_s *bucket_next;
+    struct fdcache_entry_s *wd_next;
+    struct fdcache_entry_s *lru_prev;
+    struct fdcache_entry_s *lru_next;
+} fdcache_entry_t;
+
+/**
+ * Function opening a file read-only
+ * @param path path of the file
+ * @return file descriptor, -1 on failure with errno set
+ */
+typedef int (*fdcache_open_fn)(const char *path);
+
+/**
+ * @brief Creates an open file cache
+ * @details Creates an empty cache which keeps at most max_entries regular files open. Files are invalidated as soon
+ * as they change, which is detected using inotify, and ttl milliseconds after they have been opened at the latest, so
+ * changes inotify does not report, e.g. on network file systems, are picked up as well.
+ * @param max_entries maximum number of open files
+ * @param ttl milliseconds an entry is used at most
+ * @param open function opening files, paths are watched relative to the working directory
+ * @return new cache, NULL on failure
+ */
+fdcache_t *fdcache_create(size_t max_entries, long ttl, fdcache_open_fn open);
+
+/**
+ * @brief Destroys an open file cache
+ * @details Releases all entries of the cache. Entries still referenced are closed when they are released.
+ * @param cache cache to destroy
+ */
+void fdcache_destroy(fdcache_t *cache);
+
+/**
+ * @brief Returns the file descriptor reporting file changes
+ * @details The returned file descriptor becomes readable when cached files change. fdcache_handle_events should be
+ * called then.
+ * @param cache cache to query
+ * @return inotify file descriptor
+ */
+int fdcache_event_fd(fdcache_t *cache);
+
+/**
+ * @brief Invalidates changed files
+ * @details Reads all pending change events and removes the affected entries from the cache.
+ * @param cache cache to update
+ */
+void fdcache_handle_events(fdcache_t *cache);
+
+/**
+ * @brief Looks up an open file
+ * @details Does not access the file system. Expired entries are removed instead of returned.
+ * @param cache cache to search
+ * @param path resolved path of the file
+ * @return referenced entry which has to be released with fdcache_release, NULL if the file is not cached
+ */
+fdcache_entry_t *fdcache_get(fdcache_t *cache, const char *path);
+
+/**
+ * @brief Opens a file through the cache
+ * @details Returns the cached entry of path or opens the file with the open function of the cache. Least recently
+ * used entries are evicted to make room. Files which are not regular are not cached, the returned entry is closed
+ * once it is released.
+ * @param cache cache to open with
+ * @param path resolved path of the file
+ * @return referenced entry which has to be released with fdcache_release, NULL on failure with errno set
+ */
+fdcache_entry_t *fdcache_open(fdcache_t *cache, const char *path);
+
+/**
+ * @brief Releases a referenced entry
+ * @param entry entry returned by fdcache_get or fdcache_open
+ */
+void fdcache_release(fdcache_entry_t *entry);
+
+#endif //UE3_FDCACHE_H
@@ -1,11 +1,26 @@
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_SCAN_X86
+#endif
 
 #include "http.h"
 
@@ -25,251 +40,1877 @@ static char *HTTP_METHOD_STRINGS[] = {
 };
 
 /**
- * @brief Extracts header from stream
- * @param stream Stream aligned to first header
- * @param buf Existing buffer from readline, or null
- * @param line_n Existing line_n from readline, or 0
+ * Function finding the first byte of [p, end) which is contained in set
+ */
+typedef const char *(*scan_fn)(const char *p, const char *end, const char *set, int set_ln);
+
+/**
+ * @brief Resolves a method token
+ * @details Dispatches on length and first character, so at most one string compare is needed.
+ * @param token method token
+ * @param ln length of token
+ * @return method, or -1 if it is unknown
+ */
+static int lookup_method(const char *token, size_t ln) {
+    http_method method;
+    switch (ln) {
+        case 3:
+            method = token[0] == 'G' ? HTTP_GET : HTTP_PUT;
+            break;
+        case 4:
+            method = token[0] == 'H' ? HTTP_HEAD : HTTP_POST;
+            break;
+        case 5:
+            method = token[0] == 'P' ? HTTP_PATCH : HTTP_TRACE;
+            break;
+        case 6:
+            method = HTTP_DELETE;
+            break;
+        case 7:
+            method = token[0] == 'C' ? HTTP_CONNECT : HTTP_OPTIONS;
+            break;
+        default:
+            return -1;
+    }
+    return memcmp(token, HTTP_METHOD_STRINGS[method], ln) == 0 ? (int) method : -1;
+}
+
+/**
+ * Names of the known headers
+ */
+static const char *HTTP_KNOWN_HEADER_STRINGS[] = {
+        [HTTP_HEADER_HOST] = "Host",
+        [HTTP_HEADER_CONNECTION] = "Connection",
+        [HTTP_HEADER_CONTENT_LENGTH] = "Content-Length",
+        [HTTP_HEADER_CONTENT_TYPE] = "Content-Type",
+        [HTTP_HEADER_CONTENT_ENCODING] = "Content-Encoding",
+        [HTTP_HEADER_CONTENT_RANGE] = "Content-Range",
+        [HTTP_HEADER_TRANSFER_ENCODING] = "Transfer-Encoding",
+        [HTTP_HEADER_ACCEPT_ENCODING] = "Accept-Encoding",
+        [HTTP_HEADER_EXPECT] = "Expect",
+        [HTTP_HEADER_RANGE] = "Range",
+        [HTTP_HEADER_IF_RANGE] = "If-Range",
+        [HTTP_HEADER_IF_NONE_MATCH] = "If-None-Match",
+        [HTTP_HEADER_IF_MODIFIED_SINCE] = "If-Modified-Since",
+        [HTTP_HEADER_ETAG] = "ETag",
+        [HTTP_HEADER_LAST_MODIFIED] = "Last-Modified"
+};
+
+/**
+ * @brief Resolves a header key to a known header
+ * @details Dispatches on length and first character, which is unique among the known headers of the same length, so
+ * at most one case-insensitive string compare is needed.
+ * @param key header key
+ * @param ln length of key
+ * @return known header, or -1 if the header is not a known one
+ */
+static int lookup_known_header(const char *key, size_t ln) {
+    http_known_header known;
+    char first = key[0] | 0x20; // lower case for letters
+    switch (ln) {
+        case 4:
+            known = first == 'h' ? HTTP_HEADER_HOST : HTTP_HEADER_ETAG;
+            break;
+        case 5:
+            known = HTTP_HEADER_RANGE;
+            break;
+        case 6:
+            known = HTTP_HEADER_EXPECT;
+            break;
+        case 8:
+            known = HTTP_HEADER_IF_RANGE;
+            break;
+        case 10:
+            known = HTTP_HEADER_CONNECTION;
+            break;
+        case 12:
+            known = HTTP_HEADER_CONTENT_TYPE;
+            break;
+        case 13:
+            if (first == 'c') {
+                known = HTTP_HEADER_CONTENT_RANGE;
+            } else if (first == 'i') {
+                known = HTTP_HEADER_IF_NONE_MATCH;
+            } else {
+                known = HTTP_HEADER_LAST_MODIFIED;
+            }
+            break;
+        case 14:
+            known = HTTP_HEADER_CONTENT_LENGTH;
+            break;
+        case 15:
+            known = HTTP_HEADER_ACCEPT_ENCODING;
+            break;
+        case 16:
+            known = HTTP_HEADER_CONTENT_ENCODING;
+            break;
+        case 17:
+            known = first == 't' ? HTTP_HEADER_TRANSFER_ENCODING : HTTP_HEADER_IF_MODIFIED_SINCE;
+            break;
+        default:
+            return -1;
+    }
+    return strncasecmp(key, HTTP_KNOWN_HEADER_STRINGS[known], ln) == 0 ? (int) known : -1;
+}
+
+/**
+ * @brief Finds the first delimiter, one byte at a time
+ * @param p start of the buffer
+ * @param end end of the buffer
+ * @param set delimiters to look for
+ * @param set_ln number of delimiters, at most 4
+ * @return first delimiter, or end if there is none
+ */
+static const char *scan_scalar(const char *p, const char *end, const char *set, int set_ln) {
+    for (; p < end; p++) {
+        for (int i = 0; i < set_ln; i++) {
+            if (*p == set[i]) {
+                return p;
+            }
+        }
+    }
+    return end;
+}
+
+#ifdef HTTP_SCAN_X86
+/**
+ * @brief Finds the first delimiter, 16 bytes at a time using SSE4.2 string instructions
+ * @details See scan_scalar.
+ */
+__attribute__((target("sse4.2")))
+static const char *scan_sse42(const char *p, const char *end, const char *set, int set_ln) {
+    char set_buf[16] = { 0 };
+    memcpy(set_buf, set, set_ln);
+    __m128i needles = _mm_loadu_si128((const __m128i *) set_buf);
+
+    for (; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) p);
+        int index = _mm_cmpestri(needles, set_ln, chunk, 16,
+                                 _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+        if (index < 16) {
+            return p + index;
+        }
+    }
+    return scan_scalar(p, end, set, set_ln);
+}
+
+/**
+ * @brief Finds the first delimiter, 32 bytes at a time using AVX2 compares
+ * @details See scan_scalar.
+ */
+__attribute__((target("avx2")))
+static const char *scan_avx2(const char *p, const char *end, const char *set, int set_ln) {
+    __m256i needles[4];
+    for (int i = 0; i < set_ln; i++) {
+        needles[i] = _mm256_set1_epi8(set[i]);
+    }
+
+    for (; end - p >= 32; p += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *) p);
+        __m256i match = _mm256_cmpeq_epi8(chunk, needles[0]);
+        for (int i = 1; i < set_ln; i++) {
+            match = _mm256_or_si256(match, _mm256_cmpeq_epi8(chunk, needles[i]));
+        }
+
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8(match);
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+    return scan_scalar(p, end, set, set_ln);
+}
+#endif
+
+/**
+ * Delimiter scanner used by the parser, selected for the CPU at startup
+ */
+static scan_fn scan_any = scan_scalar;
+
+/**
+ * @brief Selects the fastest delimiter scanner supported by the CPU
+ */
+__attribute__((constructor))
+static void init_scan(void) {
+#ifdef HTTP_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_any = scan_avx2;
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        scan_any = scan_sse42;
+    }
+#endif
+}
+
+/**
+ * @brief Finds the first occurrence of a byte
+ * @param p start of the buffer
+ * @param end end of the buffer
+ * @param c byte to look for
+ * @return first occurrence, or end if there is none
+ */
+static inline char *scan_char(char *p, char *end, char c) {
+    return (char *) scan_any(p, end, &c, 1);
+}
+
+/**
+ * @brief Finds the end of an HTTP head
+ * @param buf start of the buffer
+ * @param ln number of bytes in buf
+ * @return pointer directly after the empty line terminating the head, NULL if the head is incomplete
+ */
+static char *find_head_end(char *buf, size_t ln) {
+    char *end = &buf[ln];
+    for (char *p = scan_char(buf, end, '\r'); end - p >= 4; p = scan_char(p + 1, end, '\r')) {
+        if (p[1] == '\n' && p[2] == '\r' && p[3] == '\n') {
+            return p + 4;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Alignment of arena allocations
+ */
+#define ARENA_ALIGN 16
+
+void http_arena_init(http_arena *arena, void *buf, size_t size) {
+    arena->buf = buf;
+    arena->size = size;
+    arena->used = 0;
+}
+
+void *http_arena_alloc(http_arena *arena, size_t size) {
+    uintptr_t base = (uintptr_t) arena->buf;
+    size_t start = ((base + arena->used + ARENA_ALIGN - 1) & ~(uintptr_t) (ARENA_ALIGN - 1)) - base;
+    if (start > arena->size || size > arena->size - start) {
+        return NULL;
+    }
+    arena->used = start + size;
+    return &arena->buf[start];
+}
+
+void http_arena_reset(http_arena *arena) {
+    arena->used = 0;
+}
+
+/**
+ * @brief Extracts header from a buffered HTTP head
+ * @details Headers are parsed in place: key and value point into buf and are terminated there. Only the header array is
+ * allocated from arena. Its elements are allocated one by one, which keeps them contiguous as long as nothing else is
+ * allocated from arena in between, so the array never has to be moved. Known headers are recorded in known as they are
+ * parsed.
+ * @param buf First header line
+ * @param end End of the head, directly after the empty line terminating it, as found by find_head_end
+ * @param arena Arena the header array is allocated from
  * @param header_ln Number of headers will be written into here
+ * @param known Array of HTTP_KNOWN_HEADER_LN entries, which will be filled with the known headers
  * @param err Error code will be written here on error
  * @return Array of http_header, or NULL on failure
  */
-static http_header *extract_header(FILE *stream, char *buf, size_t *line_n, size_t *header_ln, int *err) {
-    http_header *header = malloc(2 * sizeof(http_header));
+static http_header *extract_header(char *buf, char *end, http_arena *arena, size_t *header_ln, http_header **known,
+                                   int *err) {
+    memset(known, 0, HTTP_KNOWN_HEADER_LN * sizeof(http_header *));
+
+    // http_header is a multiple of ARENA_ALIGN, so a zero-sized allocation marks where the array starts
+    http_header *header = http_arena_alloc(arena, 0);
     if (header == NULL) {
-        free(header);
-        *err = -1;
+        *err = -3;
         return NULL;
     }
     for (size_t i = 0; ; i++) {
-        if (getline(&buf, line_n, stream) == -1) {
-            free(header);
-            *err = errno == EOF ? -3 : -1;
-            return NULL;
-        }
-
-        if (strcmp(buf, "\r\n") == 0) {
+        if (buf[0] == '\r') {
+            if (buf[1] != '\n') {
+                *err = -3;
+                return NULL;
+            }
             *header_ln = i;
             return header;
         }
 
-        // if i is power of two, array is full
-        if ((i >= 2) && ((i & (i - 1)) == 0)) {
-            http_header *new_ptr = realloc(header, 2 * i * sizeof(http_header));
-            if (new_ptr == NULL) {
-                free(header);
-                *err = -1;
-                return NULL;
-            }
-            header = new_ptr;
+        if (http_arena_alloc(arena, sizeof(http_header)) != &header[i]) {
+            *err = -3;
+            return NULL;
         }
 
-        size_t delimer = strcspn(buf, ":");
-        if (buf[delimer] != ':') {
-            free(header);
+        // A line break before the colon means the line is malformed
+        char *delimer = (char *) scan_any(buf, end, ":\r", 2);
+        if (*delimer != ':') {
             *err = -3;
             return NULL;
         }
 
-        char *key = strndup(buf, delimer);
-        if (key == NULL) {
-            free(header);
-            *err = -1;
+        char *line_end = scan_char(delimer, end, '\r');
+        if (line_end[1] != '\n') {
+            *err = -3;
             return NULL;
         }
 
-        char *value = &buf[delimer + 1 + strspn(&buf[delimer + 1], " ")];
-        value = strndup(value,strcspn(value,"\r\n"));
-        if (value == NULL) {
-            free(header);
-            free(key);
-            *err = -1;
-            return NULL;
+        char *value = delimer + 1;
+        while (value < line_end && *value == ' ') {
+            value++;
         }
 
-        header[i] = (http_header) { .key = key, .value = value };
+        header[i] = (http_header) { .key = buf, .key_ln = delimer - buf, .value = value, .value_ln = line_end - value };
+        int known_index = lookup_known_header(buf, delimer - buf);
+        if (known_index != -1 && known[known_index] == NULL) {
+            known[known_index] = &header[i];
+        }
+        *delimer = '\0';
+        *line_end = '\0';
+        buf = line_end + 2;
     }
 }
 
-FILE *init_client_conn(char *addr, char *port, const char **err) {
-    struct addrinfo req = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM};
-    struct addrinfo *pai;
-    int res = getaddrinfo(addr, port, &req, &pai);
-    if (res == EAI_SYSTEM) {
-        return NULL;
-    } else if (res != 0) {
-        *err = gai_strerror(res);
-        return NULL;
+/**
+ * Size of a new buffer holding a received head and the arena behind it. Buffers of this size are recycled.
+ */
+#define HEAD_BUF_SIZE 8192
+
+/**
+ * Thread-specific key holding the buffer of the head freed last on a thread, which the next head received on the same
+ * thread reuses, so receiving a head allocates nothing in the steady state
+ */
+static pthread_key_t spare_head_key;
+
+/**
+ * Whether spare_head_key has been created, buffers are not recycled otherwise
+ */
+static int spare_head_enabled = 0;
+
+/**
+ * Initializes spare_head_key once
+ */
+static pthread_once_t spare_head_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Frees the block of a head buffer
+ * @param head head buffer, or NULL
+ */
+static void head_release(void *head) {
+    if (head != NULL) {
+        free((char *) head - ARENA_ALIGN);
     }
+}
 
-    int fd = socket(pai->ai_family, pai->ai_socktype, pai->ai_protocol);
-    if (fd == -1) {
-        freeaddrinfo(pai);
+/**
+ * @brief Creates spare_head_key
+ * @details The spare buffer of a thread is freed when the thread exits.
+ */
+static void spare_head_init(void) {
+    spare_head_enabled = pthread_key_create(&spare_head_key, head_release) == 0;
+}
+
+/**
+ * @brief Returns the capacity of a head buffer
+ * @details The capacity is stored in front of the buffer, in ARENA_ALIGN bytes which keep the buffer aligned.
+ * @param head head buffer
+ * @return size of the buffer in bytes
+ */
+static size_t head_capacity(char *head) {
+    return *(size_t *) (head - ARENA_ALIGN);
+}
+
+/**
+ * @brief Allocates a head buffer
+ * @details Reuses the spare buffer of the calling thread if it is large enough.
+ * @param size minimum size of the buffer
+ * @return buffer of at least size and HEAD_BUF_SIZE bytes, to be freed with head_free, NULL on failure
+ */
+static char *head_alloc(size_t size) {
+    pthread_once(&spare_head_once, spare_head_init);
+    if (spare_head_enabled && size <= HEAD_BUF_SIZE) {
+        char *spare = pthread_getspecific(spare_head_key);
+        if (spare != NULL) {
+            pthread_setspecific(spare_head_key, NULL);
+            return spare;
+        }
+    }
+
+    size_t capacity = size > HEAD_BUF_SIZE ? size : HEAD_BUF_SIZE;
+    char *block = malloc(ARENA_ALIGN + capacity);
+    if (block == NULL) {
         return NULL;
     }
+    *(size_t *) block = capacity;
+    return block + ARENA_ALIGN;
+}
 
-    if (connect(fd, pai->ai_addr, pai->ai_addrlen) == -1) {
-        freeaddrinfo(pai);
-        close(fd);
+/**
+ * @brief Grows a head buffer
+ * @param head head buffer, freed on failure
+ * @param size new size of the buffer
+ * @return grown buffer, NULL on failure
+ */
+static char *head_grow(char *head, size_t size) {
+    char *block = realloc(head - ARENA_ALIGN, ARENA_ALIGN + size);
+    if (block == NULL) {
+        head_release(head);
         return NULL;
     }
+    *(size_t *) block = size;
+    return block + ARENA_ALIGN;
+}
 
-    freeaddrinfo(pai);
-    FILE *stream = fdopen(fd, "r+");
-    if (stream == NULL) {
-        close(fd);
+/**
+ * @brief Frees a head buffer
+ * @details Buffers of HEAD_BUF_SIZE bytes are kept as spare buffer of the calling thread if it has none yet.
+ * @param head head buffer, or NULL
+ */
+static void head_free(char *head) {
+    if (head != NULL && spare_head_enabled && head_capacity(head) == HEAD_BUF_SIZE &&
+        pthread_getspecific(spare_head_key) == NULL && pthread_setspecific(spare_head_key, head) == 0) {
+        return;
+    }
+    head_release(head);
+}
+
+/**
+ * @brief Reads a complete HTTP head from stream
+ * @details Reads lines from stream until the empty line terminating the head, directly into a buffer of HEAD_BUF_SIZE
+ * bytes which is doubled if the head does not fit. An arena large enough for the header array of the head is placed
+ * behind the head in the same buffer. Heads containing a NUL byte are rejected.
+ * @param stream open socket
+ * @param head_ln Length of the head will be written into here
+ * @param arena Will be initialized with the space behind the head
+ * @param err Error code will be written here on error, -2 if the stream ended before the head or it contains a NUL
+ * @return buffer containing the head, to be freed with head_free, or NULL on failure
+ */
+static char *read_head(FILE *stream, size_t *head_ln, http_arena *arena, int *err) {
+    char *head = head_alloc(HEAD_BUF_SIZE);
+    if (head == NULL) {
+        *err = -1;
         return NULL;
     }
+    size_t size = head_capacity(head);
+    size_t ln = 0;
+    size_t line_start = 0;
+    size_t line_count = 0;
 
-    return stream;
+    while (1) {
+        if (fgets(&head[ln], (int) (size - ln), stream) == NULL) {
+            *err = feof(stream) ? -2 : -1;
+            head_free(head);
+            return NULL;
+        }
+
+        // fgets stops after a line break or once the buffer is full, anything else is the end of the stream or a NUL
+        size_t read_ln = strlen(&head[ln]);
+        ln += read_ln;
+        if (read_ln == 0 || (head[ln - 1] != '\n' && ln + 1 < size)) {
+            *err = ferror(stream) ? -1 : -2;
+            head_free(head);
+            return NULL;
+        } else if (head[ln - 1] != '\n') {
+            size *= 2;
+            head = head_grow(head, size);
+            if (head == NULL) {
+                *err = -1;
+                return NULL;
+            }
+            continue;
+        }
+
+        line_count++;
+        if (ln - line_start == 2 && head[line_start] == '\r') {
+            break;
+        }
+        line_start = ln;
+    }
+
+    size_t arena_pos = ln + 1;
+    size_t arena_size = line_count * sizeof(http_header) + 2 * ARENA_ALIGN;
+    if (arena_pos + arena_size > size) {
+        size = arena_pos + arena_size;
+        head = head_grow(head, size);
+        if (head == NULL) {
+            *err = -1;
+            return NULL;
+        }
+    }
+
+    http_arena_init(arena, &head[arena_pos], size - arena_pos);
+    *head_ln = ln;
+    return head;
+}
+
+/**
+ * Struct representing the transport of an HTTP message, either a stdio stream or an http_conn
+ * The FILE based functions and the http_conn functions share their implementation through it.
+ */
+typedef struct {
+    FILE *stream;
+    http_conn *conn;
+} http_io;
+
+/**
+ * Maximum number of buffers gathered into one write
+ */
+#define GATHER_IOV 64
+
+/**
+ * Struct representing output which is collected and written with a single writev
+ */
+typedef struct {
+    http_io *io;
+    struct iovec iov[GATHER_IOV];
+    int ln;
+} gather_t;
+
+/**
+ * @brief Reads more data into the buffer of a connection
+ * @details Moves unread data to the start of the buffer first, if the buffer is full.
+ * @param conn connection to read from
+ * @return number of bytes read, 0 at the end of the stream, -1 on failure
+ */
+static ssize_t conn_fill(http_conn *conn) {
+    if (conn->pos > 0 && conn->ln == HTTP_CONN_BUF_SIZE) {
+        conn->ln -= conn->pos;
+        memmove(conn->buf, &conn->buf[conn->pos], conn->ln);
+        conn->pos = 0;
+    } else if (conn->pos == conn->ln) {
+        conn->pos = 0;
+        conn->ln = 0;
+    }
+
+    while (1) {
+        ssize_t read_ln = read(conn->fd, &conn->buf[conn->ln], HTTP_CONN_BUF_SIZE - conn->ln);
+        if (read_ln == -1 && errno == EINTR) {
+            continue;
+        } else if (read_ln == -1) {
+            conn->error = errno;
+        } else if (read_ln == 0) {
+            conn->eof = 1;
+        } else {
+            conn->ln += read_ln;
+        }
+        return read_ln;
+    }
+}
+
+/**
+ * @brief Reads a byte
+ * @param io transport to read from
+ * @return byte read, EOF at the end of the stream or on failure
+ */
+static int io_getc(http_io *io) {
+    if (io->stream != NULL) {
+        return getc(io->stream);
+    }
+    http_conn *conn = io->conn;
+    if (conn->pos == conn->ln && conn_fill(conn) <= 0) {
+        return EOF;
+    }
+    return (unsigned char) conn->buf[conn->pos++];
+}
+
+/**
+ * @brief Reads a number of bytes
+ * @details Like fread, blocks until ln bytes have been read or the stream ended. Reads of at least a buffer size go
+ * to buf directly, without copying them through the buffer of a connection.
+ * @param io transport to read from
+ * @param buf buffer to read into
+ * @param ln number of bytes to read
+ * @return number of bytes read, less than ln at the end of the stream or on failure
+ */
+static size_t io_read(http_io *io, char *buf, size_t ln) {
+    if (io->stream != NULL) {
+        return fread(buf, 1, ln, io->stream);
+    }
+
+    http_conn *conn = io->conn;
+    size_t read_ln = 0;
+    while (read_ln < ln) {
+        if (conn->pos < conn->ln) {
+            size_t copy_ln = conn->ln - conn->pos < ln - read_ln ? conn->ln - conn->pos : ln - read_ln;
+            memcpy(&buf[read_ln], &conn->buf[conn->pos], copy_ln);
+            conn->pos += copy_ln;
+            read_ln += copy_ln;
+        } else if (ln - read_ln >= HTTP_CONN_BUF_SIZE) {
+            ssize_t direct_ln = read(conn->fd, &buf[read_ln], ln - read_ln);
+            if (direct_ln == -1 && errno == EINTR) {
+                continue;
+            } else if (direct_ln == -1) {
+                conn->error = errno;
+                break;
+            } else if (direct_ln == 0) {
+                conn->eof = 1;
+                break;
+            }
+            read_ln += direct_ln;
+        } else if (conn_fill(conn) <= 0) {
+            break;
+        }
+    }
+    return read_ln;
+}
+
+/**
+ * @brief Checks whether reading failed
+ * @details Restores errno of the failed read for connections, as it may have been overwritten since.
+ * @param io transport to check
+ * @return nonzero if a read failed, 0 otherwise
+ */
+static int io_error(http_io *io) {
+    if (io->stream != NULL) {
+        return ferror(io->stream);
+    } else if (io->conn->error != 0) {
+        errno = io->conn->error;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes several buffers completely
+ * @details Connections write the buffers with writev, streams buffer them.
+ * @param io transport to write to
+ * @param iov buffers to write, modified for connections
+ * @param iov_ln number of buffers
+ * @return 0 on success, -1 on failure
+ */
+static int io_writev(http_io *io, struct iovec *iov, int iov_ln) {
+    if (io->stream != NULL) {
+        for (int i = 0; i < iov_ln; i++) {
+            if (fwrite(iov[i].iov_base, 1, iov[i].iov_len, io->stream) < iov[i].iov_len) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    while (iov_ln > 0) {
+        ssize_t write_ln = writev(io->conn->fd, iov, iov_ln);
+        if (write_ln == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (iov_ln > 0 && (size_t) write_ln >= iov->iov_len) {
+            write_ln -= iov->iov_len;
+            iov++;
+            iov_ln--;
+        }
+        if (iov_ln > 0) {
+            iov->iov_base = (char *) iov->iov_base + write_ln;
+            iov->iov_len -= write_ln;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes a buffer completely
+ * @param io transport to write to
+ * @param buf data to write
+ * @param ln number of bytes to write
+ * @return 0 on success, -1 on failure
+ */
+static int io_write(http_io *io, const char *buf, size_t ln) {
+    struct iovec iov = { .iov_base = (char *) buf, .iov_len = ln };
+    return io_writev(io, &iov, 1);
+}
+
+/**
+ * @brief Flushes buffered output
+ * @param io transport to flush, connections do not buffer output
+ * @return 0 on success, -1 on failure
+ */
+static int io_flush(http_io *io) {
+    return io->stream != NULL && fflush(io->stream) == EOF ? -1 : 0;
+}
+
+/**
+ * @brief Returns the file descriptor of a transport
+ * @param io transport
+ * @return file descriptor, -1 for streams without one
+ */
+static int io_fd(http_io *io) {
+    return io->stream != NULL ? fileno(io->stream) : io->conn->fd;
+}
+
+/**
+ * @brief Appends a buffer to gathered output
+ * @details The buffer must stay valid until the output is flushed. Writes the gathered buffers if no entry is left.
+ * @param gather output to append to
+ * @param buf data to append
+ * @param ln number of bytes
+ * @return 0 on success, -1 on failure
+ */
+static int gather_add(gather_t *gather, const char *buf, size_t ln) {
+    if (gather->ln == GATHER_IOV) {
+        if (io_writev(gather->io, gather->iov, gather->ln) == -1) {
+            return -1;
+        }
+        gather->ln = 0;
+    }
+    gather->iov[gather->ln++] = (struct iovec) { .iov_base = (char *) buf, .iov_len = ln };
+    return 0;
+}
+
+/**
+ * @brief Writes all gathered buffers
+ * @param gather output to write
+ * @return 0 on success, -1 on failure
+ */
+static int gather_flush(gather_t *gather) {
+    int result = io_writev(gather->io, gather->iov, gather->ln);
+    gather->ln = 0;
+    return result;
+}
+
+/**
+ * @brief Reads a complete HTTP head from a connection
+ * @details Waits until the buffer of the connection holds a complete head and copies it into a head buffer, with room
+ * for an arena behind it like read_head. Heads larger than the buffer of the connection are rejected.
+ * @param conn open connection
+ * @param head_ln Length of the head will be written into here
+ * @param arena Will be initialized with the space behind the head
+ * @param err Error code will be written here on error, -2 if the stream ended before the head or it is too large
+ * @return buffer containing the head, to be freed with head_free, or NULL on failure
+ */
+static char *read_head_conn(http_conn *conn, size_t *head_ln, http_arena *arena, int *err) {
+    char *end;
+    while ((end = find_head_end(&conn->buf[conn->pos], conn->ln - conn->pos)) == NULL) {
+        if (conn->pos == 0 && conn->ln == HTTP_CONN_BUF_SIZE) {
+            *err = -2;
+            return NULL;
+        }
+        ssize_t read_ln = conn_fill(conn);
+        if (read_ln <= 0) {
+            *err = read_ln == 0 ? -2 : -1;
+            return NULL;
+        }
+    }
+
+    char *start = &conn->buf[conn->pos];
+    size_t ln = end - start;
+    size_t line_count = 0;
+    for (char *p = start; p < end; p++) {
+        line_count += *p == '\n';
+    }
+
+    size_t arena_pos = ln + 1;
+    size_t arena_size = line_count * sizeof(http_header) + 2 * ARENA_ALIGN;
+    char *head = head_alloc(arena_pos + arena_size);
+    if (head == NULL) {
+        *err = -1;
+        return NULL;
+    }
+    memcpy(head, start, ln);
+    head[ln] = '\0';
+    conn->pos += ln;
+
+    http_arena_init(arena, &head[arena_pos], head_capacity(head) - arena_pos);
+    *head_ln = ln;
+    return head;
+}
+
+/**
+ * @brief Reads a complete HTTP head from a transport
+ * @see read_head
+ */
+static char *io_read_head(http_io *io, size_t *head_ln, http_arena *arena, int *err) {
+    if (io->stream != NULL) {
+        return read_head(io->stream, head_ln, arena, err);
+    }
+    return read_head_conn(io->conn, head_ln, arena, err);
+}
+
+/**
+ * @brief Checks whether the Connection header allows to keep the connection open
+ * @details HTTP/1.1 connections are persistent unless "close" is sent.
+ * @param connection Connection header, or NULL
+ * @return 1 if the connection may be kept open, 0 otherwise
+ */
+static int is_keep_alive(http_header *connection) {
+    return connection == NULL || strcasecmp(connection->value, "close") != 0;
+}
+
+/**
+ * @brief Checks whether a body uses the chunked transfer coding
+ * @param transfer_encoding Transfer-Encoding header, or NULL
+ * @return 1 if chunked is the final transfer coding, 0 otherwise
+ */
+static int is_chunked(http_header *transfer_encoding) {
+    if (transfer_encoding == NULL) {
+        return 0;
+    }
+    const char *coding = strrchr(transfer_encoding->value, ',');
+    coding = coding == NULL ? transfer_encoding->value : coding + 1;
+    while (*coding == ' ' || *coding == '\t') {
+        coding++;
+    }
+    size_t coding_ln = strcspn(coding, " \t");
+    return coding_ln == 7 && strncasecmp(coding, "chunked", 7) == 0 && coding[strspn(&coding[7], " \t") + 7] == '\0';
+}
+
+/**
+ * @brief Parses a Content-Length header
+ * @param content_length Content-Length header, or NULL
+ * @param value parsed length will be written here, -1 if there is no header
+ * @return 0 on success, -1 if the value is not a valid length
+ */
+static int parse_content_length(http_header *content_length, long *value) {
+    *value = -1;
+    if (content_length == NULL) {
+        return 0;
+    }
+
+    char *endptr;
+    errno = 0;
+    *value = strtol(content_length->value, &endptr, 10);
+    while (*endptr == ' ' || *endptr == '\t') {
+        endptr++;
+    }
+    if (errno != 0 || endptr == content_length->value || *endptr != '\0' || *value < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+char *get_header(http_header *header, size_t header_ln, const char *key) {
+    for (size_t i = 0; i < header_ln; i++) {
+        if (strcasecmp(header[i].key, key) == 0) {
+            return header[i].value;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Connects to the first reachable address
+ * @param ai list of addresses to try in order
+ * @return connected socket, -1 on failure
+ */
+static int connect_addrinfo(struct addrinfo *ai) {
+    int err_code = EADDRNOTAVAIL;
+    for (; ai != NULL; ai = ai->ai_next) {
+        int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd == -1) {
+            err_code = errno;
+            continue;
+        }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            return fd;
+        }
+        err_code = errno;
+        close(fd);
+    }
+    errno = err_code;
+    return -1;
+}
+
+/**
+ * @brief Resolves a host and connects to it
+ * @param addr host to connect to
+ * @param port port to connect to
+ * @param err error message - is populated if -1 is returned and errno is not set
+ * @return connected socket, -1 on failure
+ */
+static int connect_host(char *addr, char *port, const char **err) {
+    struct addrinfo req = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *pai;
+    int res = getaddrinfo(addr, port, &req, &pai);
+    if (res == EAI_SYSTEM) {
+        return -1;
+    } else if (res != 0) {
+        *err = gai_strerror(res);
+        return -1;
+    }
+
+    int fd = connect_addrinfo(pai);
+    freeaddrinfo(pai);
+    return fd;
+}
+
+FILE *init_client_conn(char *addr, char *port, const char **err) {
+    int fd = connect_host(addr, port, err);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    FILE *stream = fdopen(fd, "r+");
+    if (stream == NULL) {
+        int err_code = errno;
+        close(fd);
+        errno = err_code;
+    }
+    return stream;
+}
+
+http_conn *http_conn_open(int fd) {
+    http_conn *conn = malloc(sizeof(http_conn));
+    if (conn == NULL) {
+        int err_code = errno;
+        close(fd);
+        errno = err_code;
+        return NULL;
+    }
+    conn->fd = fd;
+    conn->eof = 0;
+    conn->error = 0;
+    conn->pos = 0;
+    conn->ln = 0;
+    return conn;
+}
+
+http_conn *http_conn_connect(char *addr, char *port, const char **err) {
+    int fd = connect_host(addr, port, err);
+    if (fd == -1) {
+        return NULL;
+    }
+    return http_conn_open(fd);
+}
+
+void http_conn_close(http_conn *conn) {
+    close(conn->fd);
+    free(conn);
+}
+
+/**
+ * Seconds an idle pooled connection is kept, servers close idle connections after a timeout as well
+ */
+#define POOL_IDLE_TIMEOUT 10
+
+/**
+ * Maximum number of addresses of a host tried when connecting
+ */
+#define POOL_MAX_ADDRS 8
+
+/**
+ * Struct representing a cached DNS result
+ */
+typedef struct pool_dns_s {
+    char *key; // "host:port"
+    struct addrinfo ai[POOL_MAX_ADDRS]; // linked list of copies, ai_addr points into addr
+    struct sockaddr_storage addr[POOL_MAX_ADDRS];
+    size_t ln;
+    time_t expires;
+    struct pool_dns_s *next;
+} pool_dns;
+
+/**
+ * Struct representing an idle pooled connection
+ */
+typedef struct pool_conn_s {
+    char *key; // "host:port"
+    http_conn *conn;
+    time_t idle_since;
+    struct pool_conn_s *next;
+} pool_conn;
+
+struct http_pool_s {
+    pthread_mutex_t lock;
+    size_t max_idle;
+    size_t idle_ln;
+    time_t dns_ttl;
+    pool_dns *dns;
+    pool_conn *idle; // most recently returned first
+};
+
+/**
+ * @brief Returns the time of the monotonic clock in seconds
+ */
+static time_t pool_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/**
+ * @brief Builds the key of an origin
+ * @return newly allocated "addr:port", NULL on failure
+ */
+static char *pool_key(const char *addr, const char *port) {
+    char *key = malloc(strlen(addr) + strlen(port) + 2);
+    if (key != NULL) {
+        sprintf(key, "%s:%s", addr, port);
+    }
+    return key;
+}
+
+/**
+ * @brief Checks whether an idle connection is still usable
+ * @details An idle connection must neither have buffered input nor be readable; if it is, the server has closed it or
+ * sent unexpected data.
+ * @param conn idle connection
+ * @return 1 if the connection can be reused, 0 otherwise
+ */
+static int is_conn_idle(http_conn *conn) {
+    struct pollfd pfd = {.fd = conn->fd, .events = POLLIN};
+    return conn->pos == conn->ln && !conn->eof && !conn->error && poll(&pfd, 1, 0) == 0;
+}
+
+/**
+ * @brief Copies the addresses of a DNS result into a cache entry
+ * @details Key and next of the entry are left untouched.
+ * @param dns entry to fill, its list is linked in the order of ai
+ * @param ai result of getaddrinfo
+ * @return number of copied addresses
+ */
+static size_t pool_dns_fill(pool_dns *dns, struct addrinfo *ai) {
+    size_t ln = 0;
+    for (; ai != NULL && ln < POOL_MAX_ADDRS; ai = ai->ai_next) {
+        if (ai->ai_addrlen > sizeof(struct sockaddr_storage)) {
+            continue;
+        }
+        memcpy(&dns->addr[ln], ai->ai_addr, ai->ai_addrlen);
+        dns->ai[ln] = *ai;
+        dns->ai[ln].ai_addr = (struct sockaddr *) &dns->addr[ln];
+        dns->ai[ln].ai_canonname = NULL;
+        dns->ai[ln].ai_next = NULL;
+        if (ln > 0) {
+            dns->ai[ln - 1].ai_next = &dns->ai[ln];
+        }
+        ln++;
+    }
+    return ln;
+}
+
+/**
+ * @brief Resolves an origin, using the DNS cache of a pool
+ * @details Only lookups are done under the lock of the pool, getaddrinfo is called without holding it.
+ * @param pool pool holding the cache
+ * @param key key of the origin
+ * @param addr host to resolve
+ * @param port port to resolve
+ * @param result copy of the cached result will be written here, its list starts at result->ai
+ * @param err error message - is populated if -1 is returned and errno is not set
+ * @return 0 on success, -1 on failure
+ */
+static int pool_resolve(http_pool *pool, const char *key, char *addr, char *port, pool_dns *result,
+                        const char **err) {
+    time_t now = pool_now();
+    pthread_mutex_lock(&pool->lock);
+    pool_dns **link = &pool->dns;
+    while (*link != NULL && strcmp((*link)->key, key) != 0) {
+        link = &(*link)->next;
+    }
+    if (*link != NULL && (*link)->expires > now) {
+        // The copied list has to be relinked into the copies of its nodes
+        *result = **link;
+        for (size_t i = 0; i < result->ln; i++) {
+            result->ai[i].ai_addr = (struct sockaddr *) &result->addr[i];
+            result->ai[i].ai_next = i + 1 < result->ln ? &result->ai[i + 1] : NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    struct addrinfo req = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *pai;
+    int res = getaddrinfo(addr, port, &req, &pai);
+    if (res == EAI_SYSTEM) {
+        return -1;
+    } else if (res != 0) {
+        *err = gai_strerror(res);
+        return -1;
+    }
+    result->ln = pool_dns_fill(result, pai);
+    freeaddrinfo(pai);
+    if (result->ln == 0) {
+        *err = gai_strerror(EAI_NONAME);
+        return -1;
+    }
+    result->expires = now + pool->dns_ttl;
+
+    // Caching is best effort, the result is used even if it cannot be stored
+    pthread_mutex_lock(&pool->lock);
+    link = &pool->dns;
+    while (*link != NULL && strcmp((*link)->key, key) != 0) {
+        link = &(*link)->next;
+    }
+    pool_dns *dns = *link;
+    if (dns == NULL) {
+        dns = malloc(sizeof(pool_dns));
+        if (dns != NULL && (dns->key = strdup(key)) == NULL) {
+            free(dns);
+            dns = NULL;
+        } else if (dns != NULL) {
+            dns->next = pool->dns;
+            pool->dns = dns;
+        }
+    }
+    if (dns != NULL) {
+        dns->ln = pool_dns_fill(dns, result->ai);
+        dns->expires = result->expires;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+http_pool *http_pool_create(size_t max_idle, time_t dns_ttl) {
+    http_pool *pool = malloc(sizeof(http_pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    if ((errno = pthread_mutex_init(&pool->lock, NULL)) != 0) {
+        free(pool);
+        return NULL;
+    }
+    pool->max_idle = max_idle;
+    pool->idle_ln = 0;
+    pool->dns_ttl = dns_ttl;
+    pool->dns = NULL;
+    pool->idle = NULL;
+    return pool;
+}
+
+void http_pool_destroy(http_pool *pool) {
+    while (pool->idle != NULL) {
+        pool_conn *conn = pool->idle;
+        pool->idle = conn->next;
+        http_conn_close(conn->conn);
+        free(conn->key);
+        free(conn);
+    }
+    while (pool->dns != NULL) {
+        pool_dns *dns = pool->dns;
+        pool->dns = dns->next;
+        free(dns->key);
+        free(dns);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+http_conn *http_pool_get(http_pool *pool, char *addr, char *port, int *reused, const char **err) {
+    char *key = pool_key(addr, port);
+    if (key == NULL) {
+        return NULL;
+    }
+
+    while (1) {
+        // Take the most recently used idle connection to the origin, dropping expired ones on the way
+        time_t now = pool_now();
+        pool_conn *found = NULL;
+        pool_conn *expired = NULL;
+        pthread_mutex_lock(&pool->lock);
+        for (pool_conn **link = &pool->idle; *link != NULL;) {
+            pool_conn *conn = *link;
+            if (conn->idle_since + POOL_IDLE_TIMEOUT < now) {
+                *link = conn->next;
+                conn->next = expired;
+                expired = conn;
+                pool->idle_ln--;
+            } else if (found == NULL && strcmp(conn->key, key) == 0) {
+                *link = conn->next;
+                found = conn;
+                pool->idle_ln--;
+            } else {
+                link = &conn->next;
+            }
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        while (expired != NULL) {
+            pool_conn *conn = expired;
+            expired = conn->next;
+            http_conn_close(conn->conn);
+            free(conn->key);
+            free(conn);
+        }
+        if (found == NULL) {
+            break;
+        }
+
+        http_conn *conn = found->conn;
+        free(found->key);
+        free(found);
+        if (is_conn_idle(conn)) {
+            free(key);
+            *reused = 1;
+            return conn;
+        }
+        http_conn_close(conn);
+    }
+
+    pool_dns dns;
+    int result = pool_resolve(pool, key, addr, port, &dns, err);
+    free(key);
+    if (result == -1) {
+        return NULL;
+    }
+
+    int fd = connect_addrinfo(dns.ai);
+    if (fd == -1) {
+        return NULL;
+    }
+    *reused = 0;
+    return http_conn_open(fd);
+}
+
+void http_pool_put(http_pool *pool, char *addr, char *port, http_conn *idle) {
+    pool_conn *conn = malloc(sizeof(pool_conn));
+    if (conn == NULL || (conn->key = pool_key(addr, port)) == NULL) {
+        free(conn);
+        http_conn_close(idle);
+        return;
+    }
+    conn->conn = idle;
+    conn->idle_since = pool_now();
+
+    // Evict the least recently returned connection if the pool is full
+    pool_conn *evicted = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->idle_ln == pool->max_idle) {
+        pool_conn **link = &pool->idle;
+        while (*link != NULL && (*link)->next != NULL) {
+            link = &(*link)->next;
+        }
+        evicted = *link;
+        *link = NULL;
+        if (evicted != NULL) {
+            pool->idle_ln--;
+        } else {
+            evicted = conn;
+            conn = NULL;
+        }
+    }
+    if (conn != NULL) {
+        conn->next = pool->idle;
+        pool->idle = conn;
+        pool->idle_ln++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (evicted != NULL) {
+        http_conn_close(evicted->conn);
+        free(evicted->key);
+        free(evicted);
+    }
+}
+
+int open_socket(char *port, const http_listen_opts *opts, const char **err) {
+    struct addrinfo req = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *pai;
+    int res = getaddrinfo(NULL, port, &req, &pai);
+    if (res == EAI_SYSTEM) {
+        return -1;
+    } else if (res != 0) {
+        *err = gai_strerror(res);
+        return -1;
+    }
+
+    int fd = socket(pai->ai_family, pai->ai_socktype, pai->ai_protocol);
+    if (fd == -1) {
+        freeaddrinfo(pai);
+        return -1;
+    }
+
+    int option = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option)) == -1) {
+        freeaddrinfo(pai);
+        close(fd);
+        return -1;
+    }
+
+    if (opts->reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &option, sizeof(option)) == -1) {
+        freeaddrinfo(pai);
+        close(fd);
+        return -1;
+    }
+
+    if (opts->defer_accept > 0 &&
+        setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &opts->defer_accept, sizeof(opts->defer_accept)) == -1) {
+        freeaddrinfo(pai);
+        close(fd);
+        return -1;
+    }
+
+    if (opts->fastopen > 0 && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &opts->fastopen, sizeof(opts->fastopen)) == -1) {
+        freeaddrinfo(pai);
+        close(fd);
+        return -1;
+    }
+
+    if (bind(fd, pai->ai_addr, pai->ai_addrlen) == -1) {
+        freeaddrinfo(pai);
+        close(fd);
+        return -1;
+    }
+
+    freeaddrinfo(pai);
+
+    if (listen(fd, opts->backlog) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int accept_client_fd(int socket) {
+    int fd = accept(socket, NULL, NULL);
+    if (fd == -1) {
+        return -1;
+    }
+
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+FILE *accept_client_conn(int socket) {
+    int fd = accept(socket, NULL, NULL);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    FILE *stream = fdopen(fd, "r+");
+    if (stream == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    return stream;
+}
+
+/**
+ * @brief Sends an HTTP request
+ * @details Gathers the head into as few writes as possible, see send_req.
+ * @param io transport to send on
+ * @param req request to send
+ * @return 0 on success, -1 on failure
+ */
+static int io_send_req(http_io *io, http_req *req) {
+    gather_t gather = { .io = io, .ln = 0 };
+    const char *method = HTTP_METHOD_STRINGS[req->method];
+    const char *path = req->path[0] == '/' ? &req->path[1] : req->path;
+    int failed = gather_add(&gather, method, strlen(method)) == -1 || gather_add(&gather, " /", 2) == -1 ||
+                 gather_add(&gather, path, strlen(path)) == -1 || gather_add(&gather, " HTTP/1.1\r\n", 11) == -1;
+
+    for (size_t i = 0; i < req->header_ln && !failed; i++) {
+        failed = gather_add(&gather, req->header[i].key, strlen(req->header[i].key)) == -1 ||
+                 gather_add(&gather, ": ", 2) == -1 ||
+                 gather_add(&gather, req->header[i].value, strlen(req->header[i].value)) == -1 ||
+                 gather_add(&gather, "\r\n", 2) == -1;
+    }
+
+    char content_length[48];
+    if (req->body != NULL && !failed) {
+        long old_pos = ftell(req->body);
+        fseek(req->body, 0, SEEK_END);
+        long file_ln = ftell(req->body);
+        fseek(req->body, old_pos, SEEK_SET);
+
+        int ln = snprintf(content_length, sizeof(content_length), "Content-Length: %ld\r\n", file_ln - old_pos);
+        failed = gather_add(&gather, content_length, ln) == -1;
+    }
+
+    const char *connection = req->keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    if (failed || gather_add(&gather, connection, strlen(connection)) == -1 || gather_flush(&gather) == -1) {
+        return -1;
+    }
+
+    if (req->body != NULL) {
+        char buffer[16384];
+
+        while (1) {
+            size_t read_ln = fread(buffer, 1, sizeof(buffer), req->body);
+            if (ferror(req->body) != 0 || io_write(io, buffer, read_ln) == -1) {
+                return -1;
+            }
+
+            if (read_ln < sizeof(buffer)) {
+                break;
+            }
+        }
+    }
+    return io_flush(io);
+}
+
+int send_req(FILE *stream, http_req *req) {
+    http_io io = { .stream = stream, .conn = NULL };
+    return io_send_req(&io, req);
+}
+
+void http_pipe_init(http_pipe *pipe) {
+    pipe->fd[0] = -1;
+    pipe->fd[1] = -1;
+    pipe->pending = 0;
+}
+
+void http_pipe_close(http_pipe *pipe) {
+    if (pipe->fd[0] != -1) {
+        close(pipe->fd[0]);
+        close(pipe->fd[1]);
+    }
+    http_pipe_init(pipe);
+}
+
+/**
+ * @brief Copies file data to a socket using splice
+ * @details Fallback for send_file if sendfile is not supported for fd. The data is moved through a pipe, so it never
+ * enters user space. The pipe is only refilled from the file once it is empty, so its pending data always starts at
+ * offset and a full socket leaves it for the next call instead of being waited for.
+ * @param socket socket to write to
+ * @param fd file to read from
+ * @param offset offset to read from, is advanced by the number of bytes sent
+ * @param count maximum number of bytes to send
+ * @param pipe pipe to splice through, created if it is not yet
+ * @return number of bytes sent, -1 on failure
+ */
+static ssize_t splice_file(int socket, int fd, off_t *offset, size_t count, http_pipe *pipe) {
+    if (pipe->fd[0] == -1 && pipe2(pipe->fd, O_NONBLOCK | O_CLOEXEC) == -1) {
+        return -1;
+    }
+
+    if (pipe->pending == 0) {
+        off_t in_offset = *offset;
+        ssize_t in_ln = splice(fd, &in_offset, pipe->fd[1], NULL, count, SPLICE_F_MOVE);
+        if (in_ln <= 0) {
+            return in_ln;
+        }
+        pipe->pending = in_ln;
+    }
+
+    size_t ln = pipe->pending < count ? pipe->pending : count;
+    ssize_t out_ln = splice(pipe->fd[0], NULL, socket, NULL, ln, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (out_ln > 0) {
+        pipe->pending -= out_ln;
+        *offset += out_ln;
+    }
+    return out_ln;
+}
+
+ssize_t send_file(int socket, int fd, off_t *offset, size_t count, http_pipe *pipe) {
+    if (pipe->pending > 0) {
+        return splice_file(socket, fd, offset, count, pipe);
+    }
+
+    ssize_t ln = sendfile(socket, fd, offset, count);
+    if (ln == -1 && (errno == EINVAL || errno == ENOSYS)) {
+        return splice_file(socket, fd, offset, count, pipe);
+    }
+    return ln;
+}
+
+/**
+ * @brief Sends the remaining part of a regular file to a socket without copying it
+ * @details Sends body from its current position until EOF to socket using send_file and advances the position of body.
+ * @param socket socket to write to
+ * @param body regular file to send
+ * @param length number of bytes to send
+ * @return 0 on success, -1 on failure
+ */
+static int send_body_zero_copy(int socket, FILE *body, long length) {
+    http_pipe pipe;
+    http_pipe_init(&pipe);
+    off_t offset = ftell(body);
+    off_t end = offset + length;
+    while (offset < end) {
+        ssize_t ln = send_file(socket, fileno(body), &offset, end - offset, &pipe);
+        if (ln == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            http_pipe_close(&pipe);
+            return -1;
+        } else if (ln == 0) {
+            break;
+        }
+    }
+    http_pipe_close(&pipe);
+    return fseek(body, offset, SEEK_SET);
+}
+
+/**
+ * Number of buffers the cached Date is rotated through. A reader which loaded the current buffer can use it for this
+ * many updates minus one before it is overwritten.
+ */
+#define DATE_SLOTS 4
+
+/**
+ * Buffers of the cached Date
+ */
+static char date_slots[DATE_SLOTS][HTTP_DATE_SIZE];
+
+/**
+ * Index of the buffer holding the current Date, -1 until the first update. Accessed atomically.
+ */
+static int date_slot = -1;
+
+int format_http_date(char *buf, time_t time) {
+    struct tm tm;
+    if (gmtime_r(&time, &tm) == NULL || strftime(buf, HTTP_DATE_SIZE, "%a, %d %b %Y %H:%M:%S GMT", &tm) == 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int parse_http_date(const char *str, time_t *time) {
+    // IMF-fixdate, RFC 850 and asctime, see RFC 9110 section 5.6.7
+    static const char *formats[] = { "%a, %d %b %Y %H:%M:%S GMT", "%A, %d-%b-%y %H:%M:%S GMT", "%a %b %e %H:%M:%S %Y" };
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char *end = strptime(str, formats[i], &tm);
+        if (end != NULL && *end == '\0') {
+            *time = timegm(&tm);
+            return *time == -1 ? -1 : 0;
+        }
+    }
+    return -1;
+}
+
+int match_etag(const char *list, const char *etag) {
+    size_t etag_ln = strlen(etag);
+    if (strncmp(etag, "W/", 2) == 0) {
+        etag += 2;
+        etag_ln -= 2;
+    }
+
+    const char *pos = list;
+    while (1) {
+        while (*pos == ' ' || *pos == '\t' || *pos == ',') {
+            pos++;
+        }
+        if (*pos == '*') {
+            return 1;
+        } else if (strncmp(pos, "W/", 2) == 0) {
+            pos += 2;
+        }
+        if (*pos != '"') {
+            return 0;
+        }
+
+        const char *end = strchr(pos + 1, '"');
+        if (end == NULL) {
+            return 0;
+        }
+        end++;
+        if (end - pos == etag_ln && memcmp(pos, etag, etag_ln) == 0) {
+            return 1;
+        }
+        pos = end;
+    }
+}
+
+int accept_quality(const char *list, const char *token) {
+    size_t token_ln = strlen(token);
+    int wildcard = 0;
+    const char *pos = list;
+    while (*pos != '\0') {
+        while (*pos == ' ' || *pos == '\t' || *pos == ',') {
+            pos++;
+        }
+        const char *name = pos;
+        while (*pos != '\0' && *pos != ',' && *pos != ';' && *pos != ' ' && *pos != '\t') {
+            pos++;
+        }
+        size_t name_ln = pos - name;
+
+        // Quality defaults to 1, other parameters are ignored
+        int quality = 1000;
+        while (*pos != '\0' && *pos != ',') {
+            if (*pos == ';') {
+                pos++;
+                while (*pos == ' ' || *pos == '\t') {
+                    pos++;
+                }
+                if ((*pos == 'q' || *pos == 'Q') && pos[1] == '=') {
+                    char *end;
+                    double q = strtod(pos + 2, &end);
+                    quality = q <= 0 ? 0 : q >= 1 ? 1000 : (int) (q * 1000 + 0.5);
+                    pos = end;
+                    continue;
+                }
+            }
+            if (*pos != '\0' && *pos != ',') {
+                pos++;
+            }
+        }
+
+        if (name_ln == token_ln && strncasecmp(name, token, token_ln) == 0) {
+            return quality;
+        } else if (name_ln == 1 && *name == '*') {
+            wildcard = quality;
+        }
+    }
+    return wildcard;
+}
+
+/**
+ * @brief Parses a non-negative decimal number
+ * @param str string to parse
+ * @param value parsed number will be written here
+ * @return pointer behind the number, NULL if str does not start with a digit or the number overflows
+ */
+static const char *parse_offset(const char *str, off_t *value) {
+    if (*str < '0' || *str > '9') {
+        return NULL;
+    }
+    *value = 0;
+    for (; *str >= '0' && *str <= '9'; str++) {
+        if (*value > (INT64_MAX - (*str - '0')) / 10) {
+            return NULL;
+        }
+        *value = *value * 10 + (*str - '0');
+    }
+    return str;
 }
 
-int open_socket(char *port, const char **err) {
-    struct addrinfo req = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM};
-    struct addrinfo *pai;
-    int res = getaddrinfo(NULL, port, &req, &pai);
-    if (res == EAI_SYSTEM) {
-        return -1;
-    } else if (res != 0) {
-        *err = gai_strerror(res);
+int parse_range(const char *str, off_t size, off_t *start, off_t *end) {
+    if (strncasecmp(str, "bytes=", 6) != 0) {
         return -1;
     }
-
-    int fd = socket(pai->ai_family, pai->ai_socktype, pai->ai_protocol);
-    if (fd == -1) {
-        freeaddrinfo(pai);
-        return -1;
+    str += 6;
+    while (*str == ' ') {
+        str++;
     }
 
-    int option = 1;
-    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option)) == -1) {
-        freeaddrinfo(pai);
-        close(fd);
-        return -1;
+    off_t first, last;
+    const char *pos;
+    if (*str == '-') {
+        // Suffix range, the last bytes of the representation
+        pos = parse_offset(str + 1, &last);
+        if (pos == NULL) {
+            return -1;
+        }
+        first = last < size ? size - last : 0;
+        last = size - 1;
+        if (size == 0 || first > last) {
+            first = size;
+        }
+    } else {
+        pos = parse_offset(str, &first);
+        if (pos == NULL || *pos != '-') {
+            return -1;
+        }
+        pos++;
+        last = size - 1;
+        if (*pos >= '0' && *pos <= '9') {
+            pos = parse_offset(pos, &last);
+            if (pos == NULL || last < first) {
+                return -1;
+            }
+            if (last >= size) {
+                last = size - 1;
+            }
+        }
     }
 
-    if (bind(fd, pai->ai_addr, pai->ai_addrlen) == -1) {
-        freeaddrinfo(pai);
-        close(fd);
+    while (*pos == ' ') {
+        pos++;
+    }
+    if (*pos != '\0') {
         return -1;
     }
+    if (first >= size) {
+        return -2;
+    }
 
-    freeaddrinfo(pai);
+    *start = first;
+    *end = last + 1;
+    return 0;
+}
 
-    if (listen(fd, 1) < 0) {
-        close(fd);
+int http_date_update(void) {
+    // time() may use a coarse clock, which lags behind at the start of a second
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    int slot = (__atomic_load_n(&date_slot, __ATOMIC_RELAXED) + 1) % DATE_SLOTS;
+    if (format_http_date(date_slots[slot], now.tv_sec) == -1) {
         return -1;
     }
-    return fd;
+    __atomic_store_n(&date_slot, slot, __ATOMIC_RELEASE);
+    return 0;
 }
 
-FILE *accept_client_conn(int socket) {
-    int fd = accept(socket, NULL, NULL);
-    if (fd == -1) {
-        return NULL;
-    }
-
-    FILE *stream = fdopen(fd, "r+");
-    if (stream == NULL) {
-        close(fd);
-        return NULL;
+const char *http_date(void) {
+    int slot = __atomic_load_n(&date_slot, __ATOMIC_ACQUIRE);
+    if (slot == -1) {
+        if (http_date_update() == -1) {
+            return NULL;
+        }
+        slot = __atomic_load_n(&date_slot, __ATOMIC_ACQUIRE);
     }
+    return date_slots[slot];
+}
 
-    return stream;
+const char *http_method_name(http_method method) {
+    return HTTP_METHOD_STRINGS[method];
 }
 
-int send_req(FILE *stream, http_req *req) {
-    if (fprintf(stream, "%s /%s HTTP/1.1\r\n", HTTP_METHOD_STRINGS[req->method], req->path[0] == '/' ? &req->path[1] : req->path) < 0) {
+int format_res_head_start(char *buf, size_t size, http_res *res, long length) {
+    // Keep counting once the buffer is full, so the caller learns the required size like with snprintf
+    size_t ln = 0;
+    int written = snprintf(buf, size, "HTTP/1.1 %ld %s\r\n", res->status_code.code, res->status_code.description);
+    if (written < 0) {
         return -1;
     }
+    ln += written;
 
-    for (size_t i = 0; i < req->header_ln; i++) {
-        if (fprintf(stream, "%s: %s\r\n", req->header[i].key, req->header[i].value) < 0) {
+    for (size_t i = 0; i < res->header_ln; i++) {
+        written = snprintf(ln < size ? &buf[ln] : NULL, ln < size ? size - ln : 0, "%s: %s\r\n",
+                           res->header[i].key, res->header[i].value);
+        if (written < 0) {
             return -1;
         }
+        ln += written;
     }
 
-    if (req->body != NULL) {
-        long old_pos = ftell(req->body);
-        fseek(req->body, 0, SEEK_END);
-        long file_ln = ftell(req->body);
-        fseek(req->body, old_pos, SEEK_SET);
+    if (res->chunked) {
+        written = snprintf(ln < size ? &buf[ln] : NULL, ln < size ? size - ln : 0, "Transfer-Encoding: chunked\r\n");
+        if (written < 0) {
+            return -1;
+        }
+        ln += written;
+    } else if (length >= 0) {
+        written = snprintf(ln < size ? &buf[ln] : NULL, ln < size ? size - ln : 0, "Content-Length: %ld\r\n", length);
+        if (written < 0) {
+            return -1;
+        }
+        ln += written;
+    }
+
+    return (int) ln;
+}
 
-        fprintf(stream, "Content-Length: %ld\r\n", file_ln - old_pos);
+int format_res_head_end(char *buf, size_t size, int keep_alive) {
+    const char *date = http_date();
+    if (date == NULL) {
+        return -1;
     }
 
-    if (fprintf(stream, "Connection: close\r\n\r\n") < 0) {
+    return snprintf(buf, size, "Date: %s\r\nConnection: %s\r\n\r\n", date, keep_alive ? "keep-alive" : "close");
+}
+
+int format_res_head(char *buf, size_t size, http_res *res, long length) {
+    int start_ln = format_res_head_start(buf, size, res, length);
+    if (start_ln < 0) {
         return -1;
     }
 
-    if (req->body != NULL) {
-        char *buffer[1024];
+    int end_ln = format_res_head_end(start_ln < size ? &buf[start_ln] : NULL, start_ln < size ? size - start_ln : 0,
+                                     res->keep_alive);
+    if (end_ln < 0) {
+        return -1;
+    }
 
-        while (1) {
-            size_t read_ln = fread(buffer, 1024, 1, req->body);
-            if (ferror(req->body) != 0) {
-                return -1;
-            }
+    return start_ln + end_ln;
+}
 
-            size_t write_ln = fwrite(buffer, read_ln, 1, stream);
-            if (write_ln < read_ln) {
-                return -1;
-            }
+/**
+ * @brief Sends a body with the chunked transfer coding
+ * @details Sends body in chunks as it is read, followed by the last chunk without trailers.
+ * @param io transport to send on
+ * @param body stream to read the body from
+ * @return 0 on success, -1 on failure
+ */
+static int send_body_chunked(http_io *io, FILE *body) {
+    char buffer[16384];
+    while (1) {
+        size_t read_ln = fread(buffer, 1, sizeof(buffer), body);
+        if (ferror(body) != 0) {
+            return -1;
+        }
 
-            if (read_ln < 1024) {
-                break;
-            }
+        // Size line, data and CRLF of a chunk go out in one write
+        char size_line[24];
+        struct iovec iov[3] = {
+            { .iov_base = size_line, .iov_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", read_ln) },
+            { .iov_base = buffer, .iov_len = read_ln },
+            { .iov_base = "\r\n", .iov_len = 2 }
+        };
+        if (read_ln > 0 && io_writev(io, iov, 3) == -1) {
+            return -1;
+        }
+
+        if (feof(body)) {
+            break;
         }
     }
-    if (fflush(stream) == EOF) {
+
+    if (io_write(io, "0\r\n\r\n", 5) == -1 || io_flush(io) == -1) {
         return -1;
     }
-
     return 0;
 }
 
-int send_res(FILE *stream, http_res *res) {
-    if (fprintf(stream, "HTTP/1.1 %ld %s\r\n", res->status_code.code, res->status_code.description) < 0) {
+/**
+ * @brief Sends an HTTP response
+ * @see send_res
+ * @param io transport to send on
+ * @param res response to send
+ * @return 0 on success, -1 on failure
+ */
+static int io_send_res(http_io *io, http_res *res) {
+    long length = 0;
+    if (res->body != NULL && !res->chunked) {
+        long old_pos = ftell(res->body);
+        long file_ln = -1;
+        if (old_pos != -1 && fseek(res->body, 0, SEEK_END) == 0) {
+            file_ln = ftell(res->body);
+            fseek(res->body, old_pos, SEEK_SET);
+        }
+        length = old_pos == -1 || file_ln == -1 ? -1 : file_ln - old_pos;
+    }
+
+    // Bodies of unknown length, like pipes, are sent chunked
+    http_res head_res = *res;
+    head_res.chunked = res->body != NULL && (res->chunked || length < 0);
+
+    char head_buf[1024];
+    char *head = head_buf;
+    int head_ln = format_res_head(head, sizeof(head_buf), &head_res, length);
+    if (head_ln < 0) {
         return -1;
     }
-    for (size_t i = 0; i < res->header_ln; i++) {
-        if (fprintf(stream, "%s: %s\r\n", res->header[i].key, res->header[i].value) < 0) {
+    if (head_ln >= sizeof(head_buf)) {
+        head = malloc(head_ln + 1);
+        if (head == NULL) {
             return -1;
         }
+        format_res_head(head, head_ln + 1, &head_res, length);
     }
 
-    char date[256];
-    time_t t = time(0);
-    struct tm *tmp = gmtime(&t);
-    if (tmp == NULL) {
-        return -1;
+    // Regular files are sent with sendfile. The head is corked in front of them, so it shares the first segment
+    int socket = io_fd(io);
+    int zero_copy = 0;
+    if (res->body != NULL && !head_res.chunked && socket != -1 && fileno(res->body) != -1) {
+        struct stat st;
+        zero_copy = fstat(fileno(res->body), &st) == 0 && S_ISREG(st.st_mode);
     }
-    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S %Z", tmp);
+    int cork = 1;
+    int corked = zero_copy && setsockopt(socket, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork)) == 0;
 
-    long length = 0;
-    if (res->body != NULL) {
-        long old_pos = ftell(res->body);
-        fseek(res->body, 0, SEEK_END);
-        long file_ln = ftell(res->body);
-        fseek(res->body, old_pos, SEEK_SET);
+    int failed = io_write(io, head, head_ln) == -1;
+    if (head != head_buf) {
+        free(head);
+    }
+    if (failed) {
+        return -1;
+    }
 
-        length = file_ln - old_pos;
+    if (zero_copy) {
+        if (io_flush(io) == -1 || send_body_zero_copy(socket, res->body, length) == -1) {
+            return -1;
+        }
+        if (corked) {
+            cork = 0;
+            setsockopt(socket, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+        }
+        return 0;
     }
 
-    if (fprintf(stream, "Date: %s\r\nContent-Length: %ld\r\nConnection: close\r\n\r\n", date, length) < 0) {
-        return -1;
+    if (head_res.chunked) {
+        return send_body_chunked(io, res->body);
     }
 
     if (res->body != NULL) {
-        char buffer[1024];
+        char buffer[16384];
 
         while (1) {
             size_t read_ln = fread(buffer, 1, sizeof(buffer), res->body);
-            if (ferror(res->body) != 0) {
-                return -1;
-            }
-
-            size_t write_ln = fwrite(buffer, 1, read_ln, stream);
-            if (write_ln < read_ln) {
+            if (ferror(res->body) != 0 || io_write(io, buffer, read_ln) == -1) {
                 return -1;
             }
 
@@ -278,126 +1919,400 @@ int send_res(FILE *stream, http_res *res) {
             }
         }
     }
-    if (fflush(stream) == EOF) {
-        return -1;
-    }
+    return io_flush(io);
+}
 
-    return 0;
+int send_res(FILE *stream, http_res *res) {
+    http_io io = { .stream = stream, .conn = NULL };
+    return io_send_res(&io, res);
 }
 
-int recv_res(FILE *stream, http_res *res) {
-    char *buf = NULL;
-    size_t line_n = 0;
-    char *saveptr;
+long parse_res(char *buf, size_t ln, http_res *res, http_arena *arena) {
+    char *end = find_head_end(buf, ln);
+    if (end == NULL) {
+        return 0;
+    }
+    res->raw = NULL;
 
     // Head
-    if (getline(&buf, &line_n, stream) == -1) {
-        free(buf);
-        return errno == EOF ? -2 : -1;
+    char *line_end = scan_char(buf, end, '\r');
+    if (line_end[1] != '\n') {
+        return -2;
     }
-
-    char *token = strtok_r(buf, " ", &saveptr);
-    if (token == NULL || strcmp(token, "HTTP/1.1") != 0) {
-        free(buf);
+    if (line_end - buf < 9 || memcmp(buf, "HTTP/1.1 ", 9) != 0) {
         return -2;
     }
 
-    token = strtok_r(NULL, " ", &saveptr);
-    if (token == NULL) {
-        free(buf);
-        return -2;
+    char *token = &buf[9];
+    char *token_end = token;
+    while (token_end < line_end && *token_end >= '0' && *token_end <= '9') {
+        token_end++;
     }
-    char *endptr;
-    res->status_code.code = strtol(token, &endptr, 10);
-    if (*endptr != '\0') {
-        free(buf);
+    if (token_end == token || token_end - token > 3 || (token_end < line_end && *token_end != ' ')) {
         return -2;
     }
+    res->status_code.code = strtol(token, NULL, 10);
 
-    if (*saveptr != '\0') {
-        char *description = strndup(saveptr, strcspn(saveptr, "\r\n"));
-        if (description == NULL) {
-            free(buf);
-            return -1;
-        }
-        res->status_code.description = description;
-    } else {
-        res->status_code.description = strdup("");
-    }
+    res->status_code.description = token_end < line_end ? token_end + 1 : line_end;
+    *line_end = '\0';
 
     // Header
     int err;
-    res->header = extract_header(stream, buf, &line_n, &res->header_ln, &err);
+    res->header = extract_header(line_end + 2, end, arena, &res->header_ln, res->known_header, &err);
     if (res->header == NULL) {
-        free(res->status_code.description);
-        free(buf);
         return err;
     }
 
-    free(buf);
-    return 0;
+    res->keep_alive = is_keep_alive(res->known_header[HTTP_HEADER_CONNECTION]);
+    if (parse_content_length(res->known_header[HTTP_HEADER_CONTENT_LENGTH], &res->content_length) == -1) {
+        return -3;
+    }
+
+    // The body ends with the last chunk if chunked is the final transfer coding, otherwise it ends with the connection
+    http_header *transfer_encoding = res->known_header[HTTP_HEADER_TRANSFER_ENCODING];
+    res->chunked = is_chunked(transfer_encoding);
+    if (transfer_encoding != NULL) {
+        res->content_length = -1;
+    }
+    res->body_left = res->chunked ? 0 : res->content_length;
+    res->body_done = res->body_left == 0 && !res->chunked;
+
+    return end - buf;
 }
 
-int recv_req(FILE *stream, http_req *req) {
-    char *buf = NULL;
-    size_t line_n = 0;
-    char *saveptr;
+long parse_req(char *buf, size_t ln, http_req *req, http_arena *arena) {
+    char *end = find_head_end(buf, ln);
+    if (end == NULL) {
+        return 0;
+    }
+    req->raw = NULL;
 
     // Head
-    if (getline(&buf, &line_n, stream) == -1) {
-        free(buf);
-        return errno == EOF ? -2 : -1;
+    char *token_end = (char *) scan_any(buf, end, " \r", 2);
+    if (*token_end != ' ') {
+        return -2;
     }
 
-    char *token = strtok_r(buf, " ", &saveptr);
-    if (token == NULL) {
-        free(buf);
+    req->method = lookup_method(buf, token_end - buf);
+    if (req->method == -1) {
         return -2;
     }
 
-    req->method = -1;
-    for (int i = 0; i < sizeof(HTTP_METHOD_STRINGS) / sizeof(char*); i++) {
-        if (strcmp(token, HTTP_METHOD_STRINGS[i]) == 0) {
-            req->method = i;
-            break;
-        }
+    char *token = token_end + 1;
+    token_end = (char *) scan_any(token, end, " \r", 2);
+    if (*token_end != ' ' || token[0] != '/') {
+        return -2;
     }
-    if (req->method == -1) {
-        free(buf);
+
+    char *line_end = token_end + 9;
+    if (end - token_end < 11 || memcmp(token_end, " HTTP/1.1\r\n", 11) != 0) {
         return -2;
     }
 
-    token = strtok_r(NULL, " ", &saveptr);
-    if (token == NULL || token[0] != '/') {
-        free(buf);
+    req->path = token;
+    req->path_ln = token_end - token;
+    *token_end = '\0';
+
+    // Header
+    int err;
+    req->header = extract_header(line_end + 2, end, arena, &req->header_ln, req->known_header, &err);
+    if (req->header == NULL) {
+        return err;
+    }
+
+    req->keep_alive = is_keep_alive(req->known_header[HTTP_HEADER_CONNECTION]);
+    if (parse_content_length(req->known_header[HTTP_HEADER_CONTENT_LENGTH], &req->content_length) == -1) {
+        return -3;
+    }
+    http_header *transfer_encoding = req->known_header[HTTP_HEADER_TRANSFER_ENCODING];
+    req->chunked = is_chunked(transfer_encoding);
+    if (transfer_encoding != NULL) {
+        // Transfer-Encoding overrides Content-Length, see RFC 9112 section 6.3
+        req->content_length = -1;
+    }
+    return end - buf;
+}
+
+/**
+ * @brief Receives an HTTP response head
+ * @see recv_res
+ */
+static int io_recv_res(http_io *io, http_res *res) {
+    int err;
+    size_t head_ln;
+    http_arena arena;
+    char *head = io_read_head(io, &head_ln, &arena, &err);
+    if (head == NULL) {
+        return err;
+    }
+
+    long parsed = parse_res(head, head_ln, res, &arena);
+    if (parsed <= 0) {
+        head_free(head);
+        return parsed == 0 ? -2 : (int) parsed;
+    }
+    res->raw = head;
+    return 0;
+}
+
+int recv_res(FILE *stream, http_res *res) {
+    http_io io = { .stream = stream, .conn = NULL };
+    return io_recv_res(&io, res);
+}
+
+/**
+ * @brief Reads a line of a chunked body
+ * @details Reads a chunk size or trailer line up to and including CRLF. Longer lines than buf are truncated.
+ * @param io transport to read from
+ * @param buf buffer the line is written into, without CRLF
+ * @param size size of buf
+ * @return 0 on success, -1 on failure, -2 if the stream ended or the line is not terminated by CRLF
+ */
+static int read_chunk_line(http_io *io, char *buf, size_t size) {
+    size_t ln = 0;
+    while (1) {
+        int c = io_getc(io);
+        if (c == EOF) {
+            return io_error(io) ? -1 : -2;
+        } else if (c == '\n') {
+            if (ln == 0 || buf[ln - 1] != '\r') {
+                return -2;
+            }
+            buf[ln - 1] = '\0';
+            return 0;
+        }
+        if (ln < size - 1) {
+            buf[ln++] = (char) c;
+        }
+    }
+}
+
+/**
+ * @brief Starts the next chunk of a chunked body
+ * @details Reads the chunk size line. At the last chunk, the trailers are skipped and the body is marked done.
+ * @param io transport to read from
+ * @param res response whose body is received
+ * @return 0 on success, -1 on failure, -2 on a protocol error
+ */
+static int recv_chunk_size(http_io *io, http_res *res) {
+    char line[256];
+    int err = read_chunk_line(io, line, sizeof(line));
+    if (err != 0) {
+        return err;
+    }
+
+    // Chunk extensions after the size are ignored
+    char *endptr;
+    errno = 0;
+    res->body_left = strtol(line, &endptr, 16);
+    if (errno != 0 || endptr == line || res->body_left < 0 ||
+        (*endptr != '\0' && *endptr != ';' && *endptr != ' ' && *endptr != '\t')) {
         return -2;
     }
-    req->path = strdup(token);
-    if (req->path == NULL) {
-        free(buf);
-        return -1;
+
+    if (res->body_left == 0) {
+        // Skip the trailers up to the empty line ending the body
+        do {
+            err = read_chunk_line(io, line, sizeof(line));
+            if (err != 0) {
+                return err;
+            }
+        } while (line[0] != '\0');
+        res->body_done = 1;
     }
+    return 0;
+}
 
-    token = strtok_r(NULL, " ", &saveptr);
-    if (token == NULL || strcmp(token, "HTTP/1.1\r\n") != 0) {
-        free(req->path);
-        free(buf);
+/**
+ * @brief Accounts for received body data
+ * @details Reads the line break ending a chunk once its data is complete.
+ * @param io transport the data was read from
+ * @param res response whose body is received
+ * @param read_ln number of bytes received
+ * @param ln number of bytes which were requested
+ * @param complete whether the transport blocks until all requested bytes have been received
+ * @return 0 on success, -1 on failure, -2 on a protocol error
+ */
+static int recv_body_advance(http_io *io, http_res *res, size_t read_ln, size_t ln, int complete) {
+    if (res->body_left == -1) {
+        // Body ends with the connection
+        res->body_done = complete ? read_ln < ln : read_ln == 0;
+        return 0;
+    } else if (complete ? read_ln < ln : read_ln == 0) {
         return -2;
     }
 
-    // Header
+    res->body_left -= read_ln;
+    if (res->chunked && res->body_left == 0) {
+        char line[256];
+        int err = read_chunk_line(io, line, sizeof(line));
+        if (err != 0) {
+            return err;
+        } else if (line[0] != '\0') {
+            return -2;
+        }
+    }
+    res->body_done = !res->chunked && res->body_left == 0;
+    return 0;
+}
+
+/**
+ * @brief Receives a part of a response body
+ * @see recv_body
+ */
+static ssize_t io_recv_body(http_io *io, http_res *res, char *buf, size_t size) {
+    if (res->body_done) {
+        return 0;
+    }
+
+    if (res->chunked && res->body_left == 0) {
+        int err = recv_chunk_size(io, res);
+        if (err != 0 || res->body_done) {
+            return err;
+        }
+    }
+
+    size_t ln = res->body_left != -1 && res->body_left < size ? res->body_left : size;
+    size_t read_ln = io_read(io, buf, ln);
+    if (io_error(io)) {
+        return -1;
+    }
+
+    int err = recv_body_advance(io, res, read_ln, ln, 1);
+    return err != 0 ? err : (ssize_t) read_ln;
+}
+
+ssize_t recv_body(FILE *stream, http_res *res, char *buf, size_t size) {
+    http_io io = { .stream = stream, .conn = NULL };
+    return io_recv_body(&io, res, buf, size);
+}
+
+/**
+ * @brief Receives an HTTP request head
+ * @see recv_req
+ */
+static int io_recv_req(http_io *io, http_req *req) {
     int err;
-    req->header = extract_header(stream, buf, &line_n, &req->header_ln, &err);
-    if (req->header == NULL) {
-        free(req->path);
-        free(buf);
+    size_t head_ln;
+    http_arena arena;
+    char *head = io_read_head(io, &head_ln, &arena, &err);
+    if (head == NULL) {
         return err;
     }
 
-    free(buf);
+    long parsed = parse_req(head, head_ln, req, &arena);
+    if (parsed <= 0) {
+        head_free(head);
+        return parsed == 0 ? -2 : (int) parsed;
+    }
+    req->raw = head;
+    return 0;
+}
+
+int recv_req(FILE *stream, http_req *req) {
+    http_io io = { .stream = stream, .conn = NULL };
+    return io_recv_req(&io, req);
+}
+
+int http_conn_send_req(http_conn *conn, http_req *req) {
+    http_io io = { .stream = NULL, .conn = conn };
+    return io_send_req(&io, req);
+}
+
+int http_conn_send_res(http_conn *conn, http_res *res) {
+    http_io io = { .stream = NULL, .conn = conn };
+    return io_send_res(&io, res);
+}
+
+int http_conn_recv_req(http_conn *conn, http_req *req) {
+    http_io io = { .stream = NULL, .conn = conn };
+    return io_recv_req(&io, req);
+}
+
+int http_conn_recv_res(http_conn *conn, http_res *res) {
+    http_io io = { .stream = NULL, .conn = conn };
+    return io_recv_res(&io, res);
+}
+
+ssize_t http_conn_recv_body(http_conn *conn, http_res *res, char *buf, size_t size) {
+    http_io io = { .stream = NULL, .conn = conn };
+    return io_recv_body(&io, res, buf, size);
+}
+
+/**
+ * @brief Writes a complete buffer into a file
+ * @param fd file to write to
+ * @param buf data to write
+ * @param ln number of bytes to write
+ * @param offset offset to write at, advanced by ln, NULL to write at the file position
+ * @return 0 on success, -1 on failure
+ */
+static int write_at(int fd, const char *buf, size_t ln, off_t *offset) {
+    while (ln > 0) {
+        ssize_t write_ln = offset != NULL ? pwrite(fd, buf, ln, *offset) : write(fd, buf, ln);
+        if (write_ln == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += write_ln;
+        ln -= write_ln;
+        if (offset != NULL) {
+            *offset += write_ln;
+        }
+    }
     return 0;
 }
 
+ssize_t http_conn_splice_body(http_conn *conn, http_res *res, int fd, off_t *offset, int *pipe_fds, size_t size) {
+    http_io io = { .stream = NULL, .conn = conn };
+    if (res->body_done) {
+        return 0;
+    }
+
+    if (res->chunked && res->body_left == 0) {
+        int err = recv_chunk_size(&io, res);
+        if (err != 0 || res->body_done) {
+            return err;
+        }
+    }
+
+    // Data which has been read into the buffer together with the head or a chunk line is written from there
+    size_t ln = res->body_left != -1 && res->body_left < size ? res->body_left : size;
+    ssize_t moved;
+    if (conn->pos < conn->ln) {
+        moved = conn->ln - conn->pos < ln ? conn->ln - conn->pos : ln;
+        if (write_at(fd, &conn->buf[conn->pos], moved, offset) == -1) {
+            return -3;
+        }
+        conn->pos += moved;
+    } else {
+        do {
+            moved = splice(conn->fd, NULL, pipe_fds[1], NULL, ln, SPLICE_F_MOVE | SPLICE_F_MORE);
+        } while (moved == -1 && errno == EINTR);
+        if (moved == -1) {
+            conn->error = errno;
+            return -1;
+        } else if (moved == 0) {
+            conn->eof = 1;
+        }
+
+        for (ssize_t left = moved; left > 0;) {
+            ssize_t write_ln = splice(pipe_fds[0], NULL, fd, offset, left, SPLICE_F_MOVE);
+            if (write_ln == -1 && errno == EINTR) {
+                continue;
+            } else if (write_ln <= 0) {
+                return -3;
+            }
+            left -= write_ln;
+        }
+    }
+
+    int err = recv_body_advance(&io, res, moved, ln, 0);
+    return err != 0 ? err : moved;
+}
+
 int clear_http_head(FILE *stream) {
     char buf[1024];
     while (fgets(buf, 1024, stream) != NULL) {
@@ -408,19 +2323,11 @@ int clear_http_head(FILE *stream) {
 }
 
 void free_http_res(http_res *res) {
-    for (size_t i = 0; i < res->header_ln; i++) {
-        free(res->header[i].value);
-        free(res->header[i].key);
-    }
-    free(res->header);
-    free(res->status_code.description);
+    head_free(res->raw);
+    res->raw = NULL;
 }
 
 void free_http_req(http_req *req) {
-    for (size_t i = 0; i < req->header_ln; i++) {
-        free(req->header[i].value);
-        free(req->header[i].key);
-    }
-    free(req->header);
-    free(req->path);
+    head_free(req->raw);
+    req->raw = NULL;
 }
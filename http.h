@@ -1,6 +1,20 @@
 #ifndef UE3_HTTP_H
 #define UE3_HTTP_H
 
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+
+/**
+ * Size of a date formatted with format_http_date, including the terminating null byte
+ */
+#define HTTP_DATE_SIZE 30
+
+/**
+ * Size of the receive buffer of an http_conn, also the maximum size of a received head
+ */
+#define HTTP_CONN_BUF_SIZE 16384
+
 /**
  * Enum representing the different HTTP Methods
  */
@@ -16,14 +30,49 @@ typedef enum {
     HTTP_PATCH
 } http_method;
 
+/**
+ * Enum representing the headers which are looked up directly while parsing
+ */
+typedef enum {
+    HTTP_HEADER_HOST,
+    HTTP_HEADER_CONNECTION,
+    HTTP_HEADER_CONTENT_LENGTH,
+    HTTP_HEADER_CONTENT_TYPE,
+    HTTP_HEADER_CONTENT_ENCODING,
+    HTTP_HEADER_CONTENT_RANGE,
+    HTTP_HEADER_TRANSFER_ENCODING,
+    HTTP_HEADER_ACCEPT_ENCODING,
+    HTTP_HEADER_EXPECT,
+    HTTP_HEADER_RANGE,
+    HTTP_HEADER_IF_RANGE,
+    HTTP_HEADER_IF_NONE_MATCH,
+    HTTP_HEADER_IF_MODIFIED_SINCE,
+    HTTP_HEADER_ETAG,
+    HTTP_HEADER_LAST_MODIFIED,
+    HTTP_KNOWN_HEADER_LN
+} http_known_header;
+
 /**
  * Struct representing an HTTP header
+ * When received, key and value are null-terminated slices into the receive buffer
  */
 typedef struct {
     char *key;
+    size_t key_ln; // only for receiving
     char *value;
+    size_t value_ln; // only for receiving
 } http_header;
 
+/**
+ * Struct representing a bump allocator over a fixed buffer
+ * All allocations are released at once by resetting it
+ */
+typedef struct {
+    char *buf;
+    size_t size;
+    size_t used;
+} http_arena;
+
 /**
  * Struct representing an HTTP status code
  */
@@ -38,9 +87,15 @@ typedef struct {
 typedef struct {
     http_method method;
     char *path;
+    size_t path_ln; // only for receiving
     http_header *header; // array
     size_t header_ln;
+    http_header *known_header[HTTP_KNOWN_HEADER_LN]; // only for receiving, first occurrence in header or NULL
+    int keep_alive; // keep the connection open after the response
+    long content_length; // only for receiving, -1 if there is no Content-Length
+    int chunked; // only for receiving, the body uses the chunked transfer coding
     FILE *body; // only for sending
+    char *raw; // buffer owned by a received request, freed by free_http_req
 } http_req;
 
 /**
@@ -50,9 +105,87 @@ typedef struct {
     http_status_code status_code;
     http_header *header; // array
     size_t header_ln;
+    http_header *known_header[HTTP_KNOWN_HEADER_LN]; // only for receiving, first occurrence in header or NULL
+    int keep_alive; // keep the connection open after the response
+    long content_length; // only for receiving, -1 if unknown
+    int chunked; // body is sent with the chunked transfer coding
     FILE *body; // only for sending
+    char *raw; // buffer owned by a received response, freed by free_http_res
+    long body_left; // only for receiving, bytes left of the body or of the current chunk, see recv_body
+    int body_done; // only for receiving, the end of the body has been reached
 } http_res;
 
+/**
+ * @brief Initializes an arena
+ * @param arena arena to initialize
+ * @param buf memory the arena allocates from
+ * @param size size of buf
+ */
+void http_arena_init(http_arena *arena, void *buf, size_t size);
+
+/**
+ * @brief Allocates memory from an arena
+ * @details Allocations are aligned to 16 bytes and are only released by http_arena_reset.
+ * @param arena arena to allocate from
+ * @param size number of bytes to allocate
+ * @return allocated memory, NULL if the arena is full
+ */
+void *http_arena_alloc(http_arena *arena, size_t size);
+
+/**
+ * @brief Releases all allocations of an arena at once
+ * @param arena arena to reset
+ */
+void http_arena_reset(http_arena *arena);
+
+/**
+ * @brief Looks up a header
+ * @details Searches the header array for a header with the given key. Keys are compared case-insensitively.
+ * Received known headers are available in O(1) through known_header instead.
+ * @param header array of headers
+ * @param header_ln number of headers
+ * @param key key to look for
+ * @return value of the first matching header, NULL if there is none
+ */
+char *get_header(http_header *header, size_t header_ln, const char *key);
+
+/**
+ * Struct representing a buffered connection on a blocking socket
+ * Received data is read in large blocks into buf, of which buf[pos..ln) is not consumed yet. Sent heads are gathered
+ * into a single writev instead of being copied into a stdio buffer.
+ */
+typedef struct {
+    int fd;
+    int eof; // the peer closed the connection
+    int error; // errno of the last failed read, 0 if there was none
+    size_t pos;
+    size_t ln;
+    char buf[HTTP_CONN_BUF_SIZE];
+} http_conn;
+
+/**
+ * @brief Opens a buffered connection on a socket
+ * @param fd connected blocking socket, owned by the connection and closed on failure
+ * @return new connection which has to be closed with http_conn_close, NULL on failure
+ */
+http_conn *http_conn_open(int fd);
+
+/**
+ * @brief Initiates a buffered client connection
+ * @details Resolves addr and connects to the first reachable address, like init_client_conn.
+ * @param addr remote address to connect to
+ * @param port remote port to connect to
+ * @param err error message - is populated if NULL is returned and errno is not set
+ * @return new connection, NULL on failure
+ */
+http_conn *http_conn_connect(char *addr, char *port, const char **err);
+
+/**
+ * @brief Closes a buffered connection and its socket
+ * @param conn connection to close
+ */
+void http_conn_close(http_conn *conn);
+
 /**
  * @brief Initiates a client connection
  * @details Initiates a client connection to addr and port and returns an open file descriptor for the socket.
@@ -64,12 +197,73 @@ typedef struct {
 FILE *init_client_conn(char *addr, char *port, const char **err);
 
 /**
- *
- * @param port
- * @param err
- * @return
+ * Struct representing a pool of client connections, shared by threads
+ * Idle keep-alive connections are kept per origin (host and port) for reuse, and resolved addresses are cached.
+ */
+typedef struct http_pool_s http_pool;
+
+/**
+ * @brief Creates a connection pool
+ * @param max_idle maximum number of idle connections kept, over all origins
+ * @param dns_ttl seconds a resolved address is reused, 0 to resolve on every new connection
+ * @return new pool, NULL on failure
+ */
+http_pool *http_pool_create(size_t max_idle, time_t dns_ttl);
+
+/**
+ * @brief Destroys a connection pool
+ * @details Closes all idle connections. Connections taken from the pool are not affected.
+ * @param pool pool to destroy
+ */
+void http_pool_destroy(http_pool *pool);
+
+/**
+ * @brief Takes a connection to an origin from a pool
+ * @details Returns an idle connection to addr and port if one is left, otherwise initiates a new one like
+ * init_client_conn, without resolving addr again while its cached address is valid. A reused connection may still
+ * have been closed by the server just now, so a request failing on it should be retried on another connection.
+ * @param pool pool to take the connection from
+ * @param addr remote address to connect to
+ * @param port remote port to connect to
+ * @param reused whether an idle connection is returned will be written here
+ * @param err error message - is populated if NULL is returned and errno is not set
+ * @return connection, or NULL if failed
+ */
+http_conn *http_pool_get(http_pool *pool, char *addr, char *port, int *reused, const char **err);
+
+/**
+ * @brief Returns a connection to a pool
+ * @details The connection is kept for reuse. It must have been used with keep-alive, and the last response must have
+ * been received completely. The least recently returned connection is closed if the pool is full.
+ * @param pool pool to return the connection to
+ * @param addr remote address of the connection
+ * @param port remote port of the connection
+ * @param conn connection, owned by the pool afterwards
+ */
+void http_pool_put(http_pool *pool, char *addr, char *port, http_conn *conn);
+
+/**
+ * Struct representing the options of a listening socket
+ */
+typedef struct {
+    int reuse_port; // enable SO_REUSEPORT, so several sockets can listen on the same port
+    int backlog; // maximum number of established connections waiting to be accepted
+    int defer_accept; // seconds TCP_DEFER_ACCEPT waits for the first data of a connection, 0 disables it
+    int fastopen; // maximum number of pending TCP Fast Open requests, 0 disables it
+} http_listen_opts;
+
+/**
+ * @brief Opens a listening socket
+ * @details Opens a socket listening on 0.0.0.0 and port. With reuse_port, the kernel distributes incoming connections
+ * between all sockets listening on the same port. With defer_accept, connections only become ready to be accepted once
+ * the client has sent data, so connecting without sending a request does not occupy the server. With fastopen, clients
+ * may send their request with the SYN already.
+ * @param port local port to listen on
+ * @param opts options of the socket
+ * @param err error message - is populated if -1 is returned and errno is not set
+ * @return file descriptor of the listening socket, or -1 if failed
  */
-int open_socket(char *port, const char **err);
+int open_socket(char *port, const http_listen_opts *opts, const char **err);
 
 /**
  * @brief Accepts a client connection
@@ -79,6 +273,15 @@ int open_socket(char *port, const char **err);
  */
 FILE *accept_client_conn(int socket);
 
+/**
+ * @brief Accepts a client connection as a non-blocking file descriptor
+ * @details Accepts a waiting client connection and switches it to non-blocking mode, so it can be driven by an
+ * event loop. If the listening socket is non-blocking as well, -1 with errno EAGAIN is returned when no client is waiting.
+ * @param socket File directive to listening socket
+ * @return File descriptor of client connection, -1 on failure
+ */
+int accept_client_fd(int socket);
+
 /**
  * @brief Sends an HTTP request
  * @details Sends an HTTP request described by the req parameter.
@@ -90,16 +293,194 @@ int send_req(FILE *stream, http_req *req);
 
 /**
  * @brief Sends an HTTP response
- * @details Sends an HTTP response described by the res parameter.
+ * @details Sends an HTTP response described by the res parameter. If the body is a regular file, it is sent with
+ * send_file behind the corked head instead of being copied through stdio.
  * @param stream open socket
  * @param req filled http_res struct which describes the http response
  * @return 0 on success, -1 on failure
  */
 int send_res(FILE *stream, http_res *res);
 
+/**
+ * Struct representing the pipe send_file splices through if sendfile is not supported
+ * Data which has been moved into the pipe but not into the socket yet stays pending, it is the data at the offset of
+ * the next send_file call.
+ */
+typedef struct {
+    int fd[2]; // created on first use, -1 before
+    size_t pending; // bytes in the pipe
+} http_pipe;
+
+/**
+ * @brief Initializes a pipe for send_file
+ * @details Does not create the pipe yet, it is only needed if sendfile is not supported.
+ * @param pipe pipe to initialize
+ */
+void http_pipe_init(http_pipe *pipe);
+
+/**
+ * @brief Closes a pipe for send_file
+ * @details Pending data is discarded.
+ * @param pipe pipe to close
+ */
+void http_pipe_close(http_pipe *pipe);
+
+/**
+ * @brief Sends part of a file to a socket without copying it through user space
+ * @details Uses sendfile, or splice through pipe if sendfile is not supported for fd. Like sendfile, it may send less
+ * than count bytes, and fails with EAGAIN if a non-blocking socket is full. It never waits for the socket. Data which
+ * has been spliced into the pipe but not sent stays pending for the next call, which has to continue the same range.
+ * @param socket socket to write to
+ * @param fd file to read from
+ * @param offset offset to read from, is advanced by the number of bytes sent
+ * @param count maximum number of bytes to send
+ * @param pipe pipe used for splice, kept for the following calls for the same socket
+ * @return number of bytes sent, -1 on failure
+ */
+ssize_t send_file(int socket, int fd, off_t *offset, size_t count, http_pipe *pipe);
+
+/**
+ * @brief Refreshes the cached Date
+ * @details Formats the current time for the Date header of responses. This is meant to be called once per second by
+ * a single timer thread. Threads reading the Date with http_date are not blocked by this.
+ * @return 0 on success, -1 on failure
+ */
+int http_date_update(void);
+
+/**
+ * @brief Returns the cached Date
+ * @details Returns the current time formatted for the Date header, as last refreshed by http_date_update. It is
+ * refreshed on the first call if http_date_update has never been called. This is lock-free and thread-safe, the
+ * returned string stays valid for several refreshes.
+ * @return formatted date, NULL on failure
+ */
+const char *http_date(void);
+
+/**
+ * @brief Returns the token of a method
+ * @param method method to look up
+ * @return method token, e.g. "GET"
+ */
+const char *http_method_name(http_method method);
+
+/**
+ * @brief Formats a date for HTTP headers
+ * @details Formats time as IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT".
+ * @param buf buffer of at least HTTP_DATE_SIZE bytes
+ * @param time time to format
+ * @return 0 on success, -1 on failure
+ */
+int format_http_date(char *buf, time_t time);
+
+/**
+ * @brief Parses a date of an HTTP header
+ * @details Accepts IMF-fixdate as well as the obsolete RFC 850 and asctime formats.
+ * @param str null-terminated date
+ * @param time parsed time will be written here
+ * @return 0 on success, -1 if str is not a valid date
+ */
+int parse_http_date(const char *str, time_t *time);
+
+/**
+ * @brief Checks whether an entity tag is contained in a list
+ * @details Compares etag with the comma-separated entity tags in list, for example the value of If-None-Match, using
+ * the weak comparison. "*" matches any entity tag.
+ * @param list null-terminated list of entity tags
+ * @param etag quoted entity tag to look for
+ * @return 1 if etag is contained in list, 0 otherwise
+ */
+int match_etag(const char *list, const char *etag);
+
+/**
+ * @brief Returns the quality a list of preferences assigns to a token
+ * @details Looks up token in a comma-separated list with optional quality values, for example the value of
+ * Accept-Encoding. Tokens are compared case-insensitively. If token is not listed, the quality of "*" applies.
+ * @param list null-terminated list of preferences
+ * @param token token to look for
+ * @return quality in thousandths, 0 if token is not acceptable
+ */
+int accept_quality(const char *list, const char *token);
+
+/**
+ * @brief Parses the value of a Range header
+ * @details Parses a single byte range, e.g. "bytes=0-499", "bytes=500-" or "bytes=-500", and clamps it to size.
+ * Multiple ranges are not supported and reported like malformed values, so the caller can ignore the header.
+ * @param str null-terminated value of the Range header
+ * @param size size of the representation
+ * @param start first byte of the range will be written here
+ * @param end byte after the range will be written here
+ * @return 0 on success, -1 if the value is malformed or contains multiple ranges, -2 if the range is not satisfiable
+ */
+int parse_range(const char *str, off_t size, off_t *start, off_t *end);
+
+/**
+ * @brief Formats the static start of an HTTP response head
+ * @details Writes status line, headers of res and Content-Length into buf. Content-Length is left out if length is
+ * negative, which is needed for 304 responses, and replaced by Transfer-Encoding if res is chunked.
+ * Together with format_res_head_end this forms the same head as format_res_head, which allows to render this part once
+ * and reuse it for many responses. Truncation and return value are handled like with format_res_head.
+ * @param buf buffer the head is written into
+ * @param size size of buf
+ * @param res filled http_res struct which describes the http response, its body is ignored
+ * @param length value of the Content-Length header, or -1
+ * @return length of the formatted text (excluding the terminating null byte), -1 on failure
+ */
+int format_res_head_start(char *buf, size_t size, http_res *res, long length);
+
+/**
+ * @brief Formats the per-response end of an HTTP response head
+ * @details Writes Date, Connection and the empty line terminating the head into buf, see format_res_head_start.
+ * @param buf buffer the head is written into
+ * @param size size of buf
+ * @param keep_alive whether the connection is kept open after the response
+ * @return length of the formatted text (excluding the terminating null byte), -1 on failure
+ */
+int format_res_head_end(char *buf, size_t size, int keep_alive);
+
+/**
+ * @brief Formats the head of an HTTP response
+ * @details Writes status line, headers of res, Date, Content-Length and Connection into buf. The Date is taken from
+ * http_date. Like snprintf, the output is truncated to size bytes, but the full length is returned, so the caller can
+ * retry with a larger buffer.
+ * @param buf buffer the head is written into
+ * @param size size of buf
+ * @param res filled http_res struct which describes the http response, its body is ignored
+ * @param length value of the Content-Length header, or -1 to leave it out
+ * @return length of the complete head (excluding the terminating null byte), -1 on failure
+ */
+int format_res_head(char *buf, size_t size, http_res *res, long length);
+
+/**
+ * @brief Parses an HTTP request from a buffer
+ * @details Parses the request head at the start of buf. Data after the head, e.g. further pipelined requests, is not
+ * touched, so this can be called repeatedly to extract all complete requests of a buffer.
+ * Nothing is copied: path, header keys and values are terminated in place and point into buf, only the header array is
+ * allocated from arena. The request stays valid until buf is modified or arena is reset, free_http_req is not needed.
+ * @param buf buffer with received data
+ * @param ln number of bytes in buf
+ * @param req empty http_req struct. It will be filled with the request data
+ * @param arena arena the header array is allocated from
+ * @return length of the parsed head, 0 if buf does not contain a complete head yet, -1 on failure,
+ * -2 on malformed HTTP head, -3 on malformed headers or if the headers do not fit into arena
+ */
+long parse_req(char *buf, size_t ln, http_req *req, http_arena *arena);
+
+/**
+ * @brief Parses an HTTP response head from a buffer
+ * @details Parses the response head at the start of buf in place, see parse_req.
+ * @param buf buffer with received data
+ * @param ln number of bytes in buf
+ * @param res empty http_res struct. It will be filled with the response data
+ * @param arena arena the header array is allocated from
+ * @return length of the parsed head, 0 if buf does not contain a complete head yet, -1 on failure,
+ * -2 on malformed HTTP head, -3 on malformed headers or if the headers do not fit into arena
+ */
+long parse_res(char *buf, size_t ln, http_res *res, http_arena *arena);
+
 /**
  * @brief Waits for and receives an HTTP request
- * @details Waits for and receives an HTTP response and saved the data into res
+ * @details Waits for and receives an HTTP response and saved the data into res. keep_alive is set unless the client sent
+ * "Connection: close".
  * @param stream open socket
  * @param res empty http_req struct. It will be filled with the request data
  * @return 0 on success, -1 on failure, -2 on malformed HTTP head, -3 on malformed headers
@@ -108,13 +489,75 @@ int recv_req(FILE *stream, http_req *req);
 
 /**
  * @brief Waits for and receives an HTTP response
- * @details Waits for and receives an HTTP response and saved the data into res
+ * @details Waits for and receives an HTTP response and saved the data into res. content_length is taken from the
+ * Content-Length header and chunked from Transfer-Encoding, so the caller knows where the body ends, and keep_alive is
+ * set unless the server sent "Connection: close". The body can then be read with recv_body.
  * @param stream open socket
  * @param res empty http_res struct. It will be filled with the response data
  * @return 0 on success, -1 on failure, -2 on malformed HTTP head, -3 on malformed headers
  */
 int recv_res(FILE *stream, http_res *res);
 
+/**
+ * @brief Receives a part of a response body
+ * @details Reads the body of a response received with recv_res. Chunked bodies are decoded, their trailers are
+ * skipped. Bodies without length and transfer coding end when the server closes the connection.
+ * @param stream open socket the response was received on
+ * @param res response received with recv_res
+ * @param buf buffer the body is written into
+ * @param size size of buf
+ * @return number of bytes read, 0 at the end of the body, -1 on failure, -2 on malformed or truncated body
+ */
+ssize_t recv_body(FILE *stream, http_res *res, char *buf, size_t size);
+
+/**
+ * @brief Sends an HTTP request on a buffered connection
+ * @see send_req
+ */
+int http_conn_send_req(http_conn *conn, http_req *req);
+
+/**
+ * @brief Sends an HTTP response on a buffered connection
+ * @see send_res
+ */
+int http_conn_send_res(http_conn *conn, http_res *res);
+
+/**
+ * @brief Receives an HTTP request on a buffered connection
+ * @details Like recv_req, but heads larger than HTTP_CONN_BUF_SIZE are rejected as malformed.
+ * @see recv_req
+ */
+int http_conn_recv_req(http_conn *conn, http_req *req);
+
+/**
+ * @brief Receives an HTTP response on a buffered connection
+ * @details Like recv_res, but heads larger than HTTP_CONN_BUF_SIZE are rejected as malformed.
+ * @see recv_res
+ */
+int http_conn_recv_res(http_conn *conn, http_res *res);
+
+/**
+ * @brief Receives a part of a response body on a buffered connection
+ * @see recv_body
+ */
+ssize_t http_conn_recv_body(http_conn *conn, http_res *res, char *buf, size_t size);
+
+/**
+ * @brief Receives a part of a response body on a buffered connection into a file
+ * @details Like http_conn_recv_body, but the data is written to fd instead of a buffer. Data which is buffered already
+ * is written from the buffer of the connection, the rest is spliced from the socket through a pipe, so it is never
+ * copied to user space. Does not wait for size bytes, it moves what a single splice returns.
+ * @param conn connection to receive from
+ * @param res received response head
+ * @param fd file to write to
+ * @param offset offset to write at, advanced by the bytes written, NULL to write at the file position
+ * @param pipe_fds empty pipe to splice through, it is empty again on success
+ * @param size maximum number of bytes to move
+ * @return number of bytes moved, 0 at the end of the body, -1 if reading failed, -2 on a protocol error, -3 if
+ * writing fd failed, both with errno set
+ */
+ssize_t http_conn_splice_body(http_conn *conn, http_res *res, int fd, off_t *offset, int *pipe_fds, size_t size);
+
 /**
  * @brief Reads from stream until end of HTTP header
  * @details Reads from stream until end of HTTP header. This occurs either when the stream is closed with no data left,
@@ -126,14 +569,14 @@ int clear_http_head(FILE *stream);
 
 /**
  * @brief Frees a filled up http_req struct
- * @details Frees all memory allocations used by a populated http_req struct
+ * @details Frees the single buffer holding head and headers of a request received with recv_req
  * @param res filled http_req struct
  */
 void free_http_req(http_req *req);
 
 /**
  * @brief Frees a filled up http_res struct
- * @details Frees all memory allocations used by a populated http_res struct
+ * @details Frees the single buffer holding head and headers of a response received with recv_res
  * @param res filled http_res struct
  */
 void free_http_res(http_res *res);
@@ -0,0 +1,131 @@
+/**
+ * @file metrics.c
+ *
+ * @brief Metrics of the server threads
+ *
+ * @details Threads record into their own metrics_t, see metrics.h. Formatting merges them by summing the values of all
+ * threads, which needs no coordination with the threads recording.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "metrics.h"
+
+/**
+ * Names of the lookup outcomes, used as result label
+ */
+static const char *const lookup_names[METRICS_LOOKUP_LN] = {
+    [METRICS_CONTENT_HIT] = "content_hit",
+    [METRICS_OPEN_HIT] = "open_hit",
+    [METRICS_MISS] = "miss"
+};
+
+/**
+ * @brief Reads a counter written by another thread
+ * @param counter counter to read
+ * @return value of counter
+ */
+static uint64_t load(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Sums a member of the metrics of all threads
+ * @param metrics array of the metrics of all threads
+ * @param metrics_ln number of threads
+ * @param offset offset of the member in metrics_t
+ * @return sum of the member
+ */
+static uint64_t sum(metrics_t *metrics, size_t metrics_ln, size_t offset) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < metrics_ln; i++) {
+        total += load((const uint64_t *) ((const char *) &metrics[i] + offset));
+    }
+    return total;
+}
+
+/**
+ * @brief Formats a merged histogram
+ * @param out stream to format into
+ * @param metrics array of the metrics of all threads
+ * @param metrics_ln number of threads
+ * @param offset offset of the histogram in metrics_t
+ * @param name metric name
+ * @param help description of the metric
+ */
+static void format_histogram(FILE *out, metrics_t *metrics, size_t metrics_ln, size_t offset, const char *name,
+                             const char *help) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+
+    // Buckets are cumulative, so the count is the last bucket and consistent with them
+    uint64_t count = 0;
+    for (int i = 0; i <= METRICS_BUCKETS; i++) {
+        count += sum(metrics, metrics_ln, offset + offsetof(metrics_histogram_t, count) + i * sizeof(uint64_t));
+        if (i < METRICS_BUCKETS) {
+            fprintf(out, "%s_bucket{le=\"%.6f\"} %llu\n", name, (double) (1UL << i) / 1e6, (unsigned long long) count);
+        } else {
+            fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long) count);
+        }
+    }
+    fprintf(out, "%s_sum %.6f\n%s_count %llu\n", name,
+            (double) sum(metrics, metrics_ln, offset + offsetof(metrics_histogram_t, sum)) / 1e6, name,
+            (unsigned long long) count);
+}
+
+char *metrics_format(metrics_t *metrics, size_t metrics_ln, size_t *ln) {
+    char *text = NULL;
+    FILE *out = open_memstream(&text, ln);
+    if (out == NULL) {
+        return NULL;
+    }
+
+    fprintf(out, "# HELP http_connections_accepted_total Connections accepted\n"
+                 "# TYPE http_connections_accepted_total counter\n"
+                 "http_connections_accepted_total %llu\n",
+            (unsigned long long) sum(metrics, metrics_ln, offsetof(metrics_t, accepted)));
+
+    fprintf(out, "# HELP http_connections_active Connections currently open\n"
+                 "# TYPE http_connections_active gauge\n");
+    for (size_t i = 0; i < metrics_ln; i++) {
+        // Read closed first, so a connection closed in between cannot make the difference negative
+        uint64_t closed = load(&metrics[i].closed);
+        uint64_t accepted = load(&metrics[i].accepted);
+        fprintf(out, "http_connections_active{worker=\"%zu\"} %llu\n", i, (unsigned long long) (accepted - closed));
+    }
+
+    fprintf(out, "# HELP http_sent_bytes_total Bytes sent to clients, including heads\n"
+                 "# TYPE http_sent_bytes_total counter\n"
+                 "http_sent_bytes_total %llu\n",
+            (unsigned long long) sum(metrics, metrics_ln, offsetof(metrics_t, bytes_sent)));
+
+    fprintf(out, "# HELP http_responses_total Responses sent completely, by status code\n"
+                 "# TYPE http_responses_total counter\n");
+    for (int i = 0; i < METRICS_STATUS_LN; i++) {
+        uint64_t count = sum(metrics, metrics_ln, offsetof(metrics_t, responses) + i * sizeof(uint64_t));
+        if (count > 0) {
+            fprintf(out, "http_responses_total{code=\"%d\"} %llu\n", METRICS_STATUS_MIN + i,
+                    (unsigned long long) count);
+        }
+    }
+
+    fprintf(out, "# HELP http_file_lookups_total Requested files, by whether they were cached\n"
+                 "# TYPE http_file_lookups_total counter\n");
+    for (int i = 0; i < METRICS_LOOKUP_LN; i++) {
+        fprintf(out, "http_file_lookups_total{result=\"%s\"} %llu\n", lookup_names[i],
+                (unsigned long long) sum(metrics, metrics_ln, offsetof(metrics_t, lookups) + i * sizeof(uint64_t)));
+    }
+
+    format_histogram(out, metrics, metrics_ln, offsetof(metrics_t, first_byte), "http_first_byte_seconds",
+                     "Time from accepting the connection, or receiving the request on a reused one, to the first byte "
+                     "of the response");
+    format_histogram(out, metrics, metrics_ln, offsetof(metrics_t, last_byte), "http_transfer_seconds",
+                     "Time from the first to the last byte of the response");
+
+    if (fclose(out) == EOF) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
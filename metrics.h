@@ -0,0 +1,102 @@
+#ifndef UE3_METRICS_H
+#define UE3_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Number of finite buckets of a histogram, bucket i counts durations below 2^i microseconds
+ */
+#define METRICS_BUCKETS 24
+
+/**
+ * Lowest status code which is counted
+ */
+#define METRICS_STATUS_MIN 100
+
+/**
+ * Number of status codes which are counted, starting with METRICS_STATUS_MIN
+ */
+#define METRICS_STATUS_LN 500
+
+/**
+ * Outcomes of looking up a requested file before it is opened
+ */
+typedef enum {
+    METRICS_CONTENT_HIT, // served from the content cache
+    METRICS_OPEN_HIT, // served from the open file cache
+    METRICS_MISS, // opened from the file system
+    METRICS_LOOKUP_LN
+} metrics_lookup;
+
+/**
+ * Struct representing a histogram of durations with power of two buckets
+ */
+typedef struct {
+    uint64_t count[METRICS_BUCKETS + 1]; // last bucket counts the durations exceeding all others
+    uint64_t sum; // microseconds
+} metrics_histogram_t;
+
+/**
+ * Struct representing the metrics of a single thread
+ * Every member is only written by the owning thread and read by others with atomic loads, so recording a value
+ * neither locks nor needs an atomic read-modify-write. Aligned to a cache line, so threads do not share lines.
+ */
+typedef struct {
+    uint64_t accepted; // connections accepted
+    uint64_t closed; // connections closed
+    uint64_t bytes_sent;
+    uint64_t responses[METRICS_STATUS_LN]; // by status code, starting with METRICS_STATUS_MIN
+    uint64_t lookups[METRICS_LOOKUP_LN];
+    metrics_histogram_t first_byte; // accepting the connection or receiving the request to the first byte sent
+    metrics_histogram_t last_byte; // first to last byte of the response sent
+} __attribute__((aligned(64))) metrics_t;
+
+/**
+ * @brief Adds to a counter
+ * @details Must only be called by the thread owning the counter.
+ * @param counter counter to add to
+ * @param n value to add
+ */
+static inline void metrics_add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Records a duration in a histogram
+ * @details Must only be called by the thread owning the histogram.
+ * @param histogram histogram to record in
+ * @param us duration in microseconds, negative durations are recorded as 0
+ */
+static inline void metrics_observe(metrics_histogram_t *histogram, long us) {
+    uint64_t value = us > 0 ? (uint64_t) us : 0;
+    int bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+    metrics_add(&histogram->count[bucket < METRICS_BUCKETS ? bucket : METRICS_BUCKETS], 1);
+    metrics_add(&histogram->sum, value);
+}
+
+/**
+ * @brief Records a response
+ * @details Responses with status codes outside of the counted range are ignored.
+ * @param metrics metrics of the calling thread
+ * @param code status code of the response
+ */
+static inline void metrics_response(metrics_t *metrics, long code) {
+    if (code >= METRICS_STATUS_MIN && code < METRICS_STATUS_MIN + METRICS_STATUS_LN) {
+        metrics_add(&metrics->responses[code - METRICS_STATUS_MIN], 1);
+    }
+}
+
+/**
+ * @brief Formats metrics in the Prometheus text format
+ * @details Merges the metrics of all threads. Active connections are reported per thread, with the index of the
+ * thread as worker label, so the balance between the workers shows. May be called by any thread while the metrics
+ * are being updated.
+ * @param metrics array of the metrics of all threads
+ * @param metrics_ln number of threads
+ * @param ln length of the formatted text will be written here
+ * @return newly allocated text, NULL on failure
+ */
+char *metrics_format(metrics_t *metrics, size_t metrics_ln, size_t *ln);
+
+#endif //UE3_METRICS_H
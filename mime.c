@@ -0,0 +1,216 @@
+/**
+ * @file mime.c
+ *
+ * @brief MIME types by file extension
+ *
+ * @details The built-in types are a perfect hash table generated from mime.types at build time, see mimegen.c.
+ * Types loaded at startup are kept in a second, open addressing table which is checked first.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "mime.h"
+#include "mime_table.h"
+
+/**
+ * Types loaded with mime_load, NULL if there are none
+ */
+static mime_t *loaded = NULL;
+
+/**
+ * Number of slots of loaded, a power of two that is at least twice the number of types
+ */
+static size_t loaded_size = 0;
+
+/**
+ * Content of the loaded file, the strings of loaded point into it
+ */
+static char *loaded_data = NULL;
+
+/**
+ * @brief Extracts the extension of a path in lower case
+ * @param path path of the file
+ * @param extension buffer of MIME_EXTENSION_SIZE bytes the extension will be written to
+ * @return 0 on success, -1 if the last segment of path has no extension or it is too long
+ */
+static int get_extension(const char *path, char *extension) {
+    const char *dot = strrchr(path, '.');
+    if (dot == NULL || strchr(dot, '/') != NULL) {
+        return -1;
+    }
+    dot++;
+
+    size_t ln = strlen(dot);
+    if (ln == 0 || ln >= MIME_EXTENSION_SIZE) {
+        return -1;
+    }
+    for (size_t i = 0; i <= ln; i++) {
+        extension[i] = (char) tolower((unsigned char) dot[i]);
+    }
+    return 0;
+}
+
+/**
+ * @brief Finds the slot of an extension in the loaded table
+ * @param extension lower case extension
+ * @return slot holding extension, or the empty slot it would be inserted at
+ */
+static mime_t *find_loaded(const char *extension) {
+    size_t i = mime_hash(extension, 0) & (loaded_size - 1);
+    while (loaded[i].extension != NULL && strcmp(loaded[i].extension, extension) != 0) {
+        i = (i + 1) & (loaded_size - 1);
+    }
+    return &loaded[i];
+}
+
+const mime_t *mime_lookup(const char *path) {
+    char extension[MIME_EXTENSION_SIZE];
+    if (get_extension(path, extension) == -1) {
+        return NULL;
+    }
+
+    if (loaded != NULL) {
+        mime_t *mime = find_loaded(extension);
+        if (mime->extension != NULL) {
+            return mime;
+        }
+    }
+
+    const mime_t *mime = &mime_table[mime_hash(extension, MIME_TABLE_SEED) & (MIME_TABLE_SIZE - 1)];
+    return mime->extension != NULL && strcmp(mime->extension, extension) == 0 ? mime : NULL;
+}
+
+/**
+ * @brief Reads a whole file into memory
+ * @param path path of the file
+ * @return newly allocated, null terminated content, NULL on failure
+ */
+static char *read_all(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return NULL;
+    }
+
+    size_t size = 4096;
+    size_t ln = 0;
+    char *data = malloc(size);
+    while (data != NULL) {
+        ln += fread(&data[ln], 1, size - ln - 1, file);
+        if (ln < size - 1) {
+            break;
+        }
+        size *= 2;
+        char *grown = realloc(data, size);
+        if (grown == NULL) {
+            free(data);
+        }
+        data = grown;
+    }
+
+    if (data != NULL && ferror(file)) {
+        free(data);
+        data = NULL;
+        errno = EIO;
+    }
+    fclose(file);
+    if (data != NULL) {
+        data[ln] = '\0';
+    }
+    return data;
+}
+
+/**
+ * @brief Parses the types of a mime.types file
+ * @details Terminates types and extensions in place and lower cases the extensions. Without a table, the extensions
+ * are only counted.
+ * @param data content of the file
+ * @param table table to insert into, or NULL
+ * @return number of extensions, -1 if the file is malformed
+ */
+static long parse_types(char *data, mime_t *table) {
+    long count = 0;
+    char *line_save;
+    for (char *line = strtok_r(data, "\n", &line_save); line != NULL; line = strtok_r(NULL, "\n", &line_save)) {
+        char *comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+
+        char *save;
+        char *type = strtok_r(line, " \t\r", &save);
+        if (type == NULL) {
+            continue;
+        } else if (strchr(type, '/') == NULL) {
+            return -1;
+        }
+        for (char *extension = strtok_r(NULL, " \t\r", &save); extension != NULL;
+             extension = strtok_r(NULL, " \t\r", &save)) {
+            if (strlen(extension) >= MIME_EXTENSION_SIZE) {
+                return -1;
+            }
+            for (char *c = extension; *c != '\0'; c++) {
+                *c = (char) tolower((unsigned char) *c);
+            }
+            if (table != NULL) {
+                // Later lines win over earlier ones
+                mime_t *slot = find_loaded(extension);
+                *slot = (mime_t) {
+                    .extension = extension,
+                    .type = type,
+                    .compressible = mime_is_compressible(type)
+                };
+            }
+            count++;
+        }
+    }
+    return count;
+}
+
+int mime_load(const char *path) {
+    char *data = read_all(path);
+    if (data == NULL) {
+        return -1;
+    }
+
+    // Parsing terminates the tokens in place, so the table is filled from a second copy
+    char *copy = strdup(data);
+    if (copy == NULL) {
+        free(data);
+        return -1;
+    }
+    long count = parse_types(copy, NULL);
+    free(copy);
+    if (count == -1) {
+        free(data);
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t size = 1;
+    while (size < 2 * (size_t) count) {
+        size *= 2;
+    }
+    mime_t *table = calloc(size, sizeof(mime_t));
+    if (table == NULL) {
+        free(data);
+        return -1;
+    }
+
+    mime_unload();
+    loaded = table;
+    loaded_size = size;
+    loaded_data = data;
+    parse_types(data, table);
+    return 0;
+}
+
+void mime_unload(void) {
+    free(loaded);
+    free(loaded_data);
+    loaded = NULL;
+    loaded_size = 0;
+    loaded_data = NULL;
+}
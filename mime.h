@@ -0,0 +1,75 @@
+#ifndef UE3_MIME_H
+#define UE3_MIME_H
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Maximum length of an extension which can be looked up, including the terminating null byte
+ */
+#define MIME_EXTENSION_SIZE 16
+
+/**
+ * Struct representing the MIME type of an extension
+ */
+typedef struct {
+    const char *extension; // lower case, without dot
+    const char *type;
+    int compressible; // files of this type are worth compressing with a content coding
+} mime_t;
+
+/**
+ * @brief Hashes an extension
+ * @details 32 bit FNV-1a starting from seed. Shared with mimegen, which searches a seed without collisions for the
+ * built-in table.
+ * @param extension lower case extension
+ * @param seed seed of the table
+ * @return hash of extension
+ */
+static inline uint32_t mime_hash(const char *extension, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (; *extension != '\0'; extension++) {
+        hash ^= (unsigned char) *extension;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief Determines whether files of a type are worth compressing
+ * @details Text, scripts, markup and uncompressed fonts are, images, media and archives other than SVG are compressed
+ * already. Shared with mimegen.
+ * @param type MIME type
+ * @return 1 if type is compressible, 0 otherwise
+ */
+static inline int mime_is_compressible(const char *type) {
+    return strncmp(type, "text/", 5) == 0 || strstr(type, "javascript") != NULL || strstr(type, "json") != NULL ||
+           strstr(type, "xml") != NULL || strcmp(type, "application/wasm") == 0 || strcmp(type, "font/ttf") == 0 ||
+           strcmp(type, "font/otf") == 0 || strcmp(type, "application/vnd.ms-fontobject") == 0 ||
+           strcmp(type, "image/x-icon") == 0 || strcmp(type, "image/bmp") == 0;
+}
+
+/**
+ * @brief Looks up the MIME type of a file
+ * @details Uses the extension of the last path segment, ignoring case. Types loaded with mime_load take precedence
+ * over the built-in table. Costs a single hash probe regardless of the table sizes.
+ * @param path path of the file
+ * @return MIME type, NULL if the extension is unknown
+ */
+const mime_t *mime_lookup(const char *path);
+
+/**
+ * @brief Loads additional MIME types
+ * @details Reads a file in the format of mime.types, lines hold a type followed by its extensions. Has to be called
+ * before the first lookup, it is not thread-safe.
+ * @param path path of the file
+ * @return 0 on success, -1 on failure with errno set, EINVAL if the file is malformed
+ */
+int mime_load(const char *path);
+
+/**
+ * @brief Releases the types loaded with mime_load
+ */
+void mime_unload(void);
+
+#endif //UE3_MIME_H
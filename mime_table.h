@@ -0,0 +1,64 @@
+/**
+ * @file mime_table.h
+ *
+ * @brief Built-in MIME types, generated by mimegen from mime.types
+ */
+
+#define MIME_TABLE_SEED 4u
+#define MIME_TABLE_SIZE 512
+
+static const mime_t mime_table[MIME_TABLE_SIZE] = {
+    [19] = { "ogv", "video/ogg", 0 },
+    [27] = { "csv", "text/csv", 1 },
+    [31] = { "json", "application/json", 1 },
+    [39] = { "flac", "audio/flac", 0 },
+    [56] = { "zip", "application/zip", 0 },
+    [69] = { "vtt", "text/vtt", 1 },
+    [84] = { "otf", "font/otf", 1 },
+    [95] = { "woff", "font/woff", 0 },
+    [104] = { "tar", "application/x-tar", 0 },
+    [111] = { "webp", "image/webp", 0 },
+    [112] = { "png", "image/png", 0 },
+    [119] = { "eot", "application/vnd.ms-fontobject", 1 },
+    [132] = { "html", "text/html", 1 },
+    [133] = { "gif", "image/gif", 0 },
+    [151] = { "jsonld", "application/ld+json", 1 },
+    [163] = { "m4a", "audio/mp4", 0 },
+    [167] = { "apng", "image/apng", 0 },
+    [189] = { "mp3", "audio/mpeg", 0 },
+    [212] = { "css", "text/css", 1 },
+    [219] = { "mjs", "application/javascript", 1 },
+    [224] = { "md", "text/markdown", 1 },
+    [246] = { "opus", "audio/ogg", 0 },
+    [248] = { "gz", "application/gzip", 0 },
+    [260] = { "bmp", "image/bmp", 1 },
+    [265] = { "wasm", "application/wasm", 1 },
+    [266] = { "xml", "application/xml", 1 },
+    [278] = { "xhtml", "application/xhtml+xml", 1 },
+    [281] = { "pdf", "application/pdf", 0 },
+    [282] = { "bin", "application/octet-stream", 0 },
+    [290] = { "oga", "audio/ogg", 0 },
+    [293] = { "ttf", "font/ttf", 1 },
+    [332] = { "atom", "application/atom+xml", 1 },
+    [336] = { "aac", "audio/aac", 0 },
+    [338] = { "m4v", "video/mp4", 0 },
+    [341] = { "avif", "image/avif", 0 },
+    [366] = { "tiff", "image/tiff", 0 },
+    [384] = { "htm", "text/html", 1 },
+    [391] = { "rss", "application/rss+xml", 1 },
+    [407] = { "woff2", "font/woff2", 0 },
+    [426] = { "ico", "image/x-icon", 1 },
+    [432] = { "ogg", "audio/ogg", 0 },
+    [440] = { "mp4", "video/mp4", 0 },
+    [453] = { "mov", "video/quicktime", 0 },
+    [467] = { "txt", "text/plain", 1 },
+    [476] = { "jpg", "image/jpeg", 0 },
+    [484] = { "webmanifest", "application/manifest+json", 1 },
+    [485] = { "svg", "image/svg+xml", 1 },
+    [486] = { "js", "application/javascript", 1 },
+    [502] = { "ics", "text/calendar", 1 },
+    [504] = { "webm", "video/webm", 0 },
+    [508] = { "tif", "image/tiff", 0 },
+    [509] = { "wav", "audio/wav", 0 },
+    [511] = { "jpeg", "image/jpeg", 0 },
+};
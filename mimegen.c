@@ -0,0 +1,185 @@
+/**
+ * @file mimegen.c
+ *
+ * @brief Generator of the built-in MIME table
+ *
+ * @details Reads mime.types and writes mime_table.h, a perfect hash table of the extensions: a seed of mime_hash is
+ * searched under which no two extensions share a slot, so a lookup needs a single probe. The table is doubled until
+ * such a seed is found.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "mime.h"
+
+/**
+ * Number of seeds tried per table size
+ */
+#define MAX_SEEDS 100000
+
+/**
+ * Maximum length of a line of mime.types
+ */
+#define LINE_SIZE 1024
+
+/**
+ * @brief Reads all types of a mime.types file
+ * @param file file to read
+ * @param entries array of read mime_t, newly allocated, will be written here
+ * @param entry_ln number of entries will be written here
+ * @return 0 on success, -1 on failure
+ */
+static int read_types(FILE *file, mime_t **entries, size_t *entry_ln) {
+    size_t capacity = 64;
+    *entries = malloc(capacity * sizeof(mime_t));
+    *entry_ln = 0;
+    if (*entries == NULL) {
+        return -1;
+    }
+
+    char line[LINE_SIZE];
+    for (int line_nr = 1; fgets(line, sizeof(line), file) != NULL; line_nr++) {
+        char *comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+
+        char *save;
+        char *type = strtok_r(line, " \t\r\n", &save);
+        if (type != NULL && strchr(type, '/') == NULL) {
+            fprintf(stderr, "Line %d: invalid type %s\n", line_nr, type);
+            return -1;
+        }
+        for (char *extension = type != NULL ? strtok_r(NULL, " \t\r\n", &save) : NULL; extension != NULL;
+             extension = strtok_r(NULL, " \t\r\n", &save)) {
+            if (strlen(extension) >= MIME_EXTENSION_SIZE) {
+                fprintf(stderr, "Line %d: extension %s is too long\n", line_nr, extension);
+                return -1;
+            }
+            for (char *c = extension; *c != '\0'; c++) {
+                *c = (char) tolower((unsigned char) *c);
+            }
+            for (size_t i = 0; i < *entry_ln; i++) {
+                if (strcmp((*entries)[i].extension, extension) == 0) {
+                    fprintf(stderr, "Line %d: extension %s is listed twice\n", line_nr, extension);
+                    return -1;
+                }
+            }
+
+            if (*entry_ln == capacity) {
+                capacity *= 2;
+                mime_t *grown = realloc(*entries, capacity * sizeof(mime_t));
+                if (grown == NULL) {
+                    return -1;
+                }
+                *entries = grown;
+            }
+            mime_t *entry = &(*entries)[(*entry_ln)++];
+            entry->extension = strdup(extension);
+            entry->type = strdup(type);
+            if (entry->extension == NULL || entry->type == NULL) {
+                return -1;
+            }
+            entry->compressible = mime_is_compressible(type);
+        }
+    }
+    return ferror(file) ? -1 : 0;
+}
+
+/**
+ * @brief Searches a seed under which all extensions hash to different slots
+ * @param entries entries of the table
+ * @param entry_ln number of entries
+ * @param size table size, a power of two
+ * @param slots array of size slots, will be filled with the entry index of each slot or -1
+ * @param seed found seed will be written here
+ * @return 0 if a seed was found, -1 otherwise
+ */
+static int find_seed(mime_t *entries, size_t entry_ln, size_t size, long *slots, uint32_t *seed) {
+    for (*seed = 0; *seed < MAX_SEEDS; (*seed)++) {
+        for (size_t i = 0; i < size; i++) {
+            slots[i] = -1;
+        }
+        size_t i = 0;
+        for (; i < entry_ln; i++) {
+            long *slot = &slots[mime_hash(entries[i].extension, *seed) & (size - 1)];
+            if (*slot != -1) {
+                break;
+            }
+            *slot = (long) i;
+        }
+        if (i == entry_ln) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Entry point of the generator
+ * @details Usage: mimegen mime.types > mime_table.h
+ * @param argc argc passed to program
+ * @param argv argv passed to program
+ * @return exit code
+ */
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s MIME_TYPES\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *file = fopen(argv[1], "r");
+    if (file == NULL) {
+        perror("Failed to open MIME types");
+        return EXIT_FAILURE;
+    }
+    mime_t *entries;
+    size_t entry_ln;
+    int failed = read_types(file, &entries, &entry_ln) == -1;
+    int err_code = errno;
+    fclose(file);
+    if (failed) {
+        errno = err_code;
+        perror("Failed to read MIME types");
+        return EXIT_FAILURE;
+    }
+
+    size_t size = 1;
+    while (size < 2 * entry_ln) {
+        size *= 2;
+    }
+    long *slots = NULL;
+    uint32_t seed;
+    while (1) {
+        slots = realloc(slots, size * sizeof(long));
+        if (slots == NULL) {
+            perror("Failed to allocate memory");
+            return EXIT_FAILURE;
+        }
+        if (find_seed(entries, entry_ln, size, slots, &seed) == 0) {
+            break;
+        }
+        size *= 2;
+    }
+
+    printf("/**\n"
+           " * @file mime_table.h\n"
+           " *\n"
+           " * @brief Built-in MIME types, generated by mimegen from %s\n"
+           " */\n\n", argv[1]);
+    printf("#define MIME_TABLE_SEED %uu\n", seed);
+    printf("#define MIME_TABLE_SIZE %zu\n\n", size);
+    printf("static const mime_t mime_table[MIME_TABLE_SIZE] = {\n");
+    for (size_t i = 0; i < size; i++) {
+        if (slots[i] != -1) {
+            mime_t *entry = &entries[slots[i]];
+            printf("    [%zu] = { \"%s\", \"%s\", %d },\n", i, entry->extension, entry->type, entry->compressible);
+        }
+    }
+    printf("};\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,183 @@
+/**
+ * @file offload.c
+ *
+ * @brief Thread pool for blocking jobs
+ *
+ * @details Runs jobs which may block, like file system accesses, on a fixed number of threads, so event loops are not
+ * stalled by them. Jobs are queued under a mutex, completed jobs are pushed to lock-free completion queues which are
+ * signalled through an eventfd.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "offload.h"
+
+struct offload_s {
+    pthread_mutex_t lock;
+    pthread_cond_t ready; // signalled when a job is queued or the pool stops
+    offload_job_t *first; // queued jobs in order of submission
+    offload_job_t *last;
+    size_t queued;
+    size_t max_queued;
+    int stopping;
+    size_t thread_ln;
+    pthread_t *threads;
+};
+
+int offload_completions_init(offload_completions_t *completions) {
+    completions->head = NULL;
+    completions->event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return completions->event == -1 ? -1 : 0;
+}
+
+void offload_completions_destroy(offload_completions_t *completions) {
+    close(completions->event);
+}
+
+/**
+ * @brief Pushes a completed job to its completion queue
+ * @details Only the push to an empty queue signals the eventfd, the consumer takes all jobs at once anyway.
+ * @param job completed job
+ */
+static void offload_complete(offload_job_t *job) {
+    offload_completions_t *completions = job->completions;
+    offload_job_t *head = __atomic_load_n(&completions->head, __ATOMIC_RELAXED);
+    do {
+        job->next = head;
+    } while (!__atomic_compare_exchange_n(&completions->head, &head, job, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    uint64_t one = 1;
+    if (head == NULL && write(completions->event, &one, sizeof(one)) == -1) {
+        perror("Failed to signal completed job");
+    }
+}
+
+offload_job_t *offload_completions_take(offload_completions_t *completions) {
+    // The event is not set anymore if the jobs were taken by an earlier call already
+    uint64_t count;
+    if (read(completions->event, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("Failed to reset completion event");
+    }
+
+    // Reverse the stack, so jobs are handled in the order they completed
+    offload_job_t *job = __atomic_exchange_n(&completions->head, NULL, __ATOMIC_ACQUIRE);
+    offload_job_t *ordered = NULL;
+    while (job != NULL) {
+        offload_job_t *next = job->next;
+        job->next = ordered;
+        ordered = job;
+        job = next;
+    }
+    return ordered;
+}
+
+/**
+ * @brief Entry point of a pool thread
+ * @details Runs queued jobs until the pool stops and no jobs are left.
+ * @param arg offload_t of the thread
+ * @return NULL
+ */
+static void *offload_run(void *arg) {
+    offload_t *offload = arg;
+    pthread_mutex_lock(&offload->lock);
+    while (1) {
+        while (offload->first == NULL && !offload->stopping) {
+            pthread_cond_wait(&offload->ready, &offload->lock);
+        }
+        offload_job_t *job = offload->first;
+        if (job == NULL) {
+            break;
+        }
+        offload->first = job->next;
+        if (offload->first == NULL) {
+            offload->last = NULL;
+        }
+        offload->queued--;
+        pthread_mutex_unlock(&offload->lock);
+
+        job->run(job);
+        offload_complete(job);
+        pthread_mutex_lock(&offload->lock);
+    }
+    pthread_mutex_unlock(&offload->lock);
+    return NULL;
+}
+
+offload_t *offload_create(size_t threads, size_t max_queued) {
+    offload_t *offload = malloc(sizeof(offload_t));
+    if (offload == NULL) {
+        return NULL;
+    }
+    offload->threads = malloc(threads * sizeof(pthread_t));
+    if (offload->threads == NULL) {
+        free(offload);
+        return NULL;
+    }
+    if ((errno = pthread_mutex_init(&offload->lock, NULL)) != 0) {
+        free(offload->threads);
+        free(offload);
+        return NULL;
+    }
+    if ((errno = pthread_cond_init(&offload->ready, NULL)) != 0) {
+        pthread_mutex_destroy(&offload->lock);
+        free(offload->threads);
+        free(offload);
+        return NULL;
+    }
+    offload->first = NULL;
+    offload->last = NULL;
+    offload->queued = 0;
+    offload->max_queued = max_queued;
+    offload->stopping = 0;
+
+    for (offload->thread_ln = 0; offload->thread_ln < threads; offload->thread_ln++) {
+        int err_code = pthread_create(&offload->threads[offload->thread_ln], NULL, offload_run, offload);
+        if (err_code != 0) {
+            offload_destroy(offload);
+            errno = err_code;
+            return NULL;
+        }
+    }
+    return offload;
+}
+
+void offload_destroy(offload_t *offload) {
+    pthread_mutex_lock(&offload->lock);
+    offload->stopping = 1;
+    pthread_cond_broadcast(&offload->ready);
+    pthread_mutex_unlock(&offload->lock);
+
+    for (size_t i = 0; i < offload->thread_ln; i++) {
+        pthread_join(offload->threads[i], NULL);
+    }
+    pthread_cond_destroy(&offload->ready);
+    pthread_mutex_destroy(&offload->lock);
+    free(offload->threads);
+    free(offload);
+}
+
+int offload_submit(offload_t *offload, offload_job_t *job) {
+    job->next = NULL;
+    pthread_mutex_lock(&offload->lock);
+    if (offload->queued == offload->max_queued) {
+        pthread_mutex_unlock(&offload->lock);
+        errno = EAGAIN;
+        return -1;
+    }
+    if (offload->last != NULL) {
+        offload->last->next = job;
+    } else {
+        offload->first = job;
+    }
+    offload->last = job;
+    offload->queued++;
+    pthread_cond_signal(&offload->ready);
+    pthread_mutex_unlock(&offload->lock);
+    return 0;
+}
@@ -0,0 +1,81 @@
+#ifndef UE3_OFFLOAD_H
+#define UE3_OFFLOAD_H
+
+#include <stddef.h>
+
+struct offload_completions_s;
+
+/**
+ * Struct representing a blocking job run by a thread pool
+ * Jobs are embedded as first member into a larger structure holding their arguments and results.
+ */
+typedef struct offload_job_s {
+    void (*run)(struct offload_job_s *job); // called on a pool thread
+    struct offload_completions_s *completions; // queue the job is pushed to once it has run
+
+    // Internal members
+    struct offload_job_s *next;
+} offload_job_t;
+
+/**
+ * Struct representing a queue of completed jobs, consumed by a single thread
+ * Pool threads push completed jobs without locking. The event file descriptor becomes readable as soon as the queue
+ * is not empty anymore, so it can be waited for together with sockets.
+ */
+typedef struct offload_completions_s {
+    offload_job_t *head; // most recently completed job first, accessed atomically
+    int event; // non-blocking eventfd
+} offload_completions_t;
+
+/**
+ * Struct representing a pool of threads running blocking jobs
+ */
+typedef struct offload_s offload_t;
+
+/**
+ * @brief Initializes a completion queue
+ * @param completions queue to initialize
+ * @return 0 on success, -1 on failure
+ */
+int offload_completions_init(offload_completions_t *completions);
+
+/**
+ * @brief Releases a completion queue
+ * @details Jobs still in the queue are not freed.
+ * @param completions queue to release
+ */
+void offload_completions_destroy(offload_completions_t *completions);
+
+/**
+ * @brief Takes all completed jobs
+ * @details Resets the event file descriptor as well.
+ * @param completions queue to take from
+ * @return completed jobs in order of completion linked by next, NULL if there are none
+ */
+offload_job_t *offload_completions_take(offload_completions_t *completions);
+
+/**
+ * @brief Creates a thread pool
+ * @param threads number of threads
+ * @param max_queued maximum number of jobs waiting for a thread
+ * @return new pool, NULL on failure
+ */
+offload_t *offload_create(size_t threads, size_t max_queued);
+
+/**
+ * @brief Destroys a thread pool
+ * @details Waits until all queued jobs have run and stops the threads.
+ * @param offload pool to destroy
+ */
+void offload_destroy(offload_t *offload);
+
+/**
+ * @brief Queues a job
+ * @details The job is run on a pool thread and pushed to its completion queue afterwards.
+ * @param offload pool to run the job on
+ * @param job job to run, must stay valid until it has been taken from the completion queue
+ * @return 0 on success, -1 if max_queued jobs are waiting already
+ */
+int offload_submit(offload_t *offload, offload_job_t *job);
+
+#endif //UE3_OFFLOAD_H
@@ -6,7 +6,17 @@
  * @brief Basic HTTP Server Implementation
  *
  * @details This is a HTTP Server Implementation.
- * Response with data in a file. The file path is calculated based on the path in the URL and DOC_ROOT.
+ * Response with data in a file. The file is opened relative to DOC_ROOT, which is opened once at startup, and may
+ * not lie outside of it.
+ * Connections are served by worker threads, each running a non-blocking, epoll based event loop. Alternatively, the
+ * loop can be driven by io_uring, which accepts connections, receives requests, sends response heads and opens files
+ * with batched submissions instead of readiness notifications and system calls. Connections are
+ * persistent until they are idle for IDLE_TIMEOUT seconds or MAX_REQUESTS requests have been served.
+ * Optionally, up to MAX_BYTES of frequently requested files are cached in memory together with their response heads.
+ * If MAX_UPLOAD is set, files of up to that size can be uploaded into DOC_ROOT with PUT or POST.
+ * Files which are not cached can be opened and loaded by a pool of FILE_THREADS threads, so slow file systems do not
+ * stall the event loops. Up to MAX_OPEN files can be kept open together with their status, so files which are sent
+ * with sendfile do not cost open, fstat and close on every request.
  */
 
 #include <stdlib.h>
@@ -16,8 +26,187 @@
 #include <signal.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
 
 #include "http.h"
+#include "cache.h"
+#include "compress.h"
+#include "uring.h"
+#include "offload.h"
+#include "fdcache.h"
+#include "mime.h"
+#include "metrics.h"
+#include "accesslog.h"
+
+#if defined(__has_include)
+#if __has_include(<linux/openat2.h>)
+#include <linux/openat2.h>
+#define OPENAT2_SUPPORTED 1
+#endif
+#endif
+
+#if defined(OPENAT2_SUPPORTED) && defined(STATX_BASIC_STATS)
+#define URING_OPEN_SUPPORTED 1 // the io_uring engine can open files beneath DOC_ROOT itself
+#endif
+
+/**
+ * Maximum size of a request head, larger requests are answered with 400
+ */
+#define CONN_BUF_SIZE 8192
+
+/**
+ * Maximum size of a response head
+ */
+#define CONN_HEAD_SIZE 1024
+
+/**
+ * Size of the output buffer of a connection, which holds the heads of all queued responses and small bodies
+ */
+#define CONN_OUT_SIZE 16384
+
+/**
+ * Bodies up to this size are copied behind their head, so they are sent together with it instead of using sendfile
+ */
+#define CONN_INLINE_BODY 2048
+
+/**
+ * Size of an entity tag formatted with format_etag, including quotes and the terminating null byte
+ */
+#define ETAG_SIZE 64
+
+/**
+ * Files smaller than this are not compressed, as the saving would not outweigh the headers
+ */
+#define COMPRESS_MIN_SIZE 256
+
+/**
+ * Files larger than this are not compressed on the fly, as compressing them at the best level would stall the event
+ * loop or a file thread for too long. They are sent as they are, unless a precompressed sibling exists.
+ */
+#define COMPRESS_MAX_SIZE (1024 * 1024)
+
+/**
+ * Size of a formatted Content-Range value, including the terminating null byte
+ */
+#define CONTENT_RANGE_SIZE 72
+
+/**
+ * Capacity requested for the pipe uploads are spliced through
+ */
+#define UPLOAD_PIPE_SIZE (1024 * 1024)
+
+/**
+ * Size of the name of the temporary file of an upload, including the null terminator
+ */
+#define UPLOAD_TMP_SIZE 32
+
+/**
+ * Number of names tried for the temporary file of an upload before it fails
+ */
+#define UPLOAD_TMP_ATTEMPTS 16
+
+/**
+ * Size of the buffers holding the path of a requested file relative to DOC_ROOT, including the terminating null byte
+ */
+#define PATH_SIZE 4096
+
+/**
+ * Size of the buffer of a connection holding method and path of its pipelined requests for the access log, longer
+ * ones are truncated
+ */
+#define CONN_LOG_SIZE 4096
+
+/**
+ * Maximum length of a line of the access log, longer lines are truncated
+ */
+#define ACCESS_LOG_LINE 1024
+
+/**
+ * Size of the ring buffer each worker logs requests into
+ */
+#define ACCESS_LOG_RING (1024 * 1024)
+
+/**
+ * Milliseconds between writes of the access log
+ */
+#define ACCESS_LOG_INTERVAL 100
+
+/**
+ * Maximum number of pipelined requests handled in one batch
+ */
+#define PIPELINE_DEPTH 16
+
+/**
+ * Maximum number of headers of a request, requests with more headers are answered with 400
+ */
+#define MAX_HEADERS 100
+
+/**
+ * Maximum number of events handled per epoll_wait call
+ */
+#define MAX_EVENTS 64
+
+/**
+ * Maximum number of file jobs waiting for a thread of the offload pool, further files are opened by the event loop
+ */
+#define OFFLOAD_QUEUE 1024
+
+/**
+ * Milliseconds a file is kept open at most, so changes inotify does not report are picked up as well
+ */
+#define OPEN_FILE_TTL 2000
+
+/**
+ * Number of submission queue entries of the io_uring engine
+ */
+#define URING_ENTRIES 256
+
+/**
+ * Maximum number of worker threads
+ */
+#define MAX_WORKERS 1024
+
+/**
+ * Default number of seconds an idle connection is kept open
+ */
+#define DEFAULT_IDLE_TIMEOUT 15
+
+/**
+ * Default number of requests served on one connection before it is closed
+ */
+#define DEFAULT_MAX_REQUESTS 100
+
+/**
+ * Default number of seconds a client has to send a complete request head in
+ */
+#define DEFAULT_HEADER_TIMEOUT 10
+
+/**
+ * Maximum number of connections accepted per readiness notification of the listening socket, so a burst of new
+ * clients cannot starve the established ones
+ */
+#define ACCEPT_BATCH 64
+
+/**
+ * Response connections over the connection limit are answered with before they are closed
+ */
+#define SHED_RESPONSE "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nRetry-After: 1\r\nConnection: close\r\n\r\n"
 
 /**
  * Structure that represents all passed arguments
@@ -26,6 +215,21 @@ typedef struct {
     char *port;
     char *doc_root;
     char *index;
+    size_t index_ln;
+    long workers;
+    long idle_timeout; // seconds
+    long header_timeout; // seconds
+    long max_requests; // per connection
+    long cache_bytes; // 0 disables the file cache
+    long max_upload; // bytes, 0 disables uploads
+    int uring; // drive the event loops with io_uring instead of epoll
+    long file_threads; // 0 opens files on the event loops
+    long open_files; // 0 disables the open file cache
+    char *mime_types; // file overriding the built-in MIME types, or NULL
+    char *metrics_path; // request path the metrics are served at, or NULL
+    char *access_log; // file requests are logged to, "-" for stdout, or NULL
+    long max_connections; // over all workers, 0 for no limit
+    http_listen_opts listen; // options of the listening sockets
 } args_t;
 
 /**
@@ -34,13 +238,36 @@ typedef struct {
  * @param binary Represents the name of the binary, should probably be argv[0].
  */
 static void print_usage(char *binary) {
-    fprintf(stderr, "Usage: %s [-p PORT] [-i INDEX] DOC_ROOT\n", binary);
+    fprintf(stderr, "Usage: %s [-p PORT] [-i INDEX] [-w WORKERS] [-t IDLE_TIMEOUT] [-k MAX_REQUESTS] [-c MAX_BYTES] "
+            "[-u MAX_UPLOAD] [-e ENGINE] [-f FILE_THREADS] [-o MAX_OPEN] [-m MIME_TYPES] [-s METRICS_PATH] "
+            "[-l ACCESS_LOG] [-r HEADER_TIMEOUT] [-n MAX_CONNECTIONS] [-b BACKLOG] [-d DEFER_ACCEPT] [-q FASTOPEN] "
+            "DOC_ROOT\n",
+            binary);
+}
+
+/**
+ * @brief Parses a number argument
+ * @details Parses str as decimal number and checks that it lies within min and max.
+ * @param str string to parse
+ * @param min minimum allowed value
+ * @param max maximum allowed value
+ * @param value parsed number will be written here
+ * @return 0 on success, -1 on failure
+ */
+static int parse_number(char *str, long min, long max, long *value) {
+    char *endptr;
+    errno = 0;
+    *value = strtol(str, &endptr, 10);
+    if (errno != 0 || endptr == str || *endptr != '\0' || *value < min || *value > max) {
+        return -1;
+    }
+    return 0;
 }
 
 /**
  * Parse arguments
  * @brief Parses arguments from the command line
- * @details Parses the arguments p,o and d.
+ * @details Parses the arguments p, i, w, t, k, c, u, e, f, o, m, s, l, r, n, b, d and q.
  * @param argc argc which gets passed to main
  * @param argv argv which gets passed to main
  * @param graph initialized args_t struct where the parsed arguments will be stored
@@ -50,11 +277,26 @@ static int parse_args(int argc, char **argv, args_t *args) {
     // Define defaults if they are not set below
     args->index = NULL;
     args->port = "8080";
+    args->workers = -1;
+    args->idle_timeout = -1;
+    args->max_requests = -1;
+    args->cache_bytes = -1;
+    args->max_upload = -1;
+    args->uring = -1;
+    args->file_threads = -1;
+    args->open_files = -1;
+    args->mime_types = NULL;
+    args->metrics_path = NULL;
+    args->access_log = NULL;
+    args->header_timeout = -1;
+    args->max_connections = -1;
+    args->listen = (http_listen_opts) { .reuse_port = 0, .backlog = -1, .defer_accept = -1, .fastopen = -1 };
 
     // Parse all flags and parameters
     int opt;
+    long number;
     char *endptr = NULL;
-    while ((opt = getopt(argc, argv, "p:i:")) != -1) {
+    while ((opt = getopt(argc, argv, "p:i:w:t:k:c:u:e:f:o:m:s:l:r:n:b:d:q:")) != -1) {
         switch (opt) {
             case 'p':
                 if (endptr != NULL)
@@ -71,6 +313,98 @@ static int parse_args(int argc, char **argv, args_t *args) {
                 }
                 args->index = optarg;
                 break;
+            case 'w':
+                if (args->workers != -1 || parse_number(optarg, 1, MAX_WORKERS, &args->workers) == -1) {
+                    return -1;
+                }
+                break;
+            case 't':
+                if (args->idle_timeout != -1 || parse_number(optarg, 1, 86400, &args->idle_timeout) == -1) {
+                    return -1;
+                }
+                break;
+            case 'k':
+                if (args->max_requests != -1 || parse_number(optarg, 1, LONG_MAX, &args->max_requests) == -1) {
+                    return -1;
+                }
+                break;
+            case 'c':
+                if (args->cache_bytes != -1 || parse_number(optarg, 0, LONG_MAX, &args->cache_bytes) == -1) {
+                    return -1;
+                }
+                break;
+            case 'u':
+                if (args->max_upload != -1 || parse_number(optarg, 0, LONG_MAX, &args->max_upload) == -1) {
+                    return -1;
+                }
+                break;
+            case 'e':
+                if (args->uring != -1) {
+                    return -1;
+                } else if (strcmp(optarg, "epoll") == 0) {
+                    args->uring = 0;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    args->uring = 1;
+                } else {
+                    return -1;
+                }
+                break;
+            case 'f':
+                if (args->file_threads != -1 || parse_number(optarg, 0, MAX_WORKERS, &args->file_threads) == -1) {
+                    return -1;
+                }
+                break;
+            case 'o':
+                if (args->open_files != -1 || parse_number(optarg, 0, INT_MAX, &args->open_files) == -1) {
+                    return -1;
+                }
+                break;
+            case 'm':
+                if (args->mime_types != NULL) {
+                    return -1;
+                }
+                args->mime_types = optarg;
+                break;
+            case 's':
+                if (args->metrics_path != NULL || optarg[0] != '/') {
+                    return -1;
+                }
+                args->metrics_path = optarg;
+                break;
+            case 'l':
+                if (args->access_log != NULL) {
+                    return -1;
+                }
+                args->access_log = optarg;
+                break;
+            case 'r':
+                if (args->header_timeout != -1 || parse_number(optarg, 1, 86400, &args->header_timeout) == -1) {
+                    return -1;
+                }
+                break;
+            case 'n':
+                if (args->max_connections != -1 || parse_number(optarg, 0, LONG_MAX, &args->max_connections) == -1) {
+                    return -1;
+                }
+                break;
+            case 'b':
+                if (args->listen.backlog != -1 || parse_number(optarg, 1, INT_MAX, &number) == -1) {
+                    return -1;
+                }
+                args->listen.backlog = (int) number;
+                break;
+            case 'd':
+                if (args->listen.defer_accept != -1 || parse_number(optarg, 0, 86400, &number) == -1) {
+                    return -1;
+                }
+                args->listen.defer_accept = (int) number;
+                break;
+            case 'q':
+                if (args->listen.fastopen != -1 || parse_number(optarg, 0, INT_MAX, &number) == -1) {
+                    return -1;
+                }
+                args->listen.fastopen = (int) number;
+                break;
             default:
                 return -1;
         }
@@ -79,6 +413,60 @@ static int parse_args(int argc, char **argv, args_t *args) {
     if (args->index == NULL) {
         args->index = "index.html";
     }
+    args->index_ln = strlen(args->index);
+
+    if (args->workers == -1) {
+        args->workers = 1;
+    }
+
+    if (args->idle_timeout == -1) {
+        args->idle_timeout = DEFAULT_IDLE_TIMEOUT;
+    }
+
+    if (args->max_requests == -1) {
+        args->max_requests = DEFAULT_MAX_REQUESTS;
+    }
+
+    if (args->header_timeout == -1) {
+        args->header_timeout = DEFAULT_HEADER_TIMEOUT;
+    }
+
+    if (args->max_connections == -1) {
+        args->max_connections = 0;
+    }
+
+    args->listen.reuse_port = args->workers > 1;
+    if (args->listen.backlog == -1) {
+        args->listen.backlog = SOMAXCONN;
+    }
+
+    if (args->listen.defer_accept == -1) {
+        args->listen.defer_accept = 0;
+    }
+
+    if (args->listen.fastopen == -1) {
+        args->listen.fastopen = 0;
+    }
+
+    if (args->cache_bytes == -1) {
+        args->cache_bytes = 0;
+    }
+
+    if (args->max_upload == -1) {
+        args->max_upload = 0;
+    }
+
+    if (args->uring == -1) {
+        args->uring = 0;
+    }
+
+    if (args->file_threads == -1) {
+        args->file_threads = 0;
+    }
+
+    if (args->open_files == -1) {
+        args->open_files = 0;
+    }
 
     if (optind + 1 != argc) {
         return -1;
@@ -88,183 +476,2881 @@ static int parse_args(int argc, char **argv, args_t *args) {
     return 0;
 }
 
-volatile int pending_signal = 0;
+typedef struct conn_s conn_t;
 
 /**
- * @brief Handler for receiving signals
- * @details Sets the global variable pending_signal to received signal code
- * @param signum received signal code
+ * Timeouts a connection can be subject to, each worker keeps a list of connections per timeout
  */
-static void sig_handler(int signum) {
-    pending_signal = signum;
-}
+typedef enum {
+    CONN_TIMER_HEAD, // receiving a request head, which has to be complete HEADER_TIMEOUT seconds after it started
+    CONN_TIMER_IDLE, // any other state, the connection is closed after IDLE_TIMEOUT seconds without activity
+    CONN_TIMER_LN
+} conn_timer;
 
 /**
- * Main entrypoint.
- * @brief Main entry point
- * @details Main entry point. This is where the program will start from.
- * @param argc argc passed to program
- * @param argv argv passed to program
- * @return exit code
+ * Structure that represents a worker thread with its own listening socket and event loop
  */
-int main(int argc, char **argv) {
-    args_t args;
-    if (parse_args(argc, argv, &args) == -1) {
-        print_usage(argv[0]);
-        return EXIT_FAILURE;
-    }
+typedef struct {
+    args_t *args;
+    pthread_t thread;
+    int socket;
+    int epoll; // -1 if the worker uses io_uring
+    uring_t ring; // only valid if epoll is -1
+    int accept_multishot; // whether the kernel supports accepting several connections with one request
+    offload_completions_t completions; // file jobs completed by the offload pool, only valid if it is enabled
+    conn_t *timer_head[CONN_TIMER_LN]; // connection of each timer which started it first
+    conn_t *timer_tail[CONN_TIMER_LN]; // connection of each timer which started it last
+    long timeout[CONN_TIMER_LN]; // milliseconds
+    metrics_t *metrics; // written only by this worker
+    accesslog_ring_t *log; // access log ring of this worker, NULL if requests are not logged
+    conn_t *closing; // connections closed during the current epoll batch, freed once it has been handled
+} worker_t;
 
-    const char *err = NULL;
-    int socket = open_socket(args.port, &err);
-    if (socket == -1) {
-        if (err == NULL) {
-            perror("Failed to open socket");
-        } else {
-            fprintf(stderr, "Failed to open socket: %s\n", err);
-        }
-        return EXIT_FAILURE;
-    }
+/**
+ * Structure that represents a queued response of a connection
+ */
+typedef struct {
+    struct iovec seg[3]; // cached head start, head in the output buffer with an inlined body, cached body
+    size_t ln; // total length of seg
+    size_t sent; // bytes of seg already sent
+    cache_entry_t *entry; // referenced cache entry backing seg, or NULL
+    int body; // file descriptor of a body sent with sendfile, or -1
+    fdcache_entry_t *open; // referenced open file cache entry body belongs to, only valid if body is set
+    off_t body_pos;
+    off_t body_end;
+    int keep_alive; // keep the connection open after this response
+    long code; // status code, 0 for interim responses, which are not recorded in the metrics
+    long started; // microseconds, see now_us, the request was received
+    long first_byte; // microseconds, the first byte was sent, 0 before
+    size_t bytes; // bytes sent so far
+    size_t request_pos; // method and path of the request in the log buffer of the connection
+    size_t request_ln; // 0 if the request is unknown or the access log is disabled
+} conn_res_t;
 
-    struct sigaction sa = { .sa_handler = sig_handler };
+/**
+ * States of an upload, following the framing of the request body
+ */
+typedef enum {
+    UPLOAD_DATA, // receiving data of the body or of the current chunk
+    UPLOAD_CHUNK_SIZE, // expecting the size line of the next chunk
+    UPLOAD_CHUNK_END, // expecting the line break after the data of a chunk
+    UPLOAD_TRAILER, // expecting trailer lines up to the empty line ending the body
+    UPLOAD_DONE
+} upload_state;
 
-    sigaction(SIGINT, &sa, NULL);
-    sigaction(SIGTERM, &sa, NULL);
+/**
+ * Structure that represents a request body which is being stored into a file
+ */
+typedef struct {
+    upload_state state;
+    int chunked;
+    off_t left; // bytes left of the body or of the current chunk
+    off_t received; // bytes of content written so far
+    int fd; // temporary file
+    int dir; // directory below DOC_ROOT both files are in, opened with O_PATH
+    char tmp_name[UPLOAD_TMP_SIZE]; // name of fd in dir, renamed to name once the body is complete
+    char *name; // name of the target file in dir
+    int pipe[2]; // pipe the body is spliced through, -1 if splice is not used
+} upload_t;
 
-    while (pending_signal == 0) {
-        FILE *connection = accept_client_conn(socket);
-        if (connection == NULL) {
-            if (errno != EINTR) {
-                perror("Failed to initiate client connection");
-            }
-            continue;
-        }
+/**
+ * Structure that represents the representation of a file a request is answered with
+ */
+typedef struct {
+    cache_entry_t *entry; // referenced cache entry holding the representation, or NULL
+    int fd; // open file holding the representation if it is not cached, or -1
+    fdcache_entry_t *open; // referenced open file cache entry fd belongs to, or NULL
+    int sibling; // coding of the precompressed sibling fd belongs to, or -1
+    struct stat st; // status of the file the validators are derived from
+    off_t size; // size of the representation
+    const char *encoding; // content coding, NULL for the file itself
+    int compress; // coding fd should be compressed with into the cache, or -1
+} file_t;
 
-        http_req req;
-        int err_code = recv_req(connection, &req);
-        if (err_code == -2 || err_code == -3) {
-            fprintf(stderr, "Received malformed packet\n");
-            clear_http_head(connection);
-            http_res res = { .body = NULL, .header_ln = 0, .status_code = { .code = 400, .description = "Bad Request" } };
-            if (send_res(connection, &res) == -1) {
-                perror("Failed to send response");
-                fclose(connection);
-                continue;
-            }
-            fclose(connection);
-            continue;
-        } else if (err_code != 0) {
-            perror("Error while reading request");
-            fclose(connection);
-            continue;
-        }
+/**
+ * Structure that represents a file which is opened by the offload pool
+ */
+typedef struct {
+    offload_job_t job;
+    conn_t *conn; // connection the file is opened for, NULL once it has been closed
+    char path[PATH_SIZE];
+    const mime_t *mime;
+    compress_coding accepted[COMPRESS_CODING_LN]; // see accepted_codings
+    int accepted_ln;
+    int cacheable; // the representation may be cached as it is
+    int done;
+    int result; // 0 on success, -1 on failure
+    int err_code; // errno of the failure
+    file_t file; // opened representation on success
+    int ring; // the file is opened by requests of the io_uring engine instead of the offload pool
+    int candidate; // with ring, index of the accepted coding whose sibling is opened, accepted_ln for the file itself
+    char open_path[PATH_SIZE]; // with ring, path of the candidate
+    uring_open_how_t how; // with ring, parameters of opening the candidate
+#ifdef URING_OPEN_SUPPORTED
+    struct statx stx; // with ring, status of the opened candidate
+#endif
+} file_job_t;
 
-        if (req.method != HTTP_GET) {
-            http_res res = { .body = NULL, .header_ln = 0, .status_code = { .code = 501, .description = "Not implemented" } };
-            if (send_res(connection, &res) == -1) {
-                perror("Failed to send response");
-                free_http_req(&req);
-                fclose(connection);
-                continue;
-            }
-        }
+/**
+ * @brief Closes a file descriptor which may belong to the open file cache
+ * @param fd file descriptor to close
+ * @param open open file cache entry fd belongs to, or NULL if fd is owned by the caller
+ */
+static void release_fd(int fd, fdcache_entry_t *open) {
+    if (open != NULL) {
+        fdcache_release(open);
+    } else {
+        close(fd);
+    }
+}
 
-        char *path;
-        if (strlen(req.path) == 0) {
-            path = malloc(strlen(args.doc_root) + strlen(args.index) + 2);
-            if (path == NULL) {
-                perror("Failed to allocate memory");
-                free_http_req(&req);
-                fclose(connection);
-                close(socket);
-                return -1;
-            }
-            sprintf(path, "%s/%s", args.doc_root, args.index);
-        } else if (req.path[strlen(req.path) - 1] == '/') {
-            path = malloc(strlen(args.doc_root) + strlen(req.path) + strlen(args.index) + 1);
-            if (path == NULL) {
-                perror("Failed to allocate memory");
-                free_http_req(&req);
-                fclose(connection);
-                close(socket);
-                return -1;
-            }
-            sprintf(path, "%s%s%s", args.doc_root, req.path, args.index);
-        } else {
-            path = malloc(strlen(args.doc_root) + strlen(req.path) + 1);
-            if (path == NULL) {
-                perror("Failed to allocate memory");
-                free_http_req(&req);
-                fclose(connection);
-                close(socket);
-                return -1;
-            }
-            sprintf(path, "%s%s", args.doc_root, req.path);
-        }
+/**
+ * @brief Closes the file descriptor of a file_t
+ * @param file file whose fd is set
+ */
+static void file_close(file_t *file) {
+    release_fd(file->fd, file->open);
+    file->fd = -1;
+    file->open = NULL;
+}
 
-        free_http_req(&req);
+/**
+ * @brief Releases the resources of a file_t
+ * @param file file to release
+ */
+static void file_release(file_t *file) {
+    if (file->entry != NULL) {
+        cache_release(file->entry);
+    }
+    if (file->fd != -1) {
+        file_close(file);
+    }
+}
 
-        FILE *body = fopen(path, "r");
-        if (body == NULL) {
-            if (errno == ENOENT) {
-                http_res res = { .body = NULL, .header_ln = 0, .status_code = { .code = 404, .description = "Not Found" } };
-                if (send_res(connection, &res) == -1) {
-                    perror("Failed to send response");
-                }
-                free(path);
-                fclose(connection);
-                continue;
-            } else if (errno == EACCES) {
-                http_res res = { .body = NULL, .header_ln = 0, .status_code = { .code = 403, .description = "Forbidden" } };
-                if (send_res(connection, &res) == -1) {
-                    perror("Failed to send response");
-                }
-                free(path);
-                fclose(connection);
-                continue;
-            } else {
-                http_res res = { .body = NULL, .header_ln = 0, .status_code = { .code = 500, .description = "Internal Server Error" } };
-                perror("Failed to access file");
-                if (send_res(connection, &res) == -1) {
-                    perror("Failed to send response");
-                }
-                free(path);
-                fclose(connection);
-                continue;
-            }
-        }
+/**
+ * @brief Frees a file job
+ * @param job completed job, its file is released
+ */
+static void file_job_free(file_job_t *job) {
+    if (job->result == 0) {
+        file_release(&job->file);
+    }
+    free(job);
+}
 
-        char *extension = strrchr(path, '.');
-        char *mime = NULL;
+/**
+ * Requests of the io_uring engine a connection can wait for
+ */
+typedef enum {
+    URING_NONE,
+    URING_RECV, // receiving into the input buffer
+    URING_POLL, // waiting for readiness, the connection then proceeds as with epoll
+    URING_SEND, // sending the heads and cached bodies of queued responses
+    URING_OPEN, // opening a candidate of the file job beneath DOC_ROOT
+    URING_STAT // determining the status of the opened candidate of the file job
+} uring_op;
+
+/**
+ * Structure that represents a client connection driven by the event loop
+ */
+struct conn_s {
+    worker_t *worker;
+    int fd;
+    uint32_t events; // events the connection is registered with in epoll
+    uring_op op; // request of the io_uring engine in flight, it references the connection
+    int closed; // the connection is closed and freed once the request in flight completes or the epoll batch ends
+    char in[CONN_BUF_SIZE + 1]; // received data, starting with the next unparsed request head
+    size_t in_ln;
+    http_header arena_buf[MAX_HEADERS]; // backs the arena holding the header array of the current request
+    http_arena arena;
+    int eof; // the client has closed its sending side
+    char out[CONN_OUT_SIZE]; // heads of the queued responses
+    size_t out_ln;
+    conn_res_t queue[PIPELINE_DEPTH]; // queued responses in request order
+    struct iovec send_iov[PIPELINE_DEPTH * 3]; // segments of the send in flight with io_uring
+    struct msghdr send_msg;
+    http_pipe pipe; // pipe bodies are spliced through if sendfile is not supported for them
+    char log[CONN_LOG_SIZE]; // method and path of the requests of the current batch, for the access log
+    size_t log_ln;
+    size_t request_pos; // method and path of the current request in log
+    size_t request_ln; // 0 if the current request is unknown
+    int queue_pos; // first response which was not sent completely yet
+    int queue_ln;
+    int keep_alive; // cleared once a response which closes the connection has been queued
+    int head_only; // the current request is a HEAD request, responses are queued without body
+    long requests; // number of requests received on this connection
+    conn_timer timer; // list the connection is part of, CONN_TIMER_LN if none
+    long last_active; // milliseconds, see now_ms, the timer started
+    long received; // microseconds, see now_us, the connection was accepted or the latest request started to arrive
+    upload_t *upload; // request body being received, or NULL
+    file_job_t *job; // file being opened by the offload pool or the io_uring engine for job_req, or NULL
+    http_req job_req; // request waiting for its file, parsed in place in the input buffer
+    size_t job_end; // end of the head of job_req in the input buffer
+    conn_t *prev; // timer list
+    conn_t *next;
+};
+
+/**
+ * Eventfd which becomes readable once the worker threads should stop
+ */
+static int stop_event = -1;
+
+/**
+ * Tags identifying the non-connection file descriptors in epoll events
+ */
+static int listener_tag, stop_tag;
+
+/**
+ * File cache shared by all workers, NULL if disabled
+ */
+static cache_t *cache = NULL;
+
+/**
+ * Memory limit of the file cache
+ */
+static long cache_bytes = 0;
+
+/**
+ * Directory file descriptor of DOC_ROOT, which is the working directory as well, requested files are opened relative
+ * to it
+ */
+static int root_fd = -1;
+
+/**
+ * Open file cache shared by all workers, NULL if disabled
+ */
+static fdcache_t *fdcache = NULL;
+
+/**
+ * Thread pool opening files which are not cached, NULL if files are opened by the event loops
+ */
+static offload_t *offload = NULL;
+
+/**
+ * Tag identifying the completion queue of file jobs in epoll events and io_uring completions
+ */
+static int jobs_tag;
+
+/**
+ * Number of open connections of all workers, only counted if MAX_CONNECTIONS is set, accessed atomically
+ */
+static long connection_n = 0;
+
+/**
+ * Access log the workers log their requests into, NULL if disabled
+ */
+static accesslog_t *access_log = NULL;
+
+/**
+ * Metrics of all workers, indexed like the workers
+ */
+static metrics_t *metrics = NULL;
+
+/**
+ * Number of entries of metrics
+ */
+static size_t metrics_ln = 0;
+
+/**
+ * @brief Returns a monotonic timestamp
+ * @return milliseconds since an arbitrary point in time
+ */
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Returns a monotonic timestamp with microsecond resolution, for the metrics
+ * @return microseconds since an arbitrary point in time
+ */
+static long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Removes a connection from the timer list of its worker
+ * @param conn connection to remove
+ */
+static void conn_unlink(conn_t *conn) {
+    worker_t *worker = conn->worker;
+    if (conn->timer == CONN_TIMER_LN) {
+        return;
+    }
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        worker->timer_head[conn->timer] = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    } else {
+        worker->timer_tail[conn->timer] = conn->prev;
+    }
+    conn->prev = NULL;
+    conn->next = NULL;
+    conn->timer = CONN_TIMER_LN;
+}
+
+/**
+ * @brief Starts a timer of a connection
+ * @details Moves the connection to the end of the list of timer. All connections of a list share the same timeout,
+ * so appending keeps each list sorted by expiry and neither starting nor expiring a timer costs more than O(1).
+ * @param conn connection to start the timer for
+ * @param timer timer to start
+ */
+static void conn_start_timer(conn_t *conn, conn_timer timer) {
+    worker_t *worker = conn->worker;
+    conn->last_active = now_ms();
+    if (worker->timer_tail[timer] == conn) {
+        return;
+    }
+    conn_unlink(conn);
+    conn->timer = timer;
+    conn->prev = worker->timer_tail[timer];
+    if (worker->timer_tail[timer] != NULL) {
+        worker->timer_tail[timer]->next = conn;
+    } else {
+        worker->timer_head[timer] = conn;
+    }
+    worker->timer_tail[timer] = conn;
+}
+
+/**
+ * @brief Marks a connection as active
+ * @details Restarts the idle timer. A request head in progress keeps its deadline, so a client trickling in a head
+ * byte by byte is closed in time anyway.
+ * @param conn connection to mark
+ */
+static void conn_touch(conn_t *conn) {
+    if (conn->timer != CONN_TIMER_HEAD) {
+        conn_start_timer(conn, CONN_TIMER_IDLE);
+    }
+}
+
+/**
+ * @brief Frees an upload
+ * @param upload upload to free, its temporary file must be closed
+ */
+static void upload_free(upload_t *upload) {
+    if (upload->pipe[0] != -1) {
+        close(upload->pipe[0]);
+        close(upload->pipe[1]);
+    }
+    close(upload->dir);
+    free(upload->name);
+    free(upload);
+}
+
+/**
+ * @brief Cancels an upload
+ * @details Removes the temporary file, the target file stays untouched.
+ * @param upload upload to cancel
+ */
+static void upload_abort(upload_t *upload) {
+    close(upload->fd);
+    unlinkat(upload->dir, upload->tmp_name, 0);
+    upload_free(upload);
+}
+
+/**
+ * @brief Releases the bodies and cache entries of the responses a connection has not sent completely
+ * @param conn connection whose queue is released
+ */
+static void conn_release_queue(conn_t *conn) {
+    for (int i = conn->queue_pos; i < conn->queue_ln; i++) {
+        if (conn->queue[i].body != -1) {
+            release_fd(conn->queue[i].body, conn->queue[i].open);
+        }
+        if (conn->queue[i].entry != NULL) {
+            cache_release(conn->queue[i].entry);
+        }
+    }
+}
+
+/**
+ * @brief Closes a client connection
+ * @details Closes the socket and all queued bodies of a connection, cancels an unfinished upload and frees the
+ * connection. Closing the socket also removes it from epoll. If an io_uring request is in flight, it is cancelled and
+ * the connection is freed on its completion. With epoll, freeing is deferred to the end of the current batch, as later
+ * events of the batch may still reference the connection. A file job in flight is detached from the connection,
+ * unless the io_uring engine opens its file: the request in flight references the job, so it is freed with the
+ * connection. Likewise, the queue stays referenced by a send in flight until its completion.
+ * @param conn connection to close
+ */
+static void conn_close(conn_t *conn) {
+    metrics_add(&conn->worker->metrics->closed, 1);
+    if (conn->worker->args->max_connections > 0) {
+        __atomic_sub_fetch(&connection_n, 1, __ATOMIC_RELAXED);
+    }
+    conn_unlink(conn);
+    if (conn->upload != NULL) {
+        upload_abort(conn->upload);
+    }
+    if (conn->job != NULL && !conn->job->done && !conn->job->ring) {
+        // The job is freed once it has completed
+        conn->job->conn = NULL;
+        conn->job = NULL;
+    } else if (conn->job != NULL && conn->job->done) {
+        file_job_free(conn->job);
+        conn->job = NULL;
+    }
+    if (conn->op != URING_SEND) {
+        conn_release_queue(conn);
+    }
+    http_pipe_close(&conn->pipe);
+    close(conn->fd);
+    if (conn->op != URING_NONE) {
+        conn->closed = 1;
+        uring_cancel(&conn->worker->ring, conn);
+        return;
+    } else if (conn->worker->epoll != -1) {
+        conn->closed = 1;
+        conn->next = conn->worker->closing;
+        conn->worker->closing = conn;
+        return;
+    }
+    free(conn);
+}
+
+/**
+ * @brief Frees the connections closed during an epoll batch
+ * @param worker worker whose batch has been handled
+ */
+static void free_closed(worker_t *worker) {
+    while (worker->closing != NULL) {
+        conn_t *conn = worker->closing;
+        worker->closing = conn->next;
+        free(conn);
+    }
+}
+
+/**
+ * @brief Changes the events a connection waits for
+ * @param conn connection to change
+ * @param events new events
+ * @return 0 on success, -1 on failure
+ */
+static int conn_set_events(conn_t *conn, uint32_t events) {
+    if (conn->events == events) {
+        return 0;
+    }
+    conn->events = events;
+    struct epoll_event ev = { .events = events, .data.ptr = conn };
+    return epoll_ctl(conn->worker->epoll, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+/**
+ * @brief Waits for a connection to become ready
+ * @details With epoll, changes the events the connection is registered with. With io_uring, queues a request which
+ * completes once the connection can proceed: input is received right away into the input buffer, while uploads, which
+ * read the socket themselves, and output wait for readiness.
+ * Starts the header timer while the connection waits for the rest of a request head, or for its first one, and the
+ * idle timer otherwise.
+ * @param conn connection to wait for
+ * @param events EPOLLIN or EPOLLOUT, 0 while the connection waits for a file job
+ * @return 0 on success, -1 on failure
+ */
+static int conn_wait(conn_t *conn, uint32_t events) {
+    worker_t *worker = conn->worker;
+    conn_timer timer = CONN_TIMER_IDLE;
+    if (events == EPOLLIN && conn->upload == NULL && (conn->in_ln > 0 || conn->requests == 0)) {
+        timer = CONN_TIMER_HEAD;
+    }
+    if (conn->timer != timer) {
+        conn_start_timer(conn, timer);
+    }
+
+    if (worker->epoll != -1) {
+        return conn_set_events(conn, events);
+    } else if (events == 0) {
+        return 0;
+    }
+
+    if (events == EPOLLIN && conn->upload == NULL) {
+        if (uring_recv(&worker->ring, conn->fd, &conn->in[conn->in_ln], CONN_BUF_SIZE - conn->in_ln, conn) == -1) {
+            return -1;
+        }
+        conn->op = URING_RECV;
+        return 0;
+    }
+
+    if (uring_poll(&worker->ring, conn->fd, events == EPOLLIN ? POLLIN : POLLOUT, conn) == -1) {
+        return -1;
+    }
+    conn->op = URING_POLL;
+    return 0;
+}
+
+/**
+ * @brief Initializes the members of a queued response which are recorded once it has been sent
+ * @param conn connection the response is queued on
+ * @param queued queued response
+ * @param code status code of the response, 0 for interim responses
+ */
+static void conn_res_stamp(conn_t *conn, conn_res_t *queued, long code) {
+    queued->code = code;
+    queued->started = conn->received;
+    queued->first_byte = 0;
+    queued->bytes = 0;
+    queued->request_pos = conn->request_pos;
+    queued->request_ln = conn->request_ln;
+}
+
+/**
+ * @brief Queues a response on a connection
+ * @details Formats the head of res into the output buffer of the connection and appends it to the response queue.
+ * The connection takes ownership of body. Small bodies are copied behind the head right away.
+ * Whether the connection is kept open afterwards is taken from the connection, not from res. In response to HEAD,
+ * the body is left out while Content-Length still announces it.
+ * @param conn connection to respond on, must have at least CONN_HEAD_SIZE bytes left in its output buffer
+ * @param res response to send, its body member is ignored
+ * @param body file descriptor of the body to send, or -1
+ * @param open open file cache entry body belongs to, or NULL
+ * @param offset offset of the first byte of body to send
+ * @param length number of bytes of body to send, 0 without body, or -1 to leave out Content-Length
+ * @return 0 on success, -1 on failure
+ */
+static int conn_respond(conn_t *conn, http_res *res, int body, fdcache_entry_t *open, off_t offset, long length) {
+    conn_res_t *queued = &conn->queue[conn->queue_ln];
+    queued->entry = NULL;
+    queued->body = -1;
+    queued->keep_alive = conn->keep_alive;
+    conn_res_stamp(conn, queued, res->status_code.code);
+
+    res->keep_alive = conn->keep_alive;
+    int head_ln = format_res_head(&conn->out[conn->out_ln], CONN_HEAD_SIZE, res, length);
+    if (body != -1 && (conn->head_only || head_ln < 0 || head_ln >= CONN_HEAD_SIZE)) {
+        release_fd(body, open);
+        body = -1;
+    }
+    if (head_ln < 0 || head_ln >= CONN_HEAD_SIZE) {
+        return -1;
+    }
+
+    if (body != -1 && length <= CONN_INLINE_BODY && conn->out_ln + head_ln + length <= CONN_OUT_SIZE) {
+        ssize_t read_ln = pread(body, &conn->out[conn->out_ln + head_ln], length, offset);
+        if (read_ln == length) {
+            head_ln += length;
+            release_fd(body, open);
+            body = -1;
+        }
+    }
+
+    queued->seg[0] = (struct iovec) { .iov_base = NULL, .iov_len = 0 };
+    queued->seg[1] = (struct iovec) { .iov_base = &conn->out[conn->out_ln], .iov_len = head_ln };
+    queued->seg[2] = (struct iovec) { .iov_base = NULL, .iov_len = 0 };
+    queued->ln = head_ln;
+    queued->sent = 0;
+    queued->body = body;
+    queued->open = open;
+    queued->body_pos = offset;
+    queued->body_end = offset + length;
+    conn->out_ln += head_ln;
+    conn->queue_ln++;
+    return 0;
+}
+
+/**
+ * @brief Queues a response with a part of a cached file as body
+ * @details Formats the head of res into the output buffer, the body is sent from the cache entry. The connection takes
+ * ownership of the reference to entry.
+ * @param conn connection to respond on, must have at least CONN_HEAD_SIZE bytes left in its output buffer
+ * @param res response to send, its body member is ignored
+ * @param entry referenced cache entry holding the body
+ * @param offset offset of the first byte to send
+ * @param length number of bytes to send
+ * @return 0 on success, -1 on failure
+ */
+static int conn_respond_slice(conn_t *conn, http_res *res, cache_entry_t *entry, off_t offset, long length) {
+    res->keep_alive = conn->keep_alive;
+    int head_ln = format_res_head(&conn->out[conn->out_ln], CONN_HEAD_SIZE, res, length);
+    if (head_ln < 0 || head_ln >= CONN_HEAD_SIZE) {
+        cache_release(entry);
+        return -1;
+    }
+
+    conn_res_t *queued = &conn->queue[conn->queue_ln];
+    queued->seg[0] = (struct iovec) { .iov_base = NULL, .iov_len = 0 };
+    queued->seg[1] = (struct iovec) { .iov_base = &conn->out[conn->out_ln], .iov_len = head_ln };
+    queued->seg[2] = (struct iovec) { .iov_base = &entry->data[offset], .iov_len = conn->head_only ? 0 : length };
+    queued->ln = head_ln + queued->seg[2].iov_len;
+    queued->sent = 0;
+    queued->entry = entry;
+    queued->body = -1;
+    queued->body_pos = 0;
+    queued->body_end = 0;
+    queued->keep_alive = conn->keep_alive;
+    conn_res_stamp(conn, queued, res->status_code.code);
+    conn->out_ln += head_ln;
+    conn->queue_ln++;
+    return 0;
+}
+
+/**
+ * @brief Queues a cached response on a connection
+ * @details Only Date and Connection are formatted into the output buffer, the rest of the response is sent from the
+ * cache entry. The connection takes ownership of the reference to entry.
+ * @param conn connection to respond on, must have at least CONN_HEAD_SIZE bytes left in its output buffer
+ * @param entry referenced cache entry to send
+ * @return 0 on success, -1 on failure
+ */
+static int conn_respond_cached(conn_t *conn, cache_entry_t *entry) {
+    int end_ln = format_res_head_end(&conn->out[conn->out_ln], CONN_HEAD_SIZE, conn->keep_alive);
+    if (end_ln < 0 || end_ln >= CONN_HEAD_SIZE) {
+        cache_release(entry);
+        return -1;
+    }
+
+    conn_res_t *queued = &conn->queue[conn->queue_ln];
+    queued->seg[0] = (struct iovec) { .iov_base = entry->head, .iov_len = entry->head_ln };
+    queued->seg[1] = (struct iovec) { .iov_base = &conn->out[conn->out_ln], .iov_len = end_ln };
+    queued->seg[2] = (struct iovec) { .iov_base = entry->data, .iov_len = conn->head_only ? 0 : entry->size };
+    queued->ln = entry->head_ln + end_ln + queued->seg[2].iov_len;
+    queued->sent = 0;
+    queued->entry = entry;
+    queued->body = -1;
+    queued->body_pos = 0;
+    queued->body_end = 0;
+    queued->keep_alive = conn->keep_alive;
+    conn_res_stamp(conn, queued, 200); // heads are only cached for complete files
+    conn->out_ln += end_ln;
+    conn->queue_ln++;
+    return 0;
+}
+
+/**
+ * @brief Queues a fixed response on a connection
+ * @details Used for interim responses like 100 Continue, which carry neither Date nor Connection.
+ * @param conn connection to respond on, must have at least CONN_HEAD_SIZE bytes left in its output buffer
+ * @param data complete response
+ * @return 0 on success, -1 on failure
+ */
+static int conn_respond_raw(conn_t *conn, const char *data) {
+    size_t ln = strlen(data);
+    if (ln >= CONN_HEAD_SIZE) {
+        return -1;
+    }
+    memcpy(&conn->out[conn->out_ln], data, ln);
+
+    conn_res_t *queued = &conn->queue[conn->queue_ln];
+    queued->seg[0] = (struct iovec) { .iov_base = NULL, .iov_len = 0 };
+    queued->seg[1] = (struct iovec) { .iov_base = &conn->out[conn->out_ln], .iov_len = ln };
+    queued->seg[2] = (struct iovec) { .iov_base = NULL, .iov_len = 0 };
+    queued->ln = ln;
+    queued->sent = 0;
+    queued->entry = NULL;
+    queued->body = -1;
+    queued->body_pos = 0;
+    queued->body_end = 0;
+    queued->keep_alive = 1;
+    conn_res_stamp(conn, queued, 0);
+    conn->out_ln += ln;
+    conn->queue_ln++;
+    return 0;
+}
+
+/**
+ * @brief Responds with a status code only
+ * @details Queues a response without headers and body on a connection.
+ * @param conn connection to respond on
+ * @param code HTTP status code
+ * @param description HTTP status description
+ * @return 0 on success, -1 on failure
+ */
+static int conn_respond_status(conn_t *conn, long code, char *description) {
+    http_res res = { .body = NULL, .header_ln = 0, .status_code = { .code = code, .description = description } };
+    return conn_respond(conn, &res, -1, NULL, 0, 0);
+}
+
+/**
+ * @brief Formats the entity tag of a file
+ * @details The tag is derived from inode, size and modification time, so it changes whenever the file is replaced or
+ * modified, without reading the file.
+ * Compressed variants get their content coding appended, as they are different representations.
+ * @param buf buffer of at least ETAG_SIZE bytes
+ * @param st status of the file
+ * @param encoding content coding of the representation, or NULL
+ */
+static void format_etag(char *buf, const struct stat *st, const char *encoding) {
+    snprintf(buf, ETAG_SIZE, "\"%llx-%llx-%llx.%lx%s%s\"", (unsigned long long) st->st_ino,
+             (unsigned long long) st->st_size, (unsigned long long) st->st_mtim.tv_sec, (long) st->st_mtim.tv_nsec,
+             encoding != NULL ? "-" : "", encoding != NULL ? encoding : "");
+}
+
+/**
+ * @brief Evaluates the conditional headers of a request
+ * @details If-None-Match is checked against the entity tag of the file. Only if it is missing, If-Modified-Since is
+ * compared with the modification time. Invalid dates are ignored.
+ * @param req parsed request
+ * @param st status of the requested file
+ * @param etag entity tag of the representation, see format_etag
+ * @return 1 if the cached copy of the client is still valid, 0 otherwise
+ */
+static int is_not_modified(http_req *req, const struct stat *st, const char *etag) {
+    http_header *if_none_match = req->known_header[HTTP_HEADER_IF_NONE_MATCH];
+    if (if_none_match != NULL) {
+        return match_etag(if_none_match->value, etag);
+    }
+
+    http_header *if_modified_since = req->known_header[HTTP_HEADER_IF_MODIFIED_SINCE];
+    time_t since;
+    if (if_modified_since != NULL && parse_http_date(if_modified_since->value, &since) == 0) {
+        return st->st_mtime <= since;
+    }
+    return 0;
+}
+
+/**
+ * @brief Determines the range of a file requested
+ * @details Evaluates Range, unless If-Range names a different version of the file. If-Range is compared with the
+ * entity tag or with the modification time of the file.
+ * @param req parsed request
+ * @param st status of the requested file
+ * @param etag entity tag of the representation, see format_etag
+ * @param size size of the representation
+ * @param start first byte of the range will be written here
+ * @param end byte after the range will be written here
+ * @return 0 if a range should be sent, -1 if the complete file should be sent, -2 if the range is not satisfiable
+ */
+static int get_range(http_req *req, const struct stat *st, const char *etag, off_t size, off_t *start, off_t *end) {
+    http_header *range = req->known_header[HTTP_HEADER_RANGE];
+    if (range == NULL) {
+        return -1;
+    }
+
+    http_header *if_range = req->known_header[HTTP_HEADER_IF_RANGE];
+    if (if_range != NULL) {
+        time_t date;
+        if (if_range->value[0] == '"') {
+            // Entity tags are compared strongly
+            if (strcmp(if_range->value, etag) != 0) {
+                return -1;
+            }
+        } else if (parse_http_date(if_range->value, &date) == -1 || date != st->st_mtime) {
+            return -1;
+        }
+    }
+
+    return parse_range(range->value, size, start, end);
+}
+
+/**
+ * @brief Checks whether a requested path stays inside DOC_ROOT
+ * @param path requested path
+ * @return 1 if path contains no ".." segment, 0 otherwise
+ */
+static int is_safe_path(const char *path) {
+    for (const char *dots = strstr(path, ".."); dots != NULL; dots = strstr(dots + 2, "..")) {
+        if ((dots == path || dots[-1] == '/') && (dots[2] == '\0' || dots[2] == '/')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Builds the path of the requested file
+ * @details Makes the requested path relative to DOC_ROOT and appends the index file for directory requests. The path
+ * is written to a buffer of the caller, so nothing is allocated.
+ * @param args parsed arguments
+ * @param req_path requested path
+ * @param path buffer of PATH_SIZE bytes the path will be written to
+ * @return 0 on success, -1 on failure with errno set to EACCES if req_path leaves DOC_ROOT or ENAMETOOLONG
+ */
+static int build_path(args_t *args, const char *req_path, char *path) {
+    if (!is_safe_path(req_path)) {
+        errno = EACCES;
+        return -1;
+    }
+
+    while (*req_path == '/') {
+        req_path++;
+    }
+    size_t ln = strlen(req_path);
+    int directory = ln == 0 || req_path[ln - 1] == '/';
+    size_t index_ln = directory ? args->index_ln : 0;
+    if (ln + index_ln >= PATH_SIZE) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    memcpy(path, req_path, ln);
+    if (directory) {
+        memcpy(&path[ln], args->index, index_ln);
+    }
+    path[ln + index_ln] = '\0';
+    return 0;
+}
+
+/**
+ * @brief Responds with 416 Range Not Satisfiable
+ * @param conn connection to respond on
+ * @param size size of the representation
+ * @return 0 on success, -1 on failure
+ */
+static int conn_respond_unsatisfiable(conn_t *conn, off_t size) {
+    char content_range[CONTENT_RANGE_SIZE];
+    snprintf(content_range, sizeof(content_range), "bytes */%llu", (unsigned long long) size);
+    http_header header = { .key = "Content-Range", .value = content_range };
+    http_res res = {
+        .body = NULL,
+        .header_ln = 1,
+        .status_code = { .code = 416, .description = "Range Not Satisfiable" },
+        .header = &header
+    };
+    return conn_respond(conn, &res, -1, NULL, 0, 0);
+}
+
+/**
+ * @brief Loads a compressed variant into the cache, see cache_load_fn
+ * @param arg pointer to the compress_coding to apply
+ */
+static int compress_load(int fd, size_t size, void *arg, char **data, size_t *data_ln) {
+    return compress_file(fd, size, *(compress_coding *) arg, data, data_ln);
+}
+
+/**
+ * @brief Determines the content codings a file may be sent with
+ * @param req parsed request
+ * @param compressible whether the file should be compressed
+ * @param accepted codings accepted by the client will be written here, sorted by the quality the client assigns
+ * @return number of accepted codings
+ */
+static int accepted_codings(http_req *req, int compressible, compress_coding *accepted) {
+    int quality[COMPRESS_CODING_LN];
+    int accepted_ln = 0;
+    http_header *accept_encoding = req->known_header[HTTP_HEADER_ACCEPT_ENCODING];
+    for (int i = 0; compressible && accept_encoding != NULL && i < COMPRESS_CODING_LN; i++) {
+        int q = accept_quality(accept_encoding->value, compress_name(i));
+        if (q > 0) {
+            int j = accepted_ln++;
+            for (; j > 0 && quality[j - 1] < q; j--) {
+                accepted[j] = accepted[j - 1];
+                quality[j] = quality[j - 1];
+            }
+            accepted[j] = i;
+            quality[j] = q;
+        }
+    }
+    return accepted_ln;
+}
+
+/**
+ * @brief Determines whether a file is compressed on the fly into the cache
+ * @param size size of the file
+ * @return 1 if a file of this size is compressed once the client accepts a coding, 0 otherwise
+ */
+static int compressed_on_the_fly(off_t size) {
+    return cache != NULL && size >= COMPRESS_MIN_SIZE && size <= COMPRESS_MAX_SIZE && size <= cache_bytes / 4;
+}
+
+/**
+ * @brief Looks up the representation of a file in the caches
+ * @details Content codings accepted by the client are preferred for compressible files. Files which would be
+ * compressed are not served from the cache as they are. Files sent as they are may be found in the open file cache
+ * as well. Does not access the file system.
+ * @param path path of the requested file
+ * @param accepted codings accepted by the client, see accepted_codings
+ * @param accepted_ln number of accepted codings
+ * @param file will be filled with the cached representation
+ * @return 1 if the representation is cached, 0 otherwise
+ */
+static int lookup_file(char *path, compress_coding *accepted, int accepted_ln, file_t *file) {
+    *file = (file_t) { .entry = NULL, .fd = -1, .open = NULL, .sibling = -1, .encoding = NULL, .compress = -1 };
+
+    for (int i = 0; cache != NULL && i < accepted_ln; i++) {
+        file->entry = cache_get(cache, path, compress_name(accepted[i]));
+        if (file->entry != NULL) {
+            file->encoding = compress_name(accepted[i]);
+            break;
+        }
+    }
+
+    // Files which will not be compressed are served from the cache as they are
+    if (file->entry == NULL && cache != NULL) {
+        file->entry = cache_get(cache, path, NULL);
+        if (file->entry != NULL && accepted_ln > 0 && compressed_on_the_fly(file->entry->size)) {
+            cache_release(file->entry);
+            file->entry = NULL;
+        }
+    }
+
+    if (file->entry != NULL) {
+        file->st = file->entry->st;
+        file->size = file->entry->size;
+        return 1;
+    }
+
+    // Without codings to probe for, open_file would open the file itself, which may be open already. Files which fit
+    // into the content cache are left to open_file, so they still get cached.
+    if (fdcache != NULL && accepted_ln == 0) {
+        file->open = fdcache_get(fdcache, path);
+        if (file->open != NULL && cache != NULL && file->open->st.st_size <= cache_bytes / 4) {
+            fdcache_release(file->open);
+            file->open = NULL;
+        }
+        if (file->open != NULL) {
+            file->fd = file->open->fd;
+            file->st = file->open->st;
+            file->size = file->st.st_size;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Opens a path below DOC_ROOT
+ * @details Uses openat2 with RESOLVE_BENEATH if the kernel supports it, so symbolic links cannot lead out of DOC_ROOT
+ * either. Otherwise the path is resolved with openat, build_path has rejected ".." segments already.
+ * @param path path relative to DOC_ROOT
+ * @param flags flags to open path with, without O_CREAT
+ * @return file descriptor, -1 on failure with errno set, EXDEV if path escapes DOC_ROOT
+ */
+static int openat_beneath(const char *path, int flags) {
+#ifdef OPENAT2_SUPPORTED
+    static int unsupported = 0;
+    if (!__atomic_load_n(&unsupported, __ATOMIC_RELAXED)) {
+        struct open_how how = { .flags = flags, .resolve = RESOLVE_BENEATH };
+        int fd = (int) syscall(SYS_openat2, root_fd, path, &how, sizeof(how));
+        if (fd != -1 || errno != ENOSYS) {
+            return fd;
+        }
+        __atomic_store_n(&unsupported, 1, __ATOMIC_RELAXED);
+    }
+#endif
+    return openat(root_fd, path, flags);
+}
+
+/**
+ * @brief Opens a file below DOC_ROOT read-only
+ * @see openat_beneath
+ * @param path path relative to DOC_ROOT
+ * @return file descriptor, -1 on failure with errno set, EXDEV if path escapes DOC_ROOT
+ */
+static int open_beneath(const char *path) {
+    return openat_beneath(path, O_RDONLY);
+}
+
+/**
+ * @brief Formats the path of a precompressed sibling
+ * @param sibling buffer of PATH_SIZE bytes the path will be written to
+ * @param path path of the requested file
+ * @param coding coding of the sibling
+ * @return 0 on success, -1 if the path does not fit
+ */
+static int format_sibling(char *sibling, const char *path, compress_coding coding) {
+    int ln = snprintf(sibling, PATH_SIZE, "%s%s", path, compress_extension(coding));
+    return ln < 0 || ln >= PATH_SIZE ? -1 : 0;
+}
+
+/**
+ * @brief Opens a file and determines its status
+ * @details Goes through the open file cache if it is enabled.
+ * @param path path of the file
+ * @param file fd, open and st will be set on success
+ * @return 0 on success, -1 on failure with errno set
+ */
+static int open_path(char *path, file_t *file) {
+    if (fdcache != NULL) {
+        file->open = fdcache_open(fdcache, path);
+        if (file->open == NULL) {
+            return -1;
+        }
+        file->fd = file->open->fd;
+        file->st = file->open->st;
+        return 0;
+    }
+
+    file->fd = open_beneath(path);
+    if (file->fd == -1) {
+        return -1;
+    }
+    if (fstat(file->fd, &file->st) == -1) {
+        int err_code = errno;
+        close(file->fd);
+        file->fd = -1;
+        errno = err_code;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Decides whether an opened file is compressed into the cache
+ * @details Files are compressed with the preferred accepted coding if they are large enough to benefit, small enough
+ * to be compressed quickly and fit into the cache, see compressed_on_the_fly.
+ * @param file opened file itself, compress and encoding are set if it will be compressed
+ * @param accepted codings accepted by the client, see accepted_codings
+ * @param accepted_ln number of accepted codings
+ */
+static void choose_compression(file_t *file, compress_coding *accepted, int accepted_ln) {
+    if (accepted_ln > 0 && S_ISREG(file->st.st_mode) && compressed_on_the_fly(file->size)) {
+        file->compress = accepted[0];
+        file->encoding = compress_name(accepted[0]);
+    }
+}
+
+/**
+ * @brief Opens the representation of a file which is not cached
+ * @details Accepted content codings are served from a precompressed sibling file with .br or .gz extension, or
+ * compressed on the fly later. Otherwise the file itself is opened.
+ * @param path path of the requested file
+ * @param accepted codings accepted by the client, see accepted_codings
+ * @param accepted_ln number of accepted codings
+ * @param file will be filled with the opened representation
+ * @return 0 on success, -1 on failure with errno set
+ */
+static int open_file(char *path, compress_coding *accepted, int accepted_ln, file_t *file) {
+    *file = (file_t) { .entry = NULL, .fd = -1, .open = NULL, .sibling = -1, .encoding = NULL, .compress = -1 };
+
+    for (int i = 0; i < accepted_ln; i++) {
+        char sibling[PATH_SIZE];
+        if (format_sibling(sibling, path, accepted[i]) == 0 && open_path(sibling, file) == 0) {
+            if (S_ISREG(file->st.st_mode)) {
+                file->size = file->st.st_size;
+                file->sibling = accepted[i];
+                file->encoding = compress_name(accepted[i]);
+                return 0;
+            }
+            file_close(file);
+        }
+    }
+
+    if (open_path(path, file) == -1) {
+        return -1;
+    }
+    file->size = file->st.st_size;
+    choose_compression(file, accepted, accepted_ln);
+    return 0;
+}
+
+/**
+ * @brief Builds the headers of a file response
+ * @details The validators come first, so the headers of a 304 response are a prefix of the headers of a 200 response.
+ * Content-Range is not included.
+ * @param file opened representation
+ * @param mime MIME type of the file, or NULL
+ * @param header array of at least 6 headers which will be filled
+ * @param etag buffer of ETAG_SIZE bytes backing the ETag
+ * @param last_modified buffer of HTTP_DATE_SIZE bytes backing Last-Modified
+ * @param validator_ln number of headers which belong into a 304 response will be written here
+ * @return number of headers
+ */
+static size_t build_file_headers(file_t *file, const mime_t *mime, http_header *header, char *etag, char *last_modified,
+                                 size_t *validator_ln) {
+    size_t header_ln = 0;
+    format_etag(etag, &file->st, file->encoding);
+    header[header_ln++] = (http_header) { .key = "ETag", .value = etag };
+    if (format_http_date(last_modified, file->st.st_mtime) == 0) {
+        header[header_ln++] = (http_header) { .key = "Last-Modified", .value = last_modified };
+    }
+    if (mime != NULL && mime->compressible) {
+        // Compressible files vary by Accept-Encoding, even if they are sent as they are
+        header[header_ln++] = (http_header) { .key = "Vary", .value = "Accept-Encoding" };
+    }
+    *validator_ln = header_ln;
+
+    if (mime != NULL) {
+        header[header_ln++] = (http_header) { .key = "Content-Type", .value = (char *) mime->type };
+    }
+    if (file->encoding != NULL) {
+        header[header_ln++] = (http_header) { .key = "Content-Encoding", .value = (char *) file->encoding };
+    }
+    header[header_ln++] = (http_header) { .key = "Accept-Ranges", .value = "bytes" };
+    return header_ln;
+}
+
+/**
+ * @brief Loads an opened representation into the cache
+ * @details Files open_file decided to compress are compressed into the cache once, later requests are served from the
+ * cached variant. If that fails, the file is sent as it is. Representations sent as they are are cached if cacheable
+ * is set. Reads the whole file, so it may block.
+ * @param file opened representation, fd is closed if it has been cached
+ * @param path path of the requested file
+ * @param mime MIME type of the file, or NULL
+ * @param cacheable whether the representation may be cached as it is
+ */
+static void load_file(file_t *file, char *path, const mime_t *mime, int cacheable) {
+    http_header header[7];
+    char etag[ETAG_SIZE];
+    char last_modified[HTTP_DATE_SIZE];
+    size_t validator_ln;
+    http_res res = {
+        .body = NULL,
+        .status_code = { .code = 200, .description = "OK" },
+        .header = header
+    };
+
+    if (file->compress != -1) {
+        compress_coding coding = file->compress;
+        res.header_ln = build_file_headers(file, mime, header, etag, last_modified, &validator_ln);
+        file->entry = cache_put(cache, path, file->encoding, path, file->fd, &file->st, &res, compress_load, &coding);
+        file->compress = -1;
+        if (file->entry != NULL) {
+            file_close(file);
+            file->size = file->entry->size;
+            return;
+        }
+        file->encoding = NULL;
+    }
+
+    char sibling[PATH_SIZE];
+    if (cacheable && cache != NULL && (file->sibling == -1 || format_sibling(sibling, path, file->sibling) == 0)) {
+        res.header_ln = build_file_headers(file, mime, header, etag, last_modified, &validator_ln);
+        file->entry = cache_put(cache, path, file->encoding, file->sibling != -1 ? sibling : path, file->fd,
+                                &file->st, &res, NULL, NULL);
+        if (file->entry != NULL) {
+            file_close(file);
+        }
+    }
+}
+
+/**
+ * @brief Opens and loads the representation of a file which is not cached
+ * @see open_file
+ * @see load_file
+ * @return 0 on success, -1 on failure with errno set
+ */
+static int resolve_file(char *path, const mime_t *mime, compress_coding *accepted, int accepted_ln, int cacheable,
+                        file_t *file) {
+    if (open_file(path, accepted, accepted_ln, file) == -1) {
+        return -1;
+    }
+    load_file(file, path, mime, cacheable);
+    return 0;
+}
+
+/**
+ * @brief Runs a file job on a thread of the offload pool, see offload_job_t
+ */
+static void file_job_run(offload_job_t *job) {
+    file_job_t *file_job = (file_job_t *) job;
+    file_job->result = resolve_file(file_job->path, file_job->mime, file_job->accepted, file_job->accepted_ln,
+                                    file_job->cacheable, &file_job->file);
+    file_job->err_code = errno;
+}
+
+/**
+ * @brief Creates a file job for the request of a connection
+ * @param conn connection the request was received on
+ * @param path path of the requested file, copied into the job
+ * @param mime MIME type of the file, or NULL
+ * @param accepted codings accepted by the client, see accepted_codings
+ * @param accepted_ln number of accepted codings
+ * @param cacheable whether the representation may be cached as it is
+ * @return job which is not done yet, NULL on failure
+ */
+static file_job_t *file_job_create(conn_t *conn, char *path, const mime_t *mime, compress_coding *accepted,
+                                   int accepted_ln, int cacheable) {
+    file_job_t *job = malloc(sizeof(file_job_t));
+    if (job == NULL) {
+        return NULL;
+    }
+    job->conn = conn;
+    memcpy(job->path, path, strlen(path) + 1);
+    job->mime = mime;
+    memcpy(job->accepted, accepted, accepted_ln * sizeof(compress_coding));
+    job->accepted_ln = accepted_ln;
+    job->cacheable = cacheable;
+    job->done = 0;
+    job->ring = 0;
+    job->file = (file_t) { .entry = NULL, .fd = -1, .open = NULL, .sibling = -1, .encoding = NULL, .compress = -1 };
+    return job;
+}
+
+/**
+ * @brief Opens the file of a request with the offload pool
+ * @details The connection stops parsing until the job has completed, then conn_parse handles the request again with
+ * the opened file.
+ * @param conn connection the request was received on
+ * @param path path of the requested file, copied into the job
+ * @param mime MIME type of the file, or NULL
+ * @param accepted codings accepted by the client, see accepted_codings
+ * @param accepted_ln number of accepted codings
+ * @param cacheable whether the representation may be cached as it is
+ * @return 0 on success, -1 if the job could not be queued
+ */
+static int conn_offload(conn_t *conn, char *path, const mime_t *mime, compress_coding *accepted, int accepted_ln,
+                        int cacheable) {
+    file_job_t *job = file_job_create(conn, path, mime, accepted, accepted_ln, cacheable);
+    if (job == NULL) {
+        return -1;
+    }
+    job->job.run = file_job_run;
+    job->job.completions = &conn->worker->completions;
+    if (offload_submit(offload, &job->job) == -1) {
+        free(job);
+        return -1;
+    }
+    conn->job = job;
+    return 0;
+}
+
+#ifdef URING_OPEN_SUPPORTED
+/**
+ * @brief Queues opening the next candidate of a file job opened by the io_uring engine
+ * @details Candidates are tried in the order of open_file: the precompressed siblings of the accepted codings, then
+ * the file itself. The path is resolved with RESOLVE_BENEATH like open_beneath.
+ * @param conn connection the job belongs to
+ * @param job job whose candidate is opened, candidates whose path does not fit are skipped
+ * @return 0 on success, -1 on failure
+ */
+static int uring_open_candidate(conn_t *conn, file_job_t *job) {
+    while (job->candidate < job->accepted_ln &&
+           format_sibling(job->open_path, job->path, job->accepted[job->candidate]) == -1) {
+        job->candidate++;
+    }
+    if (job->candidate == job->accepted_ln) {
+        memcpy(job->open_path, job->path, strlen(job->path) + 1);
+    }
+
+    job->how = (uring_open_how_t) { .flags = O_RDONLY, .mode = 0, .resolve = RESOLVE_BENEATH };
+    if (uring_openat2(&conn->worker->ring, root_fd, job->open_path, &job->how, conn) == -1) {
+        return -1;
+    }
+    conn->op = URING_OPEN;
+    return 0;
+}
+
+/**
+ * @brief Converts the result of statx
+ * @param st status to fill
+ * @param stx result of statx with STATX_BASIC_STATS
+ */
+static void stat_from_statx(struct stat *st, const struct statx *stx) {
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    st->st_ino = stx->stx_ino;
+    st->st_mode = stx->stx_mode;
+    st->st_nlink = stx->stx_nlink;
+    st->st_uid = stx->stx_uid;
+    st->st_gid = stx->stx_gid;
+    st->st_size = (off_t) stx->stx_size;
+    st->st_blksize = stx->stx_blksize;
+    st->st_blocks = (blkcnt_t) stx->stx_blocks;
+    st->st_atim = (struct timespec) { .tv_sec = stx->stx_atime.tv_sec, .tv_nsec = stx->stx_atime.tv_nsec };
+    st->st_mtim = (struct timespec) { .tv_sec = stx->stx_mtime.tv_sec, .tv_nsec = stx->stx_mtime.tv_nsec };
+    st->st_ctim = (struct timespec) { .tv_sec = stx->stx_ctime.tv_sec, .tv_nsec = stx->stx_ctime.tv_nsec };
+}
+
+/**
+ * @brief Opens the file of a request with requests of the io_uring engine
+ * @details The file is opened with openat2 and its status determined with statx through the ring, so the worker does
+ * not block on path resolution. Like with conn_offload, the connection stops parsing until the file has been opened.
+ * Uncached files are loaded into the cache synchronously afterwards, see load_file.
+ * @param conn connection the request was received on
+ * @param path path of the requested file, copied into the job
+ * @param mime MIME type of the file, or NULL
+ * @param accepted codings accepted by the client, see accepted_codings
+ * @param accepted_ln number of accepted codings
+ * @param cacheable whether the representation may be cached as it is
+ * @return 0 on success, -1 if the open could not be queued
+ */
+static int conn_open_uring(conn_t *conn, char *path, const mime_t *mime, compress_coding *accepted, int accepted_ln,
+                           int cacheable) {
+    file_job_t *job = file_job_create(conn, path, mime, accepted, accepted_ln, cacheable);
+    if (job == NULL) {
+        return -1;
+    }
+    job->ring = 1;
+    job->candidate = 0;
+    if (uring_open_candidate(conn, job) == -1) {
+        free(job);
+        return -1;
+    }
+    conn->job = job;
+    return 0;
+}
+#endif
+
+/**
+ * @brief Receives data on a connection
+ * @details Reads everything available on the socket until the input buffer is full.
+ * @param conn connection to read from
+ * @return 0 on success, -1 on failure
+ */
+static int conn_recv(conn_t *conn) {
+    while (!conn->eof && conn->in_ln < CONN_BUF_SIZE) {
+        ssize_t read_ln = recv(conn->fd, &conn->in[conn->in_ln], CONN_BUF_SIZE - conn->in_ln, 0);
+        if (read_ln == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            perror("Error while reading request");
+            return -1;
+        } else if (read_ln == 0) {
+            conn->eof = 1;
+        } else if (conn->in_ln == 0 && conn->requests > 0) {
+            // The start of the next request on a reused connection
+            conn->received = now_us();
+        }
+        conn->in_ln += read_ln;
+    }
+    return 0;
+}
+
+/**
+ * @brief Creates the temporary file of an upload
+ * @details Tries unused names until one can be created exclusively, so neither an existing file nor a symbolic link
+ * in its place is followed.
+ * @param dir directory to create the file in
+ * @param name buffer of UPLOAD_TMP_SIZE bytes the name of the file will be written to
+ * @return file descriptor opened for writing, -1 on failure
+ */
+static int create_upload_file(int dir, char *name) {
+    static unsigned long counter = 0;
+    for (int i = 0; i < UPLOAD_TMP_ATTEMPTS; i++) {
+        unsigned long n = __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+        snprintf(name, UPLOAD_TMP_SIZE, ".upload-%lx-%lx", (unsigned long) getpid(), n ^ (unsigned long) now_us());
+        int fd = openat(dir, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd != -1 || errno != EEXIST) {
+            return fd;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Starts an upload
+ * @details Validates a PUT or POST request and creates the temporary file its body is stored in, next to the target
+ * file. The directory of the target is resolved beneath DOC_ROOT like the files requests are answered with, so symbolic
+ * links cannot lead uploads out of it. Requests which are not accepted are answered right away. Their body is not read,
+ * so the connection is closed afterwards.
+ * @param conn connection the request was received on
+ * @param req parsed request
+ * @return 0 on success, -1 if the connection should be closed
+ */
+static int conn_start_upload(conn_t *conn, http_req *req) {
+    args_t *args = conn->worker->args;
+    int keep_alive = conn->keep_alive;
+    conn->keep_alive = 0;
+
+    http_header *expect = req->known_header[HTTP_HEADER_EXPECT];
+    if (!is_safe_path(req->path) || req->path[strlen(req->path) - 1] == '/') {
+        return conn_respond_status(conn, 403, "Forbidden");
+    } else if (req->known_header[HTTP_HEADER_TRANSFER_ENCODING] != NULL && !req->chunked) {
+        return conn_respond_status(conn, 501, "Not Implemented");
+    } else if (!req->chunked && req->content_length == -1) {
+        return conn_respond_status(conn, 411, "Length Required");
+    } else if (req->content_length > args->max_upload) {
+        return conn_respond_status(conn, 413, "Content Too Large");
+    } else if (expect != NULL && strcasecmp(expect->value, "100-continue") != 0) {
+        return conn_respond_status(conn, 417, "Expectation Failed");
+    }
+
+    char path[PATH_SIZE];
+    if (build_path(args, req->path, path) == -1) {
+        return conn_respond_status(conn, 414, "URI Too Long");
+    }
+
+    // The directory is resolved beneath DOC_ROOT once, both files are then created and renamed relative to it
+    char *name = strrchr(path, '/');
+    if (name != NULL) {
+        *name = '\0';
+    }
+    int dir = openat_beneath(name != NULL ? path : ".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (dir == -1) {
+        if (errno == ENOENT || errno == ENOTDIR) {
+            return conn_respond_status(conn, 409, "Conflict");
+        } else if (errno == EACCES || errno == EXDEV || errno == ELOOP) {
+            return conn_respond_status(conn, 403, "Forbidden");
+        }
+        perror("Failed to open directory");
+        return conn_respond_status(conn, 500, "Internal Server Error");
+    }
+
+    upload_t *upload = malloc(sizeof(upload_t));
+    if (upload != NULL) {
+        upload->name = strdup(name != NULL ? &name[1] : path);
+    }
+    if (upload == NULL || upload->name == NULL) {
+        perror("Failed to allocate memory");
+        free(upload);
+        close(dir);
+        return conn_respond_status(conn, 500, "Internal Server Error");
+    }
+    upload->state = req->chunked ? UPLOAD_CHUNK_SIZE : UPLOAD_DATA;
+    upload->chunked = req->chunked;
+    upload->left = req->chunked ? 0 : req->content_length;
+    upload->received = 0;
+    upload->pipe[0] = -1;
+    upload->pipe[1] = -1;
+    upload->dir = dir;
+
+    upload->fd = create_upload_file(dir, upload->tmp_name);
+    if (upload->fd == -1) {
+        int err_code = errno;
+        upload_free(upload);
+        if (err_code == EACCES) {
+            return conn_respond_status(conn, 403, "Forbidden");
+        }
+        errno = err_code;
+        perror("Failed to create file");
+        return conn_respond_status(conn, 500, "Internal Server Error");
+    }
+    fchmod(upload->fd, 0644);
+
+    // Without a pipe, the body is copied through the input buffer instead of being spliced
+    if (pipe2(upload->pipe, O_NONBLOCK | O_CLOEXEC) == 0) {
+        fcntl(upload->pipe[0], F_SETPIPE_SZ, UPLOAD_PIPE_SIZE);
+    } else {
+        upload->pipe[0] = -1;
+        upload->pipe[1] = -1;
+    }
+
+    conn->upload = upload;
+    conn->keep_alive = keep_alive;
+    if (expect != NULL) {
+        return conn_respond_raw(conn, "HTTP/1.1 100 Continue\r\n\r\n");
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes a complete buffer into a file
+ * @param fd file to write to
+ * @param buf data to write
+ * @param ln number of bytes to write
+ * @return 0 on success, -1 on failure
+ */
+static int write_all(int fd, const char *buf, size_t ln) {
+    while (ln > 0) {
+        ssize_t write_ln = write(fd, buf, ln);
+        if (write_ln == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += write_ln;
+        ln -= write_ln;
+    }
+    return 0;
+}
+
+/**
+ * @brief Moves body data from the socket into the file of an upload
+ * @details Splices up to the remaining bytes of the body or chunk from the socket through the pipe of the upload into
+ * the file, so the data is not copied to user space. Must only be called with an empty input buffer.
+ * @param conn connection with an upload in state UPLOAD_DATA
+ * @return number of bytes moved, 0 at the end of the stream, -1 if reading the socket failed, -2 if writing the file
+ * failed
+ */
+static ssize_t upload_splice(conn_t *conn) {
+    upload_t *upload = conn->upload;
+    size_t ln = upload->left < UPLOAD_PIPE_SIZE ? upload->left : UPLOAD_PIPE_SIZE;
+    ssize_t moved = splice(conn->fd, NULL, upload->pipe[1], NULL, ln, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (moved <= 0) {
+        return moved;
+    }
+
+    // Drain the pipe completely, falling back to copying through the input buffer if the file does not support splice
+    ssize_t drained = 0;
+    while (drained < moved) {
+        ssize_t write_ln = splice(upload->pipe[0], NULL, upload->fd, NULL, moved - drained, SPLICE_F_MOVE);
+        if (write_ln == -1 && errno == EINVAL) {
+            write_ln = read(upload->pipe[0], conn->in, moved - drained < CONN_BUF_SIZE ? moved - drained : CONN_BUF_SIZE);
+            if (write_ln > 0 && write_all(upload->fd, conn->in, write_ln) == -1) {
+                return -2;
+            }
+        }
+        if (write_ln == -1 && errno == EINTR) {
+            continue;
+        } else if (write_ln <= 0) {
+            return -2;
+        }
+        drained += write_ln;
+    }
+    return moved;
+}
+
+/**
+ * @brief Cancels the upload of a connection with an error response
+ * @details The rest of the body is not read, so the connection is closed after the response.
+ * @param conn connection with an upload
+ * @param code HTTP status code
+ * @param description HTTP status description
+ * @return 1 if the response has been queued, -1 if the connection should be closed
+ */
+static int conn_fail_upload(conn_t *conn, long code, char *description) {
+    upload_abort(conn->upload);
+    conn->upload = NULL;
+    conn->keep_alive = 0;
+    return conn_respond_status(conn, code, description) == -1 ? -1 : 1;
+}
+
+/**
+ * @brief Completes the upload of a connection
+ * @details Replaces the target file with the temporary file and queues the response.
+ * @param conn connection with a completely received upload
+ * @return 1 if the response has been queued, -1 if the connection should be closed
+ */
+static int conn_finish_upload(conn_t *conn) {
+    upload_t *upload = conn->upload;
+    struct stat st;
+    int existed = fstatat(upload->dir, upload->name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+    int failed = close(upload->fd) == -1;
+    if (failed || renameat(upload->dir, upload->tmp_name, upload->dir, upload->name) == -1) {
+        int err_code = errno;
+        unlinkat(upload->dir, upload->tmp_name, 0);
+        upload_free(upload);
+        conn->upload = NULL;
+        if (!failed && err_code == EISDIR) {
+            return conn_respond_status(conn, 409, "Conflict") == -1 ? -1 : 1;
+        }
+        errno = err_code;
+        perror("Failed to store file");
+        return conn_respond_status(conn, 500, "Internal Server Error") == -1 ? -1 : 1;
+    }
+
+    upload_free(upload);
+    conn->upload = NULL;
+    if (existed) {
+        return conn_respond_status(conn, 204, "No Content") == -1 ? -1 : 1;
+    }
+    return conn_respond_status(conn, 201, "Created") == -1 ? -1 : 1;
+}
+
+/**
+ * @brief Parses a framing line of a chunked upload
+ * @param conn connection with an upload which is not in state UPLOAD_DATA
+ * @param line line without CRLF, null-terminated
+ * @return 0 on success, 1 if an error response has been queued, -1 if the connection should be closed
+ */
+static int conn_upload_line(conn_t *conn, char *line) {
+    upload_t *upload = conn->upload;
+    if (upload->state == UPLOAD_CHUNK_SIZE) {
+        // Chunk extensions after the size are ignored
+        char *endptr;
+        errno = 0;
+        long long size = strtoll(line, &endptr, 16);
+        if (errno != 0 || endptr == line || size < 0 ||
+            (*endptr != '\0' && *endptr != ';' && *endptr != ' ' && *endptr != '\t')) {
+            return conn_fail_upload(conn, 400, "Bad Request");
+        } else if (size > conn->worker->args->max_upload - upload->received) {
+            return conn_fail_upload(conn, 413, "Content Too Large");
+        }
+        upload->left = size;
+        upload->state = size == 0 ? UPLOAD_TRAILER : UPLOAD_DATA;
+    } else if (upload->state == UPLOAD_CHUNK_END) {
+        if (line[0] != '\0') {
+            return conn_fail_upload(conn, 400, "Bad Request");
+        }
+        upload->state = UPLOAD_CHUNK_SIZE;
+    } else if (line[0] == '\0') {
+        // Trailers are ignored
+        upload->state = UPLOAD_DONE;
+    }
+    return 0;
+}
+
+/**
+ * @brief Receives the body of an upload
+ * @details Stores the body into the temporary file as it arrives, until the socket would block. Data already in the
+ * input buffer is written first, further data of known length is spliced from the socket to the file. Memory use does
+ * not depend on the size of the body.
+ * @param conn connection with an upload and an empty response queue
+ * @return 0 if more data is needed, 1 if the response has been queued, -1 if the connection should be closed
+ */
+static int conn_upload(conn_t *conn) {
+    upload_t *upload = conn->upload;
+    while (upload->state != UPLOAD_DONE) {
+        if (upload->state == UPLOAD_DATA && upload->left == 0) {
+            upload->state = upload->chunked ? UPLOAD_CHUNK_END : UPLOAD_DONE;
+            continue;
+        }
+
+        if (upload->state == UPLOAD_DATA && conn->in_ln > 0) {
+            size_t ln = conn->in_ln < upload->left ? conn->in_ln : upload->left;
+            if (write_all(upload->fd, conn->in, ln) == -1) {
+                perror("Failed to store file");
+                return conn_fail_upload(conn, 500, "Internal Server Error");
+            }
+            upload->left -= ln;
+            upload->received += ln;
+            conn->in_ln -= ln;
+            memmove(conn->in, &conn->in[ln], conn->in_ln);
+            continue;
+        }
+
+        if (upload->state == UPLOAD_DATA && upload->pipe[0] != -1 && !conn->eof) {
+            ssize_t moved = upload_splice(conn);
+            if (moved > 0) {
+                upload->left -= moved;
+                upload->received += moved;
+                continue;
+            } else if (moved == 0) {
+                conn->eof = 1;
+            } else if (moved == -2) {
+                perror("Failed to store file");
+                return conn_fail_upload(conn, 500, "Internal Server Error");
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno == EINVAL) {
+                // The socket does not support splice, copy through the input buffer instead
+                close(upload->pipe[0]);
+                close(upload->pipe[1]);
+                upload->pipe[0] = -1;
+                upload->pipe[1] = -1;
+            } else {
+                perror("Error while reading request");
+                return -1;
+            }
+        }
+
+        if (upload->state != UPLOAD_DATA) {
+            char *line_end = memchr(conn->in, '\n', conn->in_ln);
+            if (line_end != NULL) {
+                if (line_end == conn->in || line_end[-1] != '\r') {
+                    return conn_fail_upload(conn, 400, "Bad Request");
+                }
+                line_end[-1] = '\0';
+                int result = conn_upload_line(conn, conn->in);
+                if (result != 0) {
+                    return result;
+                }
+                size_t ln = line_end + 1 - conn->in;
+                conn->in_ln -= ln;
+                memmove(conn->in, &conn->in[ln], conn->in_ln);
+                continue;
+            } else if (conn->in_ln == CONN_BUF_SIZE) {
+                return conn_fail_upload(conn, 400, "Bad Request");
+            }
+        }
+
+        // The body is incomplete if the client closes its side now
+        if (conn->eof) {
+            fprintf(stderr, "Upload ended prematurely\n");
+            return -1;
+        }
+        size_t in_ln = conn->in_ln;
+        if (conn_recv(conn) == -1) {
+            return -1;
+        } else if (conn->in_ln == in_ln && !conn->eof) {
+            return 0;
+        }
+    }
+
+    return conn_finish_upload(conn);
+}
+
+/**
+ * @brief Keeps method and path of a request for the access log
+ * @details Appends them to the log buffer of the connection, truncated to the space left.
+ * @param conn connection the request was received on
+ * @param req parsed request
+ */
+static void conn_log_request(conn_t *conn, http_req *req) {
+    size_t left = CONN_LOG_SIZE - conn->log_ln;
+    int ln = snprintf(&conn->log[conn->log_ln], left, "%s %s", http_method_name(req->method), req->path);
+    conn->request_pos = conn->log_ln;
+    conn->request_ln = ln < 0 ? 0 : (size_t) ln < left ? (size_t) ln : left - 1;
+    conn->log_ln += conn->request_ln;
+}
+
+/**
+ * @brief Responds with the metrics of all workers
+ * @details The metrics are formatted into a memory file, which is sent like the body of a file.
+ * @param conn connection to respond on
+ * @return 0 on success, -1 if the connection should be closed
+ */
+static int conn_respond_metrics(conn_t *conn) {
+    size_t text_ln;
+    char *text = metrics_format(metrics, metrics_ln, &text_ln);
+    int fd = text != NULL ? memfd_create("metrics", MFD_CLOEXEC) : -1;
+    if (fd == -1 || write_all(fd, text, text_ln) == -1) {
+        perror("Failed to format metrics");
+        if (fd != -1) {
+            close(fd);
+        }
+        free(text);
+        return conn_respond_status(conn, 500, "Internal Server Error");
+    }
+    free(text);
+
+    http_header header[] = {
+        { .key = "Content-Type", .value = "text/plain; version=0.0.4; charset=utf-8" },
+        { .key = "Cache-Control", .value = "no-store" }
+    };
+    http_res res = {
+        .body = NULL,
+        .header_ln = 2,
+        .status_code = { .code = 200, .description = "OK" },
+        .header = header
+    };
+    if (conn_respond(conn, &res, fd, NULL, 0, (long) text_ln) == -1) {
+        perror("Failed to send response");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Handles a request
+ * @details Answers from the file cache if possible, otherwise opens the requested file, queues the response and
+ * adds the file to the cache. Conditional and range requests are answered with 304, 206 or 416. HEAD requests get
+ * the same head as GET.
+ * @param conn connection the request was received on
+ * @param req parsed request
+ * @return 0 on success, -1 if the connection should be closed
+ */
+static int conn_handle_request(conn_t *conn, http_req *req) {
+    // A request whose file has been opened by the offload pool is handled a second time
+    if (conn->job == NULL) {
+        conn->requests++;
+        if (conn->worker->log != NULL) {
+            conn_log_request(conn, req);
+        }
+    }
+    conn->keep_alive = req->keep_alive && conn->requests < conn->worker->args->max_requests;
+    conn->head_only = req->method == HTTP_HEAD;
+
+    if ((req->method == HTTP_PUT || req->method == HTTP_POST) && conn->worker->args->max_upload > 0) {
+        return conn_start_upload(conn, req);
+    } else if (req->method != HTTP_GET && req->method != HTTP_HEAD) {
+        // A possible request body is not read, so the connection cannot be reused
+        conn->keep_alive = 0;
+        return conn_respond_status(conn, 501, "Not implemented");
+    } else if (req->chunked || req->content_length > 0) {
+        conn->keep_alive = 0;
+    }
+
+    char *metrics_path = conn->worker->args->metrics_path;
+    if (metrics_path != NULL && strcmp(req->path, metrics_path) == 0) {
+        return conn_respond_metrics(conn);
+    }
+
+    char path[PATH_SIZE];
+    if (build_path(conn->worker->args, req->path, path) == -1) {
+        if (errno == EACCES) {
+            return conn_respond_status(conn, 403, "Forbidden");
+        }
+        return conn_respond_status(conn, 414, "URI Too Long");
+    }
+
+    const mime_t *mime = mime_lookup(path);
+    file_t file;
+    int result = 0;
+    if (conn->job != NULL) {
+        file = conn->job->file;
+        result = conn->job->result;
+        errno = conn->job->err_code;
+        free(conn->job);
+        conn->job = NULL;
+    } else {
+        compress_coding accepted[COMPRESS_CODING_LN];
+        int accepted_ln = accepted_codings(req, mime != NULL && mime->compressible, accepted);
+        int cached = lookup_file(path, accepted, accepted_ln, &file);
+        metrics_add(&conn->worker->metrics->lookups[!cached ? METRICS_MISS : file.entry != NULL ? METRICS_CONTENT_HIT
+                                                                                                : METRICS_OPEN_HIT], 1);
+        if (!cached) {
+            // Revalidated and partial responses are not worth caching the whole file for
+            int cacheable = req->known_header[HTTP_HEADER_RANGE] == NULL &&
+                            req->known_header[HTTP_HEADER_IF_NONE_MATCH] == NULL &&
+                            req->known_header[HTTP_HEADER_IF_MODIFIED_SINCE] == NULL;
+            if (offload != NULL && conn_offload(conn, path, mime, accepted, accepted_ln, cacheable) == 0) {
+                return 0;
+            }
+#ifdef URING_OPEN_SUPPORTED
+            // The open file cache watches files before opening them itself, so it keeps opening them synchronously
+            if (offload == NULL && fdcache == NULL && conn->worker->epoll == -1 &&
+                conn_open_uring(conn, path, mime, accepted, accepted_ln, cacheable) == 0) {
+                return 0;
+            }
+#endif
+            result = resolve_file(path, mime, accepted, accepted_ln, cacheable, &file);
+        }
+    }
+    if (result == -1) {
+        if (errno == ENOENT) {
+            return conn_respond_status(conn, 404, "Not Found");
+        } else if (errno == EACCES || errno == EXDEV) {
+            return conn_respond_status(conn, 403, "Forbidden");
+        } else {
+            perror("Failed to access file");
+            return conn_respond_status(conn, 500, "Internal Server Error");
+        }
+    }
+
+    http_header header[7];
+    char etag[ETAG_SIZE];
+    char last_modified[HTTP_DATE_SIZE];
+    size_t validator_ln;
+    size_t header_ln = build_file_headers(&file, mime, header, etag, last_modified, &validator_ln);
+    http_res res = {
+        .body = NULL,
+        .header_ln = header_ln,
+        .status_code = { .code = 200, .description = "OK" },
+        .header = header
+    };
+
+    off_t start = 0;
+    off_t end = file.size;
+    int not_modified = is_not_modified(req, &file.st, etag);
+    int range = not_modified ? -1 : get_range(req, &file.st, etag, file.size, &start, &end);
+    if (not_modified || range == -2) {
+        file_release(&file);
+        if (range == -2) {
+            return conn_respond_unsatisfiable(conn, file.size);
+        }
+        res.status_code = (http_status_code) { .code = 304, .description = "Not Modified" };
+        res.header_ln = validator_ln;
+        return conn_respond(conn, &res, -1, NULL, 0, -1);
+    }
+
+    if (range == -1 && file.entry != NULL) {
+        return conn_respond_cached(conn, file.entry);
+    }
+
+    char content_range[CONTENT_RANGE_SIZE];
+    if (range == 0) {
+        snprintf(content_range, sizeof(content_range), "bytes %llu-%llu/%llu", (unsigned long long) start,
+                 (unsigned long long) end - 1, (unsigned long long) file.size);
+        header[res.header_ln++] = (http_header) { .key = "Content-Range", .value = content_range };
+        res.status_code = (http_status_code) { .code = 206, .description = "Partial Content" };
+    }
+
+    if (file.entry != NULL) {
+        return conn_respond_slice(conn, &res, file.entry, start, end - start);
+    } else if (conn_respond(conn, &res, file.fd, file.open, start, end - start) == -1) {
+        perror("Failed to send response");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Parses all complete requests received on a connection
+ * @details Handles the complete request heads at the start of the input buffer in order and queues their responses,
+ * until the queue or the output buffer is full. Incomplete data is moved to the start of the input buffer. Parsing
+ * stops at a request whose file is opened by the offload pool; once it has been opened, the request is finished first.
+ * @param conn connection with an empty response queue and without a file job in flight
+ * @return 0 on success, -1 if the connection should be closed
+ */
+static int conn_parse(conn_t *conn) {
+    size_t pos = 0;
+    if (conn->job == NULL) {
+        // All responses of the previous batch have been sent, their log entries are not needed anymore
+        conn->log_ln = 0;
+    } else {
+        // The file of the first request has been opened, its head is still in place
+        pos = conn->job_end;
+        if (conn_handle_request(conn, &conn->job_req) == -1) {
+            return -1;
+        }
+    }
+
+    while (conn->keep_alive && conn->queue_ln < PIPELINE_DEPTH && conn->out_ln + CONN_HEAD_SIZE <= CONN_OUT_SIZE) {
+        http_req req;
+        http_arena_reset(&conn->arena);
+        conn->request_ln = 0;
+        long parsed = parse_req(&conn->in[pos], conn->in_ln - pos, &req, &conn->arena);
+        if (parsed == 0) {
+            if (conn->in_ln - pos == CONN_BUF_SIZE) {
+                fprintf(stderr, "Received malformed packet\n");
+                conn->keep_alive = 0;
+                return conn_respond_status(conn, 400, "Bad Request");
+            }
+            break;
+        } else if (parsed == -2 || parsed == -3) {
+            fprintf(stderr, "Received malformed packet\n");
+            conn->keep_alive = 0;
+            return conn_respond_status(conn, 400, "Bad Request");
+        } else if (parsed < 0) {
+            perror("Error while reading request");
+            return -1;
+        }
+
+        pos += parsed;
+        if (conn_handle_request(conn, &req) == -1) {
+            return -1;
+        } else if (conn->upload != NULL) {
+            // The body of the upload follows, it is received by conn_upload
+            break;
+        } else if (conn->job != NULL) {
+            // Parsed heads point into the buffer, so it is left untouched until the request is finished
+            conn->job_req = req;
+            conn->job_end = pos;
+            return 0;
+        }
+    }
+
+    conn->in_ln -= pos;
+    memmove(conn->in, &conn->in[pos], conn->in_ln);
+    return 0;
+}
+
+/**
+ * @brief Records a completely sent response
+ * @details Updates the metrics of the worker and logs the response into its access log ring. The line holds the
+ * cached Date, method and path, status code, bytes sent and the milliseconds from receiving the request to the last
+ * byte.
+ * @param conn connection the response was sent on
+ * @param queued sent response
+ */
+static void conn_record(conn_t *conn, conn_res_t *queued) {
+    if (queued->code == 0) {
+        return;
+    }
+    long now = now_us();
+    metrics_t *worker_metrics = conn->worker->metrics;
+    metrics_response(worker_metrics, queued->code);
+    metrics_observe(&worker_metrics->first_byte, queued->first_byte - queued->started);
+    metrics_observe(&worker_metrics->last_byte, now - queued->first_byte);
+
+    if (conn->worker->log == NULL) {
+        return;
+    }
+    char line[ACCESS_LOG_LINE];
+    const char *date = http_date();
+    int ln = snprintf(line, sizeof(line), "[%s] %.*s %ld %zu %.3f\n", date != NULL ? date : "-",
+                      queued->request_ln > 0 ? (int) queued->request_ln : 1,
+                      queued->request_ln > 0 ? &conn->log[queued->request_pos] : "-", queued->code, queued->bytes,
+                      (double) (now - queued->started) / 1000);
+    if (ln < 0) {
+        return;
+    } else if (ln >= (int) sizeof(line)) {
+        ln = sizeof(line) - 1;
+        line[ln - 1] = '\n';
+    }
+    accesslog_write(conn->worker->log, line, ln);
+}
+
+/**
+ * @brief Gathers the unsent heads and cached bodies of the queued responses of a connection
+ * @details Gathers up to the first body which is not inlined. If one follows, MSG_MORE is added to flags, so the heads
+ * are coalesced with the start of the body.
+ * @param conn connection with queued responses
+ * @param iov array of PIPELINE_DEPTH * 3 segments which will be filled
+ * @param flags send flags, MSG_MORE is added if needed
+ * @return number of segments, 0 if the first unfinished response continues with its body
+ */
+static int conn_gather(conn_t *conn, struct iovec *iov, int *flags) {
+    int iov_ln = 0;
+    for (int i = conn->queue_pos; i < conn->queue_ln; i++) {
+        conn_res_t *queued = &conn->queue[i];
+        size_t skip = queued->sent;
+        for (int j = 0; j < 3; j++) {
+            if (skip >= queued->seg[j].iov_len) {
+                skip -= queued->seg[j].iov_len;
+                continue;
+            }
+            iov[iov_ln].iov_base = (char *) queued->seg[j].iov_base + skip;
+            iov[iov_ln].iov_len = queued->seg[j].iov_len - skip;
+            iov_ln++;
+            skip = 0;
+        }
+        if (queued->body != -1) {
+            if (iov_ln > 0) {
+                *flags |= MSG_MORE;
+            }
+            break;
+        }
+    }
+    return iov_ln;
+}
+
+/**
+ * @brief Accounts bytes sent from the gathered segments to the queued responses of a connection
+ * @param conn connection with queued responses
+ * @param write_ln number of bytes sent
+ */
+static void conn_sent(conn_t *conn, size_t write_ln) {
+    metrics_add(&conn->worker->metrics->bytes_sent, write_ln);
+    long now = now_us();
+    for (int i = conn->queue_pos; write_ln > 0; i++) {
+        conn_res_t *queued = &conn->queue[i];
+        size_t ln = queued->ln - queued->sent;
+        ln = ln < write_ln ? ln : write_ln;
+        if (ln > 0 && queued->sent == 0) {
+            queued->first_byte = now;
+        }
+        queued->sent += ln;
+        queued->bytes += ln;
+        write_ln -= ln;
+    }
+}
+
+/**
+ * @brief Writes the queued responses of a connection
+ * @details Writes as much of the queued responses as the socket accepts without blocking. The heads of consecutive
+ * responses and cached bodies are gathered into a single sendmsg call, see conn_gather. With io_uring, they are sent
+ * by a request instead, whose completion continues the connection. Other bodies which were not inlined are sent
+ * zero-copy with send_file.
+ * @param conn connection with queued responses
+ * @return 0 if the socket is full, 1 if all responses have been sent, 2 if a send is in flight, -1 on failure
+ */
+static int conn_write(conn_t *conn) {
+    while (conn->queue_pos < conn->queue_ln) {
+        struct iovec iov[PIPELINE_DEPTH * 3];
+        int flags = MSG_NOSIGNAL;
+        if (conn->worker->epoll == -1) {
+            int iov_ln = conn_gather(conn, conn->send_iov, &flags);
+            if (iov_ln > 0) {
+                conn->send_msg = (struct msghdr) { .msg_iov = conn->send_iov, .msg_iovlen = iov_ln };
+                if (uring_sendmsg(&conn->worker->ring, conn->fd, &conn->send_msg, flags, conn) == -1) {
+                    return -1;
+                }
+                conn->op = URING_SEND;
+                return 2;
+            }
+        } else {
+            int iov_ln = conn_gather(conn, iov, &flags);
+            if (iov_ln > 0) {
+                struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iov_ln };
+                ssize_t write_ln = sendmsg(conn->fd, &msg, flags);
+                if (write_ln == -1) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        return 0;
+                    } else if (errno == EINTR) {
+                        continue;
+                    }
+                    return -1;
+                }
+                conn_sent(conn, write_ln);
+            }
+        }
+
+        // Pop all completely sent responses and continue with the body of the first unfinished one
+        while (conn->queue_pos < conn->queue_ln) {
+            conn_res_t *queued = &conn->queue[conn->queue_pos];
+            if (queued->sent < queued->ln) {
+                break;
+            }
+
+            while (queued->body != -1 && queued->body_pos < queued->body_end) {
+                ssize_t write_ln = send_file(conn->fd, queued->body, &queued->body_pos,
+                                             queued->body_end - queued->body_pos, &conn->pipe);
+                if (write_ln == -1) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        return 0;
+                    } else if (errno == EINTR) {
+                        continue;
+                    }
+                    return -1;
+                } else if (write_ln == 0) {
+                    // File was truncated while sending, the promised length cannot be delivered anymore
+                    return -1;
+                }
+                metrics_add(&conn->worker->metrics->bytes_sent, write_ln);
+                queued->bytes += write_ln;
+            }
+
+            if (queued->body != -1) {
+                release_fd(queued->body, queued->open);
+                queued->body = -1;
+            }
+            if (queued->entry != NULL) {
+                cache_release(queued->entry);
+                queued->entry = NULL;
+            }
+            conn_record(conn, queued);
+            conn->queue_pos++;
+            if (!queued->keep_alive) {
+                return 1;
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Handles an event of a connection
+ * @details Alternates between receiving and parsing a batch of requests and writing all of their responses, until
+ * the connection would block.
+ * @param conn connection to handle
+ * @return 0 on success, -1 if the connection should be closed
+ */
+static int conn_handle_event(conn_t *conn) {
+    while (1) {
+        // While the io_uring engine opens a file, the queued responses wait, as only one request may be in flight
+        if (conn->queue_pos < conn->queue_ln && (conn->job == NULL || conn->job->done || !conn->job->ring)) {
+            int result = conn_write(conn);
+            if (result == -1) {
+                perror("Failed to send response");
+                return -1;
+            } else if (result == 0) {
+                return conn_wait(conn, EPOLLOUT);
+            } else if (result == 2) {
+                return 0;
+            } else if (!conn->keep_alive && conn->job == NULL) {
+                // A pending file job belongs to the request which closes the connection, its response comes later
+                return -1;
+            }
+            conn->queue_pos = 0;
+            conn->queue_ln = 0;
+            conn->out_ln = 0;
+        }
+
+        if (conn->job != NULL && !conn->job->done) {
+            return conn_wait(conn, 0);
+        }
+
+        if (conn->upload != NULL) {
+            int result = conn_upload(conn);
+            if (result == -1) {
+                return -1;
+            } else if (result == 0) {
+                return conn_wait(conn, EPOLLIN);
+            }
+            continue;
+        }
+
+        // With io_uring, input has been received by the completed request already
+        if ((conn->worker->epoll != -1 && conn_recv(conn) == -1) || conn_parse(conn) == -1) {
+            return -1;
+        }
+
+        if (conn->queue_ln == 0 && conn->upload == NULL) {
+            if (conn->job != NULL) {
+                return conn_wait(conn, 0);
+            } else if (conn->eof) {
+                return -1;
+            }
+            return conn_wait(conn, EPOLLIN);
+        }
+    }
+}
+
+/**
+ * @brief Admits an accepted client if the connection limit allows it
+ * @details Clients over the limit are answered with 503 right away and closed, without allocating a connection, so
+ * overload costs a single send for each of them instead of queueing clients which would time out anyway. What the
+ * client has sent already is read first, so closing does not reset the connection before the response arrives.
+ * @param worker worker which accepted the client
+ * @param fd non-blocking socket of the client
+ * @return 1 if the client has been admitted, 0 if it has been answered and fd is closed
+ */
+static int admit_client(worker_t *worker, int fd) {
+    long max_connections = worker->args->max_connections;
+    if (max_connections == 0 || __atomic_add_fetch(&connection_n, 1, __ATOMIC_RELAXED) <= max_connections) {
+        return 1;
+    }
+    __atomic_sub_fetch(&connection_n, 1, __ATOMIC_RELAXED);
+
+    char discard[CONN_HEAD_SIZE];
+    if (recv(fd, discard, sizeof(discard), MSG_DONTWAIT) == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        close(fd);
+        return 0;
+    }
+    if (send(fd, SHED_RESPONSE, sizeof(SHED_RESPONSE) - 1, MSG_NOSIGNAL | MSG_DONTWAIT) > 0) {
+        metrics_response(worker->metrics, 503);
+    }
+    close(fd);
+    return 0;
+}
+
+/**
+ * @brief Creates a connection for an accepted client
+ * @param worker worker serving the connection
+ * @param fd non-blocking socket of the client
+ * @return new connection, NULL on failure or if the client is over the connection limit, in which case fd is closed
+ */
+static conn_t *conn_create(worker_t *worker, int fd) {
+    if (!admit_client(worker, fd)) {
+        return NULL;
+    }
+    conn_t *conn = malloc(sizeof(conn_t));
+    if (conn == NULL) {
+        perror("Failed to allocate memory");
+        if (worker->args->max_connections > 0) {
+            __atomic_sub_fetch(&connection_n, 1, __ATOMIC_RELAXED);
+        }
+        close(fd);
+        return NULL;
+    }
+    // Responses finished by file jobs are written one by one, Nagle would hold them back until the client acknowledges
+    int nodelay = 1;
+    if (offload != NULL && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) == -1) {
+        perror("Failed to disable Nagle's algorithm");
+    }
+    conn->worker = worker;
+    conn->fd = fd;
+    conn->events = EPOLLIN;
+    conn->op = URING_NONE;
+    conn->closed = 0;
+    conn->in_ln = 0;
+    http_arena_init(&conn->arena, conn->arena_buf, sizeof(conn->arena_buf));
+    conn->eof = 0;
+    conn->out_ln = 0;
+    conn->queue_pos = 0;
+    conn->queue_ln = 0;
+    http_pipe_init(&conn->pipe);
+    conn->keep_alive = 1;
+    conn->requests = 0;
+    conn->head_only = 0;
+    conn->upload = NULL;
+    conn->job = NULL;
+    conn->prev = NULL;
+    conn->next = NULL;
+    conn->received = now_us();
+    conn->log_ln = 0;
+    conn->request_pos = 0;
+    conn->request_ln = 0;
+    conn->timer = CONN_TIMER_LN;
+    conn_start_timer(conn, CONN_TIMER_HEAD);
+    metrics_add(&worker->metrics->accepted, 1);
+    return conn;
+}
+
+/**
+ * @brief Accepts waiting client connections
+ * @details Accepts up to ACCEPT_BATCH client connections and registers them with epoll. The listening socket stays
+ * readable while more are waiting, so they are accepted after the events of established connections.
+ * @param worker worker to register the connections with
+ */
+static void accept_clients(worker_t *worker) {
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        int fd = accept_client_fd(worker->socket);
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+                perror("Failed to initiate client connection");
+            }
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return;
+        }
+
+        conn_t *conn = conn_create(worker, fd);
+        if (conn == NULL) {
+            continue;
+        }
+
+        struct epoll_event ev = { .events = conn->events, .data.ptr = conn };
+        if (epoll_ctl(worker->epoll, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            perror("Failed to register client connection");
+            conn_close(conn);
+        }
+    }
+}
+
+/**
+ * @brief Resumes the connections whose file jobs have completed
+ * @details Jobs of connections which have been closed in the meantime are freed.
+ * @param worker worker whose completion queue is handled
+ */
+static void complete_jobs(worker_t *worker) {
+    offload_job_t *next = offload_completions_take(&worker->completions);
+    while (next != NULL) {
+        file_job_t *job = (file_job_t *) next;
+        next = next->next;
+        conn_t *conn = job->conn;
+        if (conn == NULL) {
+            file_job_free(job);
+            continue;
+        }
+
+        job->done = 1;
+        conn_touch(conn);
+        if (conn->op != URING_NONE) {
+            // The connection waits for its output, the completion of that request continues it
+            continue;
+        }
+        if (conn_handle_event(conn) == -1) {
+            conn_close(conn);
+        }
+    }
+}
+
+/**
+ * @brief Closes timed out connections
+ * @details Closes all connections whose header or idle timer has expired. Only the start of each timer list has to be
+ * checked, as the lists are sorted by expiry.
+ * @param worker worker whose connections are checked
+ * @return milliseconds until the next connection times out, -1 if there are no connections
+ */
+static int expire_idle(worker_t *worker) {
+    long now = now_ms();
+    long next = -1;
+    for (int i = 0; i < CONN_TIMER_LN; i++) {
+        while (worker->timer_head[i] != NULL) {
+            long remaining = worker->timer_head[i]->last_active + worker->timeout[i] - now;
+            if (remaining > 0) {
+                next = next == -1 || remaining < next ? remaining : next;
+                break;
+            }
+            conn_close(worker->timer_head[i]);
+        }
+    }
+    return (int) next;
+}
+
+/**
+ * @brief Runs the event loop of a worker
+ * @details Accepts and serves connections on the listening socket of the worker until stop_event becomes readable.
+ * @param arg worker_t of this thread
+ * @return NULL
+ */
+static void *worker_run(void *arg) {
+    worker_t *worker = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        int event_n = epoll_wait(worker->epoll, events, MAX_EVENTS, expire_idle(worker));
+        if (event_n == -1) {
+            if (errno != EINTR) {
+                perror("Failed to wait for events");
+            }
+            continue;
+        }
+
+        for (int i = 0; i < event_n; i++) {
+            if (events[i].data.ptr == &stop_tag) {
+                free_closed(worker);
+                return NULL;
+            } else if (events[i].data.ptr == &listener_tag) {
+                accept_clients(worker);
+                continue;
+            } else if (events[i].data.ptr == &jobs_tag) {
+                complete_jobs(worker);
+                continue;
+            }
+
+            // A connection may have been closed by handling an earlier event of this batch
+            conn_t *conn = events[i].data.ptr;
+            if (conn->closed) {
+                continue;
+            } else if (conn->job != NULL && !conn->job->done && (events[i].events & (EPOLLERR | EPOLLHUP))) {
+                // A connection waiting for its file may still be writing earlier responses, other events continue it
+                conn_close(conn);
+                continue;
+            }
+            conn_touch(conn);
+
+            if (conn_handle_event(conn) == -1) {
+                conn_close(conn);
+            }
+        }
+        free_closed(worker);
+    }
+}
+
+/**
+ * @brief Handles the completion of an accept request of the io_uring engine
+ * @details Starts receiving on the accepted connection and queues a new accept request once the current one ended.
+ * @param worker worker which accepted the connection
+ * @param cqe completion of the accept request
+ */
+static void uring_accepted(worker_t *worker, uring_cqe_t *cqe) {
+    if (cqe->res >= 0) {
+        conn_t *conn = conn_create(worker, cqe->res);
+        if (conn != NULL && conn_wait(conn, EPOLLIN) == -1) {
+            perror("Failed to register client connection");
+            conn_close(conn);
+        }
+    } else if (cqe->res == -EINVAL && worker->accept_multishot) {
+        // Kernels before 5.19 reject multishot accept
+        worker->accept_multishot = 0;
+    } else if (cqe->res != -EINTR && cqe->res != -ECONNABORTED && cqe->res != -EAGAIN) {
+        errno = -cqe->res;
+        perror("Failed to initiate client connection");
+    }
+
+    if (!cqe->more && uring_accept(&worker->ring, worker->socket, SOCK_NONBLOCK, worker->accept_multishot,
+                                   &listener_tag) == -1) {
+        perror("Failed to accept client connections");
+    }
+}
+
+#ifdef URING_OPEN_SUPPORTED
+/**
+ * @brief Handles the completion of opening or determining the status of a candidate of a file job
+ * @details Continues with the status of an opened candidate, or with the next candidate if a sibling is missing or
+ * not a regular file. The job is done once the file itself has been tried, the connection then handles its request.
+ * @param conn connection the job belongs to
+ * @param op completed request, URING_OPEN or URING_STAT
+ * @param res result of the request
+ * @return 0 on success, -1 if the connection should be closed
+ */
+static int uring_open_completed(conn_t *conn, uring_op op, int res) {
+    file_job_t *job = conn->job;
+    file_t *file = &job->file;
+    if (op == URING_OPEN && res >= 0) {
+        file->fd = res;
+        if (uring_statx(&conn->worker->ring, file->fd, "", AT_EMPTY_PATH, STATX_BASIC_STATS, &job->stx, conn) == 0) {
+            conn->op = URING_STAT;
+            return 0;
+        }
+        res = -errno;
+    } else if (op == URING_STAT && res == 0) {
+        stat_from_statx(&file->st, &job->stx);
+    }
+
+    int sibling = job->candidate < job->accepted_ln;
+    if (file->fd != -1 && (res < 0 || (sibling && !S_ISREG(file->st.st_mode)))) {
+        close(file->fd);
+        file->fd = -1;
+    }
+    if (sibling && file->fd == -1) {
+        job->candidate++;
+        if (uring_open_candidate(conn, job) == 0) {
+            return 0;
+        }
+        res = -errno;
+        sibling = 0;
+    }
+
+    if (res < 0) {
+        job->result = -1;
+        job->err_code = -res;
+    } else {
+        file->size = file->st.st_size;
+        if (sibling) {
+            file->sibling = job->accepted[job->candidate];
+            file->encoding = compress_name(job->accepted[job->candidate]);
+        } else {
+            choose_compression(file, job->accepted, job->accepted_ln);
+        }
+        load_file(file, job->path, job->mime, job->cacheable);
+        job->result = 0;
+    }
+    job->done = 1;
+    return conn_handle_event(conn);
+}
+#endif
+
+/**
+ * @brief Handles the completion of a request of a connection
+ * @param conn connection the request was queued for
+ * @param res result of the request
+ * @return 0 on success, -1 if the connection should be closed
+ */
+static int uring_completed(conn_t *conn, int res) {
+    uring_op op = conn->op;
+    conn->op = URING_NONE;
+    if (conn->closed) {
+        if (op == URING_SEND) {
+            conn_release_queue(conn);
+        }
+        if (conn->job != NULL) {
+            // The file of a job the ring opens may have been opened before the cancellation took effect
+            if (op == URING_OPEN && res >= 0) {
+                conn->job->file.fd = res;
+            }
+            file_release(&conn->job->file);
+            free(conn->job);
+        }
+        free(conn);
+        return 0;
+    }
+    conn_touch(conn);
+
+#ifdef URING_OPEN_SUPPORTED
+    if (op == URING_OPEN || op == URING_STAT) {
+        return uring_open_completed(conn, op, res);
+    }
+#endif
+    if (res == -EAGAIN || res == -EINTR) {
+        int output = (op == URING_POLL || op == URING_SEND) && conn->queue_pos < conn->queue_ln;
+        return conn_wait(conn, output ? EPOLLOUT : EPOLLIN);
+    } else if (res < 0) {
+        errno = -res;
+        perror(op == URING_RECV ? "Error while reading request" : op == URING_SEND ? "Failed to send response"
+                                                                                    : "Failed to wait for events");
+        return -1;
+    } else if (op == URING_SEND) {
+        conn_sent(conn, res);
+    } else if (op == URING_RECV && res == 0) {
+        conn->eof = 1;
+    } else if (op == URING_RECV) {
+        if (conn->in_ln == 0 && conn->requests > 0) {
+            conn->received = now_us();
+        }
+        conn->in_ln += res;
+    }
+    return conn_handle_event(conn);
+}
+
+/**
+ * @brief Runs the io_uring driven event loop of a worker
+ * @details Like worker_run, but connections are accepted with a multishot request, input is received by requests
+ * queued into the input buffers of the connections and output is sent by requests as well. Without the open file cache
+ * and the offload pool, files are opened by requests too, see conn_open_uring. All requests queued while handling a
+ * batch of completions are submitted together when waiting for the next batch.
+ * @param arg worker_t of this thread
+ * @return NULL
+ */
+static void *worker_run_uring(void *arg) {
+    worker_t *worker = arg;
+    if (uring_accept(&worker->ring, worker->socket, SOCK_NONBLOCK, worker->accept_multishot, &listener_tag) == -1 ||
+        uring_poll(&worker->ring, stop_event, POLLIN, &stop_tag) == -1 ||
+        (offload != NULL && uring_poll(&worker->ring, worker->completions.event, POLLIN, &jobs_tag) == -1)) {
+        perror("Failed to register socket");
+        return NULL;
+    }
+
+    while (1) {
+        if (uring_wait(&worker->ring, expire_idle(worker)) == -1) {
+            if (errno != EINTR) {
+                perror("Failed to wait for events");
+            }
+            continue;
+        }
+
+        uring_cqe_t cqe;
+        while (uring_next(&worker->ring, &cqe)) {
+            if (cqe.data == NULL) {
+                // Completion of a cancellation
+                continue;
+            } else if (cqe.data == &stop_tag) {
+                return NULL;
+            } else if (cqe.data == &listener_tag) {
+                uring_accepted(worker, &cqe);
+                continue;
+            } else if (cqe.data == &jobs_tag) {
+                complete_jobs(worker);
+                if (uring_poll(&worker->ring, worker->completions.event, POLLIN, &jobs_tag) == -1) {
+                    perror("Failed to register socket");
+                }
+                continue;
+            }
 
-        if (extension != NULL) {
-            if (strcmp(extension, ".html") == 0 || strcmp(extension, ".htm") == 0) {
-                mime = "text/html";
-            } else if (strcmp(extension, ".css") == 0) {
-                mime = "text/css";
-            } else if (strcmp(extension, ".js") == 0) {
-                mime = "application/javascript";
+            conn_t *conn = cqe.data;
+            if (uring_completed(conn, cqe.res) == -1) {
+                conn_close(conn);
             }
         }
+    }
+}
+
+/**
+ * @brief Releases the event loop and the listening socket of a worker
+ * @param worker stopped worker
+ */
+static void close_worker(worker_t *worker) {
+    if (worker->epoll != -1) {
+        close(worker->epoll);
+    } else {
+        uring_destroy(&worker->ring);
+    }
+    if (offload != NULL) {
+        offload_completions_destroy(&worker->completions);
+    }
+    close(worker->socket);
+}
+
+/**
+ * @brief Initializes a worker
+ * @details Opens the listening socket and the epoll or io_uring instance of a worker. All workers listen on the same
+ * port using SO_REUSEPORT, so the kernel balances new connections between them.
+ * @param worker worker to initialize
+ * @param args parsed arguments
+ * @return 0 on success, -1 on failure
+ */
+static int init_worker(worker_t *worker, args_t *args) {
+    worker->args = args;
+    for (int i = 0; i < CONN_TIMER_LN; i++) {
+        worker->timer_head[i] = NULL;
+        worker->timer_tail[i] = NULL;
+    }
+    worker->closing = NULL;
+    worker->timeout[CONN_TIMER_HEAD] = args->header_timeout * 1000;
+    worker->timeout[CONN_TIMER_IDLE] = args->idle_timeout * 1000;
 
-        http_res res;
-        if (mime != NULL) {
-            res = (http_res) {
-                .body = body,
-                .header_ln = 1,
-                .status_code = { .code = 200, .description = "OK" },
-                .header = (http_header[]) { { .key = "Content-Type", .value = mime } }
-            };
+    const char *err = NULL;
+    worker->socket = open_socket(args->port, &args->listen, &err);
+    if (worker->socket == -1) {
+        if (err == NULL) {
+            perror("Failed to open socket");
         } else {
-            res = (http_res) { .body = body, .header_ln = 0, .status_code = { .code = 200, .description = "OK" } };
+            fprintf(stderr, "Failed to open socket: %s\n", err);
+        }
+        return -1;
+    }
+
+    int flags = fcntl(worker->socket, F_GETFL);
+    if (flags == -1 || fcntl(worker->socket, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("Failed to open socket");
+        close(worker->socket);
+        return -1;
+    }
+
+    if (offload != NULL && offload_completions_init(&worker->completions) == -1) {
+        perror("Failed to create eventfd");
+        close(worker->socket);
+        return -1;
+    }
+
+    if (args->uring) {
+        worker->epoll = -1;
+        worker->accept_multishot = 1;
+        if (uring_init(&worker->ring, URING_ENTRIES) == -1) {
+            perror("Failed to create io_uring instance");
+            if (offload != NULL) {
+                offload_completions_destroy(&worker->completions);
+            }
+            close(worker->socket);
+            return -1;
         }
-        if (send_res(connection, &res) == -1) {
-            perror("Failed to send response");
+        return 0;
+    }
+
+    worker->epoll = epoll_create1(0);
+    if (worker->epoll == -1) {
+        perror("Failed to create epoll instance");
+        if (offload != NULL) {
+            offload_completions_destroy(&worker->completions);
         }
-        free(path);
-        fclose(body);
-        fclose(connection);
+        close(worker->socket);
+        return -1;
+    }
+
+    struct epoll_event listener_ev = { .events = EPOLLIN, .data.ptr = &listener_tag };
+    struct epoll_event stop_ev = { .events = EPOLLIN, .data.ptr = &stop_tag };
+    struct epoll_event jobs_ev = { .events = EPOLLIN, .data.ptr = &jobs_tag };
+    if (epoll_ctl(worker->epoll, EPOLL_CTL_ADD, worker->socket, &listener_ev) == -1 ||
+        epoll_ctl(worker->epoll, EPOLL_CTL_ADD, stop_event, &stop_ev) == -1 ||
+        (offload != NULL && epoll_ctl(worker->epoll, EPOLL_CTL_ADD, worker->completions.event, &jobs_ev) == -1)) {
+        perror("Failed to register socket");
+        close_worker(worker);
+        return -1;
     }
 
-    close(socket);
     return 0;
 }
+
+/**
+ * @brief Releases the process-wide resources set up by main
+ * @details Everything which has been set up so far is released, so each error exit of main can use it as well. The
+ * worker threads have to be stopped already.
+ * @param signal_fd signalfd of the main thread, or -1
+ */
+static void release_globals(int signal_fd) {
+    if (offload != NULL) {
+        offload_destroy(offload);
+        offload = NULL;
+    }
+    free(metrics);
+    metrics = NULL;
+    if (stop_event != -1) {
+        close(stop_event);
+        stop_event = -1;
+    }
+    if (fdcache != NULL) {
+        fdcache_destroy(fdcache);
+        fdcache = NULL;
+    }
+    if (cache != NULL) {
+        cache_destroy(cache);
+        cache = NULL;
+    }
+    if (signal_fd != -1) {
+        close(signal_fd);
+    }
+    if (root_fd != -1) {
+        close(root_fd);
+        root_fd = -1;
+    }
+    mime_unload();
+    if (access_log != NULL) {
+        accesslog_destroy(access_log);
+        access_log = NULL;
+    }
+}
+
+/**
+ * Main entrypoint.
+ * @brief Main entry point
+ * @details Main entry point. This is where the program will start from.
+ * Starts the worker threads and waits for SIGINT or SIGTERM to stop them. Meanwhile it runs the once-per-second timer.
+ * @param argc argc passed to program
+ * @param argv argv passed to program
+ * @return exit code
+ */
+int main(int argc, char **argv) {
+    args_t args;
+    if (parse_args(argc, argv, &args) == -1) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Loaded before DOC_ROOT becomes the working directory, so a relative path is taken as given
+    if (args.mime_types != NULL && mime_load(args.mime_types) == -1) {
+        perror("Failed to load MIME types");
+        return EXIT_FAILURE;
+    }
+
+    // Requests are logged into a ring per worker, which a background thread writes out
+    if (args.access_log != NULL) {
+        int log_fd;
+        if (strcmp(args.access_log, "-") == 0) {
+            log_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+        } else {
+            log_fd = open(args.access_log, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        }
+        access_log = log_fd != -1 ? accesslog_create(log_fd, args.workers, ACCESS_LOG_RING, ACCESS_LOG_INTERVAL) : NULL;
+        if (access_log == NULL) {
+            perror("Failed to open access log");
+            if (log_fd != -1) {
+                close(log_fd);
+            }
+            release_globals(-1);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Path based calls like inotify watches and uploads resolve relative to DOC_ROOT as well
+    root_fd = open(args.doc_root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd == -1 || fchdir(root_fd) == -1) {
+        perror("Failed to open DOC_ROOT");
+        release_globals(-1);
+        return EXIT_FAILURE;
+    }
+
+    // Signals are blocked in all threads and only accepted by the main thread using a signalfd
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+    if (signal_fd == -1) {
+        perror("Failed to create signalfd");
+        release_globals(-1);
+        return EXIT_FAILURE;
+    }
+
+    if (args.cache_bytes > 0) {
+        cache_bytes = args.cache_bytes;
+        cache = cache_create(args.cache_bytes);
+        if (cache == NULL) {
+            perror("Failed to create file cache");
+            release_globals(signal_fd);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (args.open_files > 0) {
+        fdcache = fdcache_create(args.open_files, OPEN_FILE_TTL, open_beneath);
+        if (fdcache == NULL) {
+            perror("Failed to create open file cache");
+            release_globals(signal_fd);
+            return EXIT_FAILURE;
+        }
+    }
+
+    struct sigaction sa = { .sa_handler = SIG_IGN };
+    sigaction(SIGPIPE, &sa, NULL);
+
+    stop_event = eventfd(0, 0);
+    if (stop_event == -1) {
+        perror("Failed to create eventfd");
+        release_globals(signal_fd);
+        return EXIT_FAILURE;
+    }
+
+    if (args.file_threads > 0) {
+        offload = offload_create(args.file_threads, OFFLOAD_QUEUE);
+        if (offload == NULL) {
+            perror("Failed to start file threads");
+            release_globals(signal_fd);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Metrics are aligned to cache lines, so workers recording them do not contend
+    worker_t *workers = malloc(args.workers * sizeof(worker_t));
+    int alloc_err = ENOMEM;
+    if (workers != NULL) {
+        alloc_err = posix_memalign((void **) &metrics, __alignof__(metrics_t), args.workers * sizeof(metrics_t));
+    }
+    if (alloc_err != 0) {
+        errno = alloc_err;
+        perror("Failed to allocate memory");
+        free(workers);
+        release_globals(signal_fd);
+        return EXIT_FAILURE;
+    }
+
+    memset(metrics, 0, args.workers * sizeof(metrics_t));
+    metrics_ln = args.workers;
+
+    long started = 0;
+    int exit_code = EXIT_SUCCESS;
+    for (; started < args.workers; started++) {
+        workers[started].metrics = &metrics[started];
+        workers[started].log = access_log != NULL ? accesslog_ring(access_log, started) : NULL;
+        if (init_worker(&workers[started], &args) == -1) {
+            exit_code = EXIT_FAILURE;
+            break;
+        }
+
+        int err_code = pthread_create(&workers[started].thread, NULL, args.uring ? worker_run_uring : worker_run,
+                                      &workers[started]);
+        if (err_code != 0) {
+            errno = err_code;
+            perror("Failed to start worker");
+            close_worker(&workers[started]);
+            exit_code = EXIT_FAILURE;
+            break;
+        }
+    }
+
+    // The main thread doubles as timer, which refreshes the cached Date at the start of every second, and applies
+    // file changes to the caches
+    struct pollfd fds[3] = {
+        { .fd = signal_fd, .events = POLLIN },
+        { .fd = cache != NULL ? cache_event_fd(cache) : -1, .events = POLLIN },
+        { .fd = fdcache != NULL ? fdcache_event_fd(fdcache) : -1, .events = POLLIN }
+    };
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    time_t updated = now.tv_sec;
+    while (exit_code == EXIT_SUCCESS) {
+        // Round up, so the timer does not fire just before the second boundary
+        int timeout = (int) ((1000000000 - now.tv_nsec + 999999) / 1000000);
+        int ready = poll(fds, 3, timeout);
+        if (ready == -1 && errno != EINTR) {
+            perror("Failed to wait for events");
+        } else if (ready > 0 && (fds[0].revents & POLLIN)) {
+            break;
+        } else if (ready > 0) {
+            if (fds[1].revents & POLLIN) {
+                cache_handle_events(cache);
+            }
+            if (fds[2].revents & POLLIN) {
+                fdcache_handle_events(fdcache);
+            }
+        }
+
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (now.tv_sec != updated) {
+            updated = now.tv_sec;
+            if (http_date_update() == -1) {
+                perror("Failed to update date");
+            }
+        }
+    }
+
+    uint64_t stop = 1;
+    if (write(stop_event, &stop, sizeof(stop)) == -1) {
+        perror("Failed to stop workers");
+    }
+
+    // Pending file jobs still signal the completion queues of the workers
+    for (long i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    if (offload != NULL) {
+        offload_destroy(offload);
+        offload = NULL;
+    }
+    for (long i = 0; i < started; i++) {
+        close_worker(&workers[i]);
+    }
+
+    free(workers);
+    release_globals(signal_fd);
+    return exit_code;
+}
@@ -0,0 +1,330 @@
+/**
+ * @file uring.c
+ *
+ * @brief Minimal io_uring interface
+ *
+ * @details Sets up an io_uring instance with io_uring_setup and maps its queues, so requests can be queued without
+ * system calls and submitted together with waiting for completions in a single io_uring_enter call. Only the few
+ * request types needed by the server are supported.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define URING_SUPPORTED 1
+#endif
+#endif
+
+#ifdef URING_SUPPORTED
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/**
+ * @brief Wrapper of the io_uring_enter system call
+ */
+static int uring_enter(uring_t *ring, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg,
+                       size_t arg_size) {
+    return (int) syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+int uring_init(uring_t *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd == -1) {
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG) ||
+        !(params.features & IORING_FEAT_NODROP)) {
+        close(ring->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    // Both rings share a single mapping
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sq_ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        int err_code = errno;
+        close(ring->fd);
+        errno = err_code;
+        return -1;
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        int err_code = errno;
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        errno = err_code;
+        return -1;
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring->sq_mask = *(unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (unsigned *) (sq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (sq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *) (sq + params.cq_off.ring_mask);
+    ring->cqes = sq + params.cq_off.cqes;
+    ring->pending = 0;
+    return 0;
+}
+
+void uring_destroy(uring_t *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+/**
+ * @brief Submits all queued requests without waiting
+ * @param ring ring to submit on
+ * @return 0 on success, -1 on failure
+ */
+static int uring_submit(uring_t *ring) {
+    while (ring->pending > 0) {
+        int submitted = uring_enter(ring, ring->pending, 0, 0, NULL, 0);
+        if (submitted == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        ring->pending -= submitted;
+    }
+    return 0;
+}
+
+/**
+ * @brief Returns a cleared submission queue entry
+ * @details The entry is queued right away, it is submitted with the next uring_wait. If the submission queue is full,
+ * it is submitted first.
+ * @param ring ring to take the entry from
+ * @return entry to fill, NULL on failure
+ */
+static struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+    unsigned tail = *ring->sq_tail;
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries) {
+        if (uring_submit(ring) == -1) {
+            return NULL;
+        }
+    }
+
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &((struct io_uring_sqe *) ring->sqes)[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+    return sqe;
+}
+
+int uring_recv(uring_t *ring, int fd, void *buf, size_t ln, void *data) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = (unsigned) ln;
+    sqe->user_data = (uintptr_t) data;
+    return 0;
+}
+
+int uring_poll(uring_t *ring, int fd, short events, void *data) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = (unsigned short) events;
+    sqe->user_data = (uintptr_t) data;
+    return 0;
+}
+
+int uring_accept(uring_t *ring, int fd, int flags, int multishot, void *data) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->accept_flags = (unsigned) flags;
+    sqe->ioprio = multishot ? IORING_ACCEPT_MULTISHOT : 0;
+    sqe->user_data = (uintptr_t) data;
+    return 0;
+}
+
+int uring_sendmsg(uring_t *ring, int fd, const struct msghdr *msg, int flags, void *data) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) msg;
+    sqe->len = 1;
+    sqe->msg_flags = (unsigned) flags;
+    sqe->user_data = (uintptr_t) data;
+    return 0;
+}
+
+int uring_openat2(uring_t *ring, int dirfd, const char *path, const uring_open_how_t *how, void *data) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_OPENAT2;
+    sqe->fd = dirfd;
+    sqe->addr = (uintptr_t) path;
+    sqe->len = sizeof(*how);
+    sqe->off = (uintptr_t) how;
+    sqe->user_data = (uintptr_t) data;
+    return 0;
+}
+
+int uring_statx(uring_t *ring, int dirfd, const char *path, int flags, unsigned mask, struct statx *buf, void *data) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = dirfd;
+    sqe->addr = (uintptr_t) path;
+    sqe->len = mask;
+    sqe->off = (uintptr_t) buf;
+    sqe->statx_flags = (unsigned) flags;
+    sqe->user_data = (uintptr_t) data;
+    return 0;
+}
+
+int uring_cancel(uring_t *ring, void *data) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t) data;
+    sqe->user_data = 0;
+    return 0;
+}
+
+int uring_wait(uring_t *ring, int timeout) {
+    if (*ring->cq_head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return uring_submit(ring);
+    }
+
+    struct __kernel_timespec ts = { .tv_sec = timeout / 1000, .tv_nsec = (timeout % 1000) * 1000000L };
+    struct io_uring_getevents_arg arg = { .sigmask = 0, .sigmask_sz = _NSIG / 8, .ts = (uintptr_t) &ts };
+    unsigned flags = IORING_ENTER_GETEVENTS | (timeout >= 0 ? IORING_ENTER_EXT_ARG : 0);
+    int submitted = timeout >= 0 ? uring_enter(ring, ring->pending, 1, flags, &arg, sizeof(arg))
+                                 : uring_enter(ring, ring->pending, 1, flags, NULL, _NSIG / 8);
+    if (submitted == -1) {
+        return errno == ETIME ? 0 : -1;
+    }
+    ring->pending -= submitted;
+    return 0;
+}
+
+int uring_next(uring_t *ring, uring_cqe_t *cqe) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    struct io_uring_cqe *next = &((struct io_uring_cqe *) ring->cqes)[head & ring->cq_mask];
+    cqe->data = (void *) (uintptr_t) next->user_data;
+    cqe->res = next->res;
+    cqe->more = (next->flags & IORING_CQE_F_MORE) != 0;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+#else
+
+int uring_init(uring_t *ring, unsigned entries) {
+    (void) ring;
+    (void) entries;
+    errno = ENOSYS;
+    return -1;
+}
+
+void uring_destroy(uring_t *ring) {
+    (void) ring;
+}
+
+int uring_recv(uring_t *ring, int fd, void *buf, size_t ln, void *data) {
+    (void) ring, (void) fd, (void) buf, (void) ln, (void) data;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_poll(uring_t *ring, int fd, short events, void *data) {
+    (void) ring, (void) fd, (void) events, (void) data;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_accept(uring_t *ring, int fd, int flags, int multishot, void *data) {
+    (void) ring, (void) fd, (void) flags, (void) multishot, (void) data;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_sendmsg(uring_t *ring, int fd, const struct msghdr *msg, int flags, void *data) {
+    (void) ring, (void) fd, (void) msg, (void) flags, (void) data;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_openat2(uring_t *ring, int dirfd, const char *path, const uring_open_how_t *how, void *data) {
+    (void) ring, (void) dirfd, (void) path, (void) how, (void) data;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_statx(uring_t *ring, int dirfd, const char *path, int flags, unsigned mask, struct statx *buf, void *data) {
+    (void) ring, (void) dirfd, (void) path, (void) flags, (void) mask, (void) buf, (void) data;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_cancel(uring_t *ring, void *data) {
+    (void) ring, (void) data;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_wait(uring_t *ring, int timeout) {
+    (void) ring, (void) timeout;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_next(uring_t *ring, uring_cqe_t *cqe) {
+    (void) ring, (void) cqe;
+    return 0;
+}
+
+#endif
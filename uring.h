@@ -0,0 +1,166 @@
+#ifndef UE3_URING_H
+#define UE3_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct msghdr;
+struct statx;
+
+/**
+ * Struct representing an io_uring instance, driven with raw system calls
+ * Only the submitting thread may use a ring. Requests are identified by a user pointer which is returned with their
+ * completion. If the kernel headers lack io_uring, uring_init always fails with ENOSYS.
+ */
+typedef struct {
+    int fd;
+    void *sq_ring; // mapping of both rings
+    size_t sq_ring_size;
+    void *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    void *cqes;
+    unsigned pending; // prepared requests which have not been submitted yet
+} uring_t;
+
+/**
+ * Struct representing a completed request
+ */
+typedef struct {
+    void *data; // user pointer of the request
+    int res; // result of the request, a negative errno on failure
+    int more; // a multishot request stays armed and posts further completions
+} uring_cqe_t;
+
+/**
+ * Struct representing the parameters of an openat2 request, same layout as struct open_how
+ */
+typedef struct {
+    uint64_t flags; // open flags, e.g. O_RDONLY
+    uint64_t mode; // mode of created files
+    uint64_t resolve; // path resolution flags, e.g. RESOLVE_BENEATH
+} uring_open_how_t;
+
+/**
+ * @brief Creates an io_uring instance
+ * @param ring ring to initialize
+ * @param entries number of submission queue entries, rounded up to a power of two by the kernel
+ * @return 0 on success, -1 on failure
+ */
+int uring_init(uring_t *ring, unsigned entries);
+
+/**
+ * @brief Destroys an io_uring instance
+ * @details Requests still in flight are cancelled by the kernel.
+ * @param ring ring to destroy
+ */
+void uring_destroy(uring_t *ring);
+
+/**
+ * @brief Queues a receive on a socket
+ * @param ring ring to queue on
+ * @param fd socket to receive from
+ * @param buf buffer to receive into, has to stay valid until the completion
+ * @param ln size of buf
+ * @param data user pointer of the request
+ * @return 0 on success, -1 on failure
+ */
+int uring_recv(uring_t *ring, int fd, void *buf, size_t ln, void *data);
+
+/**
+ * @brief Queues a one-shot poll of a file descriptor
+ * @details The completion reports the ready events as result.
+ * @param ring ring to queue on
+ * @param fd file descriptor to poll
+ * @param events poll events to wait for, e.g. POLLIN
+ * @param data user pointer of the request
+ * @return 0 on success, -1 on failure
+ */
+int uring_poll(uring_t *ring, int fd, short events, void *data);
+
+/**
+ * @brief Queues accepting connections on a listening socket
+ * @details The accepted socket is returned as result, it is created with flags. A multishot accept posts a completion
+ * for every connection until it is cancelled or fails; its completion without more set ends it.
+ * @param ring ring to queue on
+ * @param fd listening socket
+ * @param flags socket flags of accepted connections, e.g. SOCK_NONBLOCK
+ * @param multishot whether to keep accepting after the first connection
+ * @param data user pointer of the request
+ * @return 0 on success, -1 on failure
+ */
+int uring_accept(uring_t *ring, int fd, int flags, int multishot, void *data);
+
+/**
+ * @brief Queues sending a message on a socket
+ * @details The number of bytes sent is returned as result.
+ * @param ring ring to queue on
+ * @param fd socket to send on
+ * @param msg message to send, it and the buffers it references have to stay valid until the completion
+ * @param flags send flags, e.g. MSG_NOSIGNAL
+ * @param data user pointer of the request
+ * @return 0 on success, -1 on failure
+ */
+int uring_sendmsg(uring_t *ring, int fd, const struct msghdr *msg, int flags, void *data);
+
+/**
+ * @brief Queues opening a file with openat2
+ * @details The opened file descriptor is returned as result.
+ * @param ring ring to queue on
+ * @param dirfd directory path is resolved relative to
+ * @param path path to open, has to stay valid until the completion
+ * @param how parameters of the open, has to stay valid until the completion
+ * @param data user pointer of the request
+ * @return 0 on success, -1 on failure
+ */
+int uring_openat2(uring_t *ring, int dirfd, const char *path, const uring_open_how_t *how, void *data);
+
+/**
+ * @brief Queues determining the status of a file with statx
+ * @param ring ring to queue on
+ * @param dirfd directory path is resolved relative to, or the file itself with AT_EMPTY_PATH
+ * @param path path of the file, has to stay valid until the completion
+ * @param flags statx flags, e.g. AT_EMPTY_PATH
+ * @param mask fields to determine, e.g. STATX_BASIC_STATS
+ * @param buf status will be written here, has to stay valid until the completion
+ * @param data user pointer of the request
+ * @return 0 on success, -1 on failure
+ */
+int uring_statx(uring_t *ring, int dirfd, const char *path, int flags, unsigned mask, struct statx *buf, void *data);
+
+/**
+ * @brief Queues the cancellation of a request
+ * @details The cancelled request completes with -ECANCELED unless it completed already. The cancellation itself
+ * completes with a NULL user pointer.
+ * @param ring ring to queue on
+ * @param data user pointer of the request to cancel
+ * @return 0 on success, -1 on failure
+ */
+int uring_cancel(uring_t *ring, void *data);
+
+/**
+ * @brief Submits queued requests and waits for a completion
+ * @details Submitting and waiting are done with a single system call. Returns early if a completion is available
+ * already.
+ * @param ring ring to submit on
+ * @param timeout milliseconds to wait at most, -1 to wait indefinitely
+ * @return 0 on success or timeout, -1 on failure
+ */
+int uring_wait(uring_t *ring, int timeout);
+
+/**
+ * @brief Takes the next completion
+ * @param ring ring to take from
+ * @param cqe completion will be written here
+ * @return 1 if a completion was taken, 0 if there is none
+ */
+int uring_next(uring_t *ring, uring_cqe_t *cqe);
+
+#endif //UE3_URING_H